@@ -1,150 +1,564 @@
 #include "svc.h"
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #define CAP_INIT 20  // The capacity to initialise arrays at.
 #define CAP_GROWTH 2  // The multiplicative factor to expand arrays by.
 #define NULL_ID 0xFFFFFFFF  // Represents a NULL value for index references.
+#define CAP_INIT_TABLE 64  // The capacity to initialise tables at.
+#define TABLE_TOMBSTONE ((char *)1)  // Key of table entries that were removed.
+#define MERGE_CONFLICT ((struct file *)1)  // Version picked for conflicting paths.
+#define ID_LENGTH 6  // Number of hexadecimal digits in a commit ID.
+#define TREE_FANOUT_BITS 5  // Tree nodes end after 1 in 2^5 names on average.
+#define TREE_FANOUT (1 << TREE_FANOUT_BITS)
+#define TREE_MAX_ENTRIES 128  // A tree node is ended early if it grows this large.
+#define BLOOM_BITS_PER_PATH 10  // Bloom filter bits for each changed path.
+#define BLOOM_HASHES 7  // Bits set in a Bloom filter for each changed path.
+#define BLOOM_MAX_PATHS 512  // Commits changing more paths have no filter.
+#define ALLOC_ALIGN 16  // Alignment and size granularity of allocations.
+#define ALLOC_SMALL_MAX 128  // Largest allocation rounded to ALLOC_ALIGN only.
+#define ALLOC_CLASS_MAX 32768  // Largest allocation with its own size class.
+#define SCRATCH_RESERVE ((size_t)1 << 36)  // Address space for temporary data.
+#define SCRATCH_KEEP ((size_t)1 << 20)  // Scratch bytes kept mapped after a reset.
+
+#define REPO_PATH "svc_db/repo"  // File holding commits, branches and index.
+#define REPO_MAGIC 0x31435653  // "SVC1" in little endian byte order.
+#define REPO_VERSION 11  // Incremented whenever the repository layout changes.
+#define REPO_BASE ((void *)0x5c0000000000)  // Fixed address of the repository.
+#define REPO_RESERVE ((size_t)1 << 40)  // Address space reserved for it.
+
+#define CHUNK_DIR "svc_db/chunks"  // Directory storing deduplicated chunks.
+#define CHUNK_MIN 2048  // Minimum chunk size, the rolling hash skips these bytes.
+#define CHUNK_MAX 65536  // Maximum chunk size before a boundary is forced.
+#define CHUNK_MASK (0x1FFFULL << 51)  // Boundary mask for ~8 KiB of hashing.
+#define MANIFEST_MAGIC 0x4d435653  // "SVCM" in little endian byte order.
+#define PACK_DIR "svc_db/packs"  // Directory storing packs and their indexes.
+#define PACK_MAGIC 0x50435653  // "SVCP" in little endian byte order.
+#define PACK_ALIGN 8  // Alignment of each object's offset in a pack.
+#define LZ_HASH_BITS 13  // Size of the match finder's table of positions.
+#define LZ_MIN_MATCH 4  // Shortest match, the length of the hashed sequences.
+#define LZ_MAX_OFFSET 65535  // Furthest match, the largest 16-bit offset.
+#define LZ_SKIP_SHIFT 5  // Positions without a match before the step grows.
+#define LZ_MIN_SAVING 8  // Chunks are stored raw unless 1/8 smaller compressed.
+#define DELTA_MAX_DEPTH 10  // Most deltas decoded to rebuild a packed object.
+#define DELTA_MIN_MATCH 8  // Shortest copy from a delta base, the hashed length.
+#define DELTA_HASH_BITS 16  // Size of the table of delta base positions.
+#define DELTA_MIN_SAVING 4  // Deltas must be 1/4 smaller than the stored object.
+#define DIFF_CONTEXT 3  // Unchanged lines printed around each change.
+#define DIFF_MYERS_LINES 2048  // Ranges this small are diffed with Myers directly.
+#define DIFF_MAX_COST ((size_t)1 << 24)  // Myers steps before a large range gives up.
+#define DIFF_MAX_DEPTH 64  // Nested patience splits before a range uses Myers.
+#define DIFF_BINARY_PROBE 8000  // Leading bytes searched for a NUL in binary files.
+#define DIFF_CHUNKED_SIZE ((size_t)1 << 20)  // Larger ranges are first matched by chunk.
+
+#define HASH_STRIPE 64  // Bytes consumed by each step of the content hash.
+#define HASH_STRIPES 16  // Stripes per block before the accumulators scramble.
+#define HASH_BLOCK (HASH_STRIPE * HASH_STRIPES)
+#define HASH_SECRET_SIZE 192  // Bytes of secret mixed into the hash.
+#define HASH_INVALID ((uint64_t)-3)  // Hashes from here up are error codes.
+#define HASH_DEFERRED ((uint64_t)-3)  // Marks files left for segment hashing.
+#define HASH_SEGMENT ((size_t)1 << 24)  // Files are hashed in parallel by segment.
+#define DIRENT_BUFFER 32768  // Size of the buffer for reading directory entries.
+#define URING_DEPTH 256  // Entries in the io_uring submission ring.
+#define URING_BATCH 64  // Files handled together in each io_uring stage.
+#define HASH_PRIME32_1 0x9E3779B1U
+#define HASH_PRIME32_2 0x85EBCA77U
+#define HASH_PRIME32_3 0xC2B2AE3DU
+#define HASH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME64_3 0x165667B19E3779F9ULL
+#define HASH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME64_5 0x27D4EB2F165667C5ULL
 
 /**
-* Initialises three pages in virtual memory using mmap() for the helper data
-* structure, the stdout buffer and a region to store all dynamic memory
-* allocations used by the program. All mmap() calls are private file mappings
-* initialised from /dev/zero, a stream of zero values.
+* Opens the repository file and maps it into virtual memory. The repository
+* file holds the helper data structure in its first page followed by every
+* allocation made through allocate(), so commits, branches and the index all
+* persist on disk. The file only grows, and freed blocks are reused.
 *
-* @return The Data structure to pass program data between functions.
+* The file is not an append-only log. The helper, the index and the arrays
+* are updated in place through the shared mapping, which is not synced, so a
+* crash during an operation can leave the repository inconsistent. The file
+* is locked while it is open, so only one process uses a repository at once.
+*
+* All pointers stored in the repository are absolute addresses, so the file
+* is always mapped at REPO_BASE. This allows an existing repository to be
+* reopened by mapping it, without parsing or copying any of its contents.
+* A stdout buffer and the list of memory objects are mapped privately from
+* /dev/zero, a stream of zero values, as they do not need to persist.
+*
+* @return The Data structure to pass program data between functions. NULL if
+*         the repository file could not be opened, is invalid, or is in use
+*         by another process.
 */
 struct helper *memory_init(void) {
-    // Allocate the helper data structure
-    int fd = open("/dev/zero", O_RDWR); //
-    struct helper *svc = mmap(NULL, sysconf(_SC_PAGE_SIZE),
-                              PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-    svc->page_size = sysconf(_SC_PAGE_SIZE);
+    size_t page_size = sysconf(_SC_PAGE_SIZE);
+    hash_init();
+
+    // Reserve the address range used by the repository so that it can grow
+    // in place. The reservation must be at REPO_BASE for pointers to be valid.
+    void *base = mmap(REPO_BASE, REPO_RESERVE, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
+                      | MAP_FIXED_NOREPLACE, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    if (base != REPO_BASE) {
+        munmap(base, REPO_RESERVE);
+        return NULL;
+    }
+
+    // Open the repository file, creating it with a single page for the
+    // helper if it does not exist yet.
+    int heap_fd = open(REPO_PATH, O_RDWR | O_CREAT, 0666);
+    if (heap_fd == -1) {
+        munmap(base, REPO_RESERVE);
+        return NULL;
+    }
+    struct stat sb;
+    if (flock(heap_fd, LOCK_EX | LOCK_NB) == -1 || fstat(heap_fd, &sb) == -1) {
+        close(heap_fd);
+        munmap(base, REPO_RESERVE);
+        return NULL;
+    }
+    int created = 0;
+    if (sb.st_size == 0) {
+        if (ftruncate(heap_fd, page_size) == -1) {
+            close(heap_fd);
+            munmap(base, REPO_RESERVE);
+            return NULL;
+        }
+        sb.st_size = page_size;
+        created = 1;
+    }
+
+    // Map the whole repository file over the start of the reservation
+    size_t heap_pages = sb.st_size / page_size;
+    struct helper *svc = mmap(base, heap_pages * page_size,
+                              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                              heap_fd, 0);
+    if (svc == MAP_FAILED) {
+        close(heap_fd);
+        munmap(base, REPO_RESERVE);
+        return NULL;
+    }
+    if (created) {
+        svc->magic = REPO_MAGIC;
+        svc->version = REPO_VERSION;
+        svc->base = base;
+        svc->heap_used = page_size;
+        svc->head = NULL_ID;
+    } else if (svc->magic != REPO_MAGIC || svc->version != REPO_VERSION
+               || svc->base != base) {
+        close(heap_fd);
+        munmap(base, REPO_RESERVE);
+        return NULL;
+    }
+    svc->heap_pages = heap_pages;
+    svc->page_size = page_size;
+    svc->heap_fd = heap_fd;
+    svc->n_threads = 0;
+    svc->pool = NULL;
+    svc->link_objects = 0;
+    svc->use_uring = 1;
+    svc->uring_unavailable = 0;
+    svc->clone_unsupported = 0;
+    svc->copy_range_unsupported = 0;
+    svc->ring = NULL;
+    svc->packs = NULL;
+    svc->n_packs = 0;
+    svc->packs_cap = 0;
+    svc->packs_loaded = 0;
+    svc->delta_cache = NULL;
 
     // Map a page of memory for the stdout buffer and store the pointer
+    int fd = open("/dev/zero", O_RDWR);
     char *buf = mmap(NULL, svc->page_size,
                      PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
     setvbuf(stdout, buf, _IOFBF, svc->page_size);
     svc->stdout_buffer = buf;
 
-    // Initialise mapped memory to store a list of memory objects
+    // Initialise mapped memory to store a list of memory objects. The whole
+    // repository file becomes the first memory region, with allocations
+    // continuing from the end of the used bytes.
     svc->mem_list = (struct memory *)mmap(NULL, svc->page_size,
                     PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
     close(fd);
+    struct memory file_mem = {base, heap_pages};
+    svc->mem_list[0] = file_mem;
+    svc->n_mem = 1;
+    svc->mem_cap = svc->page_size / sizeof(struct memory);
+
+    // Reserve address space for the scratch arena, where pages are only
+    // backed by memory once they are used
+    svc->scratch = mmap(NULL, SCRATCH_RESERVE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    svc->scratch_used = 0;
     return svc;
 }
 
 /**
-* Adds a new memory region to the memory list to use as the new active region,
-
+* Adds a new memory region to the memory list, extending the repository file
+* and mapping the new pages directly after the previous region. The memory
+* list is doubled in size when it is full.
+*
 * @param helper Data structure to pass program data between functions.
 * @param n_pages Number of pages of memory to allocate.
-* @return A pointer to the allocated memory.
+* @return A pointer to the new pages, or NULL if the file cannot be extended
+*         or the pages cannot be mapped.
 */
 void *memory_add(void *helper, size_t n_pages) {
     struct helper *svc = (struct helper *)helper;
-    int fd = open("/dev/zero", O_RDWR);
-    void *addr = mmap(NULL, n_pages*svc->page_size,
-                     PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-    close(fd);
+    size_t file_offset = svc->heap_pages * svc->page_size;
+    if (ftruncate(svc->heap_fd, file_offset + n_pages*svc->page_size) == -1) {
+        return NULL;
+    }
+    void *addr = mmap(svc->base + file_offset, n_pages*svc->page_size,
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                      svc->heap_fd, file_offset);
+    if (addr == MAP_FAILED) {
+        ftruncate(svc->heap_fd, file_offset);
+        return NULL;
+    }
+    svc->heap_pages += n_pages;
+
+    // The new pages directly follow the last region, so it is extended
+    // rather than adding a region to the memory list
+    struct memory *last = svc->mem_list + svc->n_mem - 1;
+    if (svc->n_mem > 0 && last->ptr + last->n_pages*svc->page_size == addr) {
+        last->n_pages += n_pages;
+        return addr;
+    }
+    if (svc->n_mem == svc->mem_cap) {
+        size_t old_size = svc->mem_cap * sizeof(struct memory);
+        svc->mem_list = mremap(svc->mem_list, old_size, old_size * CAP_GROWTH, MREMAP_MAYMOVE);
+        svc->mem_cap *= CAP_GROWTH;
+    }
     struct memory new_mem = {addr, n_pages};
     svc->mem_list[svc->n_mem] = new_mem;
     svc->n_mem++;
-    svc->offset = 0;
     return addr;
 }
 
 /**
-* Allocates a specified number of bytes from the memory page for use by the
-* program. Memory is allocated sequentially such that each new allocation
-* is placed directly after the previous in memory.
+* Returns the size of the block used for an allocation. Small allocations
+* are rounded up to a multiple of ALLOC_ALIGN, then to a power of two, and
+* allocations larger than every size class are rounded up to whole pages.
 *
 * @param helper Data structure to pass program data between functions.
 * @param n Number of bytes for the allocation.
-* @return A pointer to the allocated memory.
+* @return The size of the block in bytes.
 */
-void *allocate(void *helper, size_t n) {
+size_t alloc_block_size(void *helper, size_t n) {
     struct helper *svc = (struct helper *)helper;
+    if (n <= ALLOC_SMALL_MAX) {
+        return n == 0 ? ALLOC_ALIGN : (n + ALLOC_ALIGN - 1) & ~(size_t)(ALLOC_ALIGN - 1);
+    }
+    if (n <= ALLOC_CLASS_MAX) {
+        return (size_t)1 << (64 - __builtin_clzll(n - 1));
+    }
+    return (n + svc->page_size - 1) / svc->page_size * svc->page_size;
+}
 
-    // Get the memory object corresponding to the currently used memory region.
-    struct memory curr;
-    if (svc->n_mem == 0) {
-        struct memory temp = {NULL, 0};
-        curr = temp;
-    } else {
-        curr = svc->mem_list[svc->n_mem - 1];
+/**
+* Returns the size class of a block, given the block size.
+*
+* @param size The size of the block in bytes.
+* @return The size class, or ALLOC_CLASSES if the block is larger than every
+*         size class.
+*/
+size_t alloc_class(size_t size) {
+    if (size <= ALLOC_SMALL_MAX) {
+        return size / ALLOC_ALIGN - 1;
+    }
+    if (size <= ALLOC_CLASS_MAX) {
+        return 63 - __builtin_clzll(size);
+    }
+    return ALLOC_CLASSES;
+}
+
+/**
+* Puts a block on the free list for its size. Blocks of a size between the
+* size classes are split into blocks of the sizes of classes.
+*
+* @param helper Data structure to pass program data between functions.
+* @param ptr The block.
+* @param size The size of the block, which is a multiple of ALLOC_ALIGN.
+*/
+void free_block_push(void *helper, void *ptr, size_t size) {
+    struct helper *svc = (struct helper *)helper;
+    svc->alloc_stats.free += size;
+    if (size > ALLOC_CLASS_MAX) {
+        struct free_block *block = (struct free_block *)ptr;
+        block->next = svc->large_free;
+        block->size = size;
+        svc->large_free = block;
+        return;
+    }
+    // Split off the largest power of two that fits until the rest of the
+    // block is a size class itself
+    while (alloc_block_size(helper, size) != size) {
+        size_t part = (size_t)1 << (63 - __builtin_clzll(size));
+        struct free_block *block = (struct free_block *)(ptr + size - part);
+        size_t c = alloc_class(part);
+        block->next = svc->free_lists[c];
+        svc->free_lists[c] = block;
+        size -= part;
+    }
+    struct free_block *block = (struct free_block *)ptr;
+    size_t c = alloc_class(size);
+    block->next = svc->free_lists[c];
+    svc->free_lists[c] = block;
+}
+
+/**
+* Takes a free block of a given size from the free lists. Large blocks are
+* found by searching for the first block that is large enough, and the rest
+* of the block is put back on the free lists.
+*
+* @param helper Data structure to pass program data between functions.
+* @param size The size of the block, as returned by alloc_block_size().
+* @return A pointer to the block, or NULL if there is no free block.
+*/
+void *free_block_pop(void *helper, size_t size) {
+    struct helper *svc = (struct helper *)helper;
+    size_t c = alloc_class(size);
+    if (c < ALLOC_CLASSES) {
+        struct free_block *block = svc->free_lists[c];
+        if (block != NULL) {
+            svc->free_lists[c] = block->next;
+            svc->alloc_stats.free -= size;
+        }
+        return block;
     }
+    struct free_block **prev = &svc->large_free;
+    for (struct free_block *block = *prev; block != NULL; block = *prev) {
+        if (block->size >= size) {
+            *prev = block->next;
+            svc->alloc_stats.free -= block->size;
+            if (block->size > size) {
+                free_block_push(helper, (void *)block + size, block->size - size);
+            }
+            return block;
+        }
+        prev = &block->next;
+    }
+    return NULL;
+}
 
-    // Calculate the overflow past the end of the mapped memory region that the
-    // allocation will cause. Begin a new memory region if overflow will occur.
-    int overflow = (svc->offset + n) - (curr.n_pages * svc->page_size);
-    if (overflow >= 0) {
-        size_t n_new_pages = (size_t)(overflow / svc->page_size) + 1;
-        void *new_addr = memory_add(helper, n_new_pages);
-        svc->offset += n;
-        return new_addr;
+/**
+* Takes a block from the top of the heap, extending the repository file if
+* the block does not fit in the mapped pages.
+*
+* @param helper Data structure to pass program data between functions.
+* @param size The size of the block in bytes.
+* @return A pointer to the block, or NULL if the file cannot be extended.
+*/
+void *alloc_top(void *helper, size_t size) {
+    struct helper *svc = (struct helper *)helper;
+    size_t end = svc->heap_used + size;
+    if (end > svc->heap_pages * svc->page_size) {
+        size_t n_new_pages = (end - svc->heap_pages * svc->page_size
+                              + svc->page_size - 1) / svc->page_size;
+        if (memory_add(helper, n_new_pages) == NULL) {
+            return NULL;
+        }
     }
+    void *addr = svc->base + svc->heap_used;
+    svc->heap_used = end;
+    return addr;
+}
 
-    // Return the address of the memory allocation
-    void *addr = curr.ptr + svc->offset;
-    svc->offset += n;
+/**
+* Allocates a specified number of bytes from the repository heap. The block
+* is taken from the free list of its size class if one has been freed,
+* otherwise from the top of the heap. Every block is aligned to ALLOC_ALIGN.
+*
+* @param helper Data structure to pass program data between functions.
+* @param n Number of bytes for the allocation.
+* @return A pointer to the allocated memory, or NULL if the repository file
+*         cannot be extended.
+*/
+void *allocate(void *helper, size_t n) {
+    struct helper *svc = (struct helper *)helper;
+    size_t size = alloc_block_size(helper, n);
+    void *addr = free_block_pop(helper, size);
+    if (addr == NULL) {
+        addr = alloc_top(helper, size);
+    }
+    if (addr == NULL) {
+        return NULL;
+    }
+    svc->alloc_stats.used += n;
+    svc->alloc_stats.padding += size - n;
     return addr;
 }
 
 /**
-* Resizes an allocation made by allocate().
+* Frees an allocation made by allocate(). A block at the top of the heap is
+* returned to the top, and any other block is put on a free list.
+*
+* @param helper Data structure to pass program data between functions.
+* @param ptr The allocation, which may be NULL.
+* @param n Number of bytes the allocation was made with.
+*/
+void deallocate(void *helper, void *ptr, size_t n) {
+    struct helper *svc = (struct helper *)helper;
+    if (ptr == NULL) {
+        return;
+    }
+    size_t size = alloc_block_size(helper, n);
+    svc->alloc_stats.used -= n;
+    svc->alloc_stats.padding -= size - n;
+    if (ptr + size == svc->base + svc->heap_used) {
+        svc->heap_used -= size;
+        return;
+    }
+    free_block_push(helper, ptr, size);
+}
+
+/**
+* Resizes an allocation made by allocate(). An allocation at the top of the
+* heap is resized in place, otherwise its contents are moved to a new block
+* and the old block is freed.
 *
 * @param helper Data structure to pass program data between functions.
-* @param old_n Number of bytes to copy from the old allocation to the new.
+* @param ptr The allocation, which may be NULL.
+* @param old_n Number of bytes the allocation was made with.
 * @param n Number of bytes for the new allocation.
 * @return A pointer to the allocated memory.
 */
 void *reallocate(void *helper, void *ptr, size_t old_n, size_t n) {
+    struct helper *svc = (struct helper *)helper;
+    if (ptr == NULL) {
+        return allocate(helper, n);
+    }
+    size_t old_size = alloc_block_size(helper, old_n);
+    size_t size = alloc_block_size(helper, n);
+    if (old_size == size || ptr + old_size == svc->base + svc->heap_used) {
+        if (size > old_size) {
+            if (alloc_top(helper, size - old_size) == NULL) {
+                return NULL;
+            }
+        } else {
+            svc->heap_used -= old_size - size;
+        }
+        svc->alloc_stats.used += n - old_n;
+        svc->alloc_stats.padding += (size - n) - (old_size - old_n);
+        return ptr;
+    }
     void *addr = allocate(helper, n);
-    memcpy(addr, ptr, old_n);
+    if (addr == NULL) {
+        return NULL;
+    }
+    memcpy(addr, ptr, old_n < n ? old_n : n);
+    deallocate(helper, ptr, old_n);
     return addr;
 }
 
 /**
-* Initialises the helper data structure used to pass program data across
-* different function calls. Also creates the initial master branch and the
-* database directory for storing file versions.
+* Allocates temporary memory from the scratch arena. Scratch memory is not
+* stored in the repository and is released when the public API call that
+* allocated it returns.
+*
+* @param helper Data structure to pass program data between functions.
+* @param n Number of bytes for the allocation.
+* @return A pointer to the allocated memory.
+*/
+void *scratch_alloc(void *helper, size_t n) {
+    struct helper *svc = (struct helper *)helper;
+    void *addr = svc->scratch + svc->scratch_used;
+    svc->scratch_used += (n + ALLOC_ALIGN - 1) & ~(size_t)(ALLOC_ALIGN - 1);
+    return addr;
+}
+
+/**
+* Returns the position of the top of the scratch arena, which is passed to
+* scratch_release() to free everything allocated after it.
 *
-* @return A pointer to helper object.
+* @param helper Data structure to pass program data between functions.
+* @return The number of bytes in use in the scratch arena.
 */
-void *svc_init(void) {
-    struct helper *svc = memory_init();
+size_t scratch_mark(void *helper) {
+    struct helper *svc = (struct helper *)helper;
+    return svc->scratch_used;
+}
 
-    // Create the master branch
-    svc->head = NULL_ID;
-    svc_branch(svc, "master");
-    svc->head = 0; // Set the head to the master branch
+/**
+* Frees every scratch allocation made after a mark. If the arena has grown
+* past SCRATCH_KEEP bytes, the pages beyond it are returned to the system.
+*
+* @param helper Data structure to pass program data between functions.
+* @param mark The position returned by scratch_mark().
+*/
+void scratch_release(void *helper, size_t mark) {
+    struct helper *svc = (struct helper *)helper;
+    size_t keep = mark > SCRATCH_KEEP ? mark : SCRATCH_KEEP;
+    keep = (keep + svc->page_size - 1) / svc->page_size * svc->page_size;
+    if (svc->scratch_used > keep) {
+        madvise(svc->scratch + keep, svc->scratch_used - keep, MADV_DONTNEED);
+    }
+    svc->scratch_used = mark;
+}
 
+/**
+* Initialises the helper data structure used to pass program data across
+* different function calls. If a repository already exists in the database
+* directory it is reopened, otherwise the initial master branch is created.
+*
+* @return A pointer to helper object. NULL if the repository cannot be opened.
+*/
+void *svc_init(void) {
     // Create a database directory for file storage with read, write and
     // search permissions.
     mkdir("svc_db", S_IRWXU);
+    mkdir(CHUNK_DIR, S_IRWXU);
+    mkdir(PACK_DIR, S_IRWXU);
+
+    struct helper *svc = memory_init();
+    if (svc == NULL) {
+        return NULL;
+    }
+
+    // Create the master branch if this is a new repository
+    if (svc->n_branches == 0) {
+        svc->head = NULL_ID;
+        svc_branch(svc, "master");
+        svc->head = 0; // Set the head to the master branch
+    }
     return (void *)svc;
 }
 
 /**
-* Unmaps all the virtual memory regions allocated through mmap().
+* Unmaps all the virtual memory regions allocated through mmap(). The
+* repository file is a shared mapping, so its contents remain on disk.
 *
 * @param helper Data structure to pass program data between functions.
 */
 void cleanup(void *helper) {
     struct helper *svc = (struct helper *)helper;
 
-    // Free each of the mapped memory regions
-    for (int i=0; i<svc->n_mem; i++) {
-        struct memory *m = svc->mem_list + i;
-        munmap(m->ptr, m->n_pages * svc->page_size);
-    }
-    munmap(svc->mem_list, svc->page_size);
+    // Stop the thread pool, close the io_uring instance and unmap the packs
+    pool_destroy(helper);
+    uring_destroy(helper);
+    pack_unload(helper);
 
-    // Flush stdout and free the stdout buffer
+    // Free the list of memory objects and close the repository file
+    munmap(svc->mem_list, svc->mem_cap * sizeof(struct memory));
+    munmap(svc->scratch, SCRATCH_RESERVE);
+    close(svc->heap_fd);
+
+    // Flush stdout and free the stdout buffer, returning stdout to its own
+    // buffer so that it can still be used after cleanup.
     fflush(stdout);
+    setvbuf(stdout, NULL, _IONBF, 0);
     munmap(svc->stdout_buffer, sysconf(_SC_PAGE_SIZE));
 
-    // Free helper
-    munmap(svc, sysconf(_SC_PAGE_SIZE));
+    // Unmap the repository file along with the rest of the reserved address
+    // range. The helper is stored in the repository file so it is freed here.
+    munmap(svc->base, REPO_RESERVE);
 }
 
 /**
@@ -161,23 +575,6 @@ char *str_dup(void *helper, char *string) {
     return new_string;
 }
 
-/**
-* Uses allocate() to create a deep copy of an array of file objects.
-*
-* @param helper Data structure to pass program data between functions.
-* @param files The array of files to be copied.
-* @param n_files The length of the file array.
-* @return The copied list of files.
-*/
-struct file *files_dup(void *helper, struct file *files, size_t n_files) {
-    struct file *new_files = (struct file *)allocate(helper, n_files * sizeof(struct file));
-    for (size_t i=0; i<n_files; i++) {
-        struct file new_file = {files[i].hash, str_dup(helper, files[i].file_name)};
-        new_files[i] = new_file;
-    }
-    return new_files;
-}
-
 /**
 * Appends an element to an array. The array is reallocated if there is
 * insufficient space to add the new object.
@@ -195,8 +592,8 @@ void *array_add(void *helper, void *array, size_t *array_size, size_t *array_cap
         array = allocate(helper, CAP_INIT * n);
         *array_cap = CAP_INIT;
     } else if ((*array_size) + 1 >= *array_cap) {
+        array = reallocate(helper, array, (*array_cap)*n, (*array_cap)*CAP_GROWTH*n);
         (*array_cap) *= CAP_GROWTH;
-        array = reallocate(helper, array, (*array_size)*n, (*array_cap)*n);
     }
     // Add element to the array
     void *ptr = array + ((*array_size) * n);
@@ -206,467 +603,5797 @@ void *array_add(void *helper, void *array, size_t *array_size, size_t *array_cap
 }
 
 /**
-* Checks if a file exists.
+* Finds the entry for a key in a table, or the empty entry where the key
+* would be inserted. Entries are probed linearly from the key's hash, and the
+* stored hashes are compared before the keys themselves.
 *
-* @param file_path The specified file path.
-* @return 1 if the file exists, otherwise 0.
+* @param t The table, which must have a non-zero capacity.
+* @param key The key to find.
+* @param hash The hash of the key.
+* @return The entry holding the key, or the empty entry ending the probe.
 */
-int file_exists(char *file_path) {
-    struct stat buffer;
-    int exists = stat(file_path, &buffer);
-    if (exists == 0) {
-        return 1;
+struct table_entry *table_probe(struct table *t, char *key, uint64_t hash) {
+    size_t mask = t->cap - 1;
+    struct table_entry *tombstone = NULL;
+    for (size_t i=hash & mask; ; i=(i + 1) & mask) {
+        struct table_entry *e = t->entries + i;
+        if (e->key == NULL) {
+            return tombstone != NULL ? tombstone : e;
+        }
+        if (e->key == TABLE_TOMBSTONE) {
+            if (tombstone == NULL) {
+                tombstone = e;
+            }
+        } else if (e->hash == hash && strcmp(e->key, key) == 0) {
+            return e;
+        }
     }
-    return 0;
 }
 
 /**
-* Copies a file from one location to another in the filesystem.
+* Looks up the value stored for a key in a table.
 *
-* @param file_path The file path of the source file.
-* @param new_file_path The destination file path to place the copied file.
+* @param t The table.
+* @param key The key to look up.
+* @return The value for the key, or NULL_ID if the key is not in the table.
 */
-void file_copy(char *file_path, char *new_file_path) {
-    // Open the source file and get the file length
-    int src_fd = open(file_path, O_RDONLY);
-    size_t file_size = lseek(src_fd, 0, SEEK_END);
-
-    // Create the destination file with the same size as the source file
-    int dest_fd = open(new_file_path, O_RDWR | O_CREAT, 0666);
-    ftruncate(dest_fd, file_size);
-
-    // Map both files to the virtual address space
-    char *src = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, src_fd, 0);
-    char *dest = mmap(NULL, file_size, PROT_READ | PROT_WRITE,
-                      MAP_SHARED, dest_fd, 0);
-
-    // Copy the contents from source file to the destination file
-    memcpy(dest, src, file_size);
-
-    // Unmap the memory and close the files
-    munmap(src, file_size);
-    munmap(dest, file_size);
-    close(src_fd);
-    close(dest_fd);
+size_t table_get(struct table *t, char *key) {
+    if (t->cap == 0) {
+        return NULL_ID;
+    }
+    uint64_t hash = hash_bytes((unsigned char *)key, strlen(key));
+    size_t mask = t->cap - 1;
+    for (size_t i=hash & mask; ; i=(i + 1) & mask) {
+        struct table_entry *e = t->entries + i;
+        if (e->key == NULL) {
+            return NULL_ID;
+        }
+        if (e->key != TABLE_TOMBSTONE && e->hash == hash && strcmp(e->key, key) == 0) {
+            return e->value;
+        }
+    }
 }
 
 /**
-* Given an array of file objects, updates the database directory to contain
-* those files. All files are stored in the database as their hash to ensure
-* different file versions are distinguishable.
+* Stores a value for a key in a table, replacing any existing value. The key
+* string is not copied, so it must live as long as the table. The table is
+* doubled in size whenever it becomes more than half full.
 *
-* @param files The array of file objects to write to the database.
-* @param n_files The size of the file array.
+* @param helper Data structure to pass program data between functions.
+* @param t The table.
+* @param key The key to store.
+* @param value The value to store for the key.
 */
-void update_database(struct file *files, size_t n_files) {
-    for (size_t i=0; i<n_files; i++) {
-        // Convert the file hash into a string
-        char hash_string[18];
-        sprintf(hash_string, "svc_db/%d", files[i].hash);
-
-        if (file_exists(hash_string) == 1) {
-            continue;
+void table_put(void *helper, struct table *t, char *key, size_t value) {
+    if ((t->size + t->n_tombstones + 1) * 2 > t->cap) {
+        // Reinsert every entry into a table of twice the size
+        struct table old = *t;
+        t->cap = old.cap == 0 ? CAP_INIT_TABLE : old.cap * CAP_GROWTH;
+        t->entries = (struct table_entry *)allocate(helper, t->cap * sizeof(struct table_entry));
+        memset(t->entries, 0, t->cap * sizeof(struct table_entry));
+        t->n_tombstones = 0;
+        for (size_t i=0; i<old.cap; i++) {
+            struct table_entry *e = old.entries + i;
+            if (e->key != NULL && e->key != TABLE_TOMBSTONE) {
+                *table_probe(t, e->key, e->hash) = *e;
+            }
+        }
+        deallocate(helper, old.entries, old.cap * sizeof(struct table_entry));
+    }
+    uint64_t hash = hash_bytes((unsigned char *)key, strlen(key));
+    struct table_entry *e = table_probe(t, key, hash);
+    if (e->key == NULL || e->key == TABLE_TOMBSTONE) {
+        if (e->key == TABLE_TOMBSTONE) {
+            t->n_tombstones--;
         }
-        file_copy(files[i].file_name, hash_string);
+        t->size++;
     }
+    struct table_entry new_entry = {hash, key, value};
+    *e = new_entry;
 }
 
 /**
-* Given an array of file objects, restores the working directory to match the
-* files specified in the array. The restored files are obtained from the
-* database directory.
+* Removes a key from a table, leaving a tombstone so that probes for other
+* keys continue past its entry.
 *
-* @param files The array of file objects to be restored.
-* @param n_files The size of the file array.
-* @param overwrite Restoration will overwrite existing files if overwrite is 1.
+* @param t The table.
+* @param key The key to remove.
+* @return The value that was stored for the key, or NULL_ID if not found.
 */
-void update_working_directory(struct file *files, size_t n_files, int overwrite) {
-    for (size_t i=0; i<n_files; i++) {
-        if (overwrite == 0) {
-            if (file_exists(files[i].file_name)) {
-                continue;
-            }
-        }
-        // Convert the file hash into a string and append it to the name of
-        // the database directory to get the file path of the stored file
-        char hash_string[18];
-        sprintf(hash_string, "svc_db/%d", files[i].hash);
-        file_copy(hash_string, files[i].file_name);
+size_t table_remove(struct table *t, char *key) {
+    if (t->cap == 0) {
+        return NULL_ID;
     }
+    uint64_t hash = hash_bytes((unsigned char *)key, strlen(key));
+    struct table_entry *e = table_probe(t, key, hash);
+    if (e->key == NULL || e->key == TABLE_TOMBSTONE) {
+        return NULL_ID;
+    }
+    size_t value = e->value;
+    e->key = TABLE_TOMBSTONE;
+    t->size--;
+    t->n_tombstones++;
+    return value;
 }
 
 /**
-* Computes the hash of the file at a specified file path.
+* Removes every key from a table, keeping its capacity.
 *
-* @param helper Data structure to pass program data between functions.
-* @param file_path The file path of the file.
+* @param t The table.
 */
-int hash_file(void *helper, char *file_path) {
-    if (file_path == NULL) {
-        return -1;
+void table_clear(struct table *t) {
+    if (t->cap != 0) {
+        memset(t->entries, 0, t->cap * sizeof(struct table_entry));
     }
+    t->size = 0;
+    t->n_tombstones = 0;
+}
 
-    int hash = 0;
-    for (int i=0; file_path[i]!='\0'; i++) {
-        hash = hash + file_path[i];
-        if (hash >= 1000) {
-            hash = hash % 1000;
-        }
+/**
+* Returns the ID of a path in the path pool, adding the path if it is not in
+* the pool yet. Every distinct path is stored once, with its hash and its sort
+* key, which is the path folded to lower case. The first 8 bytes of the sort
+* key are also packed into an integer, which orders most pairs of paths
+* without comparing the strings.
+*
+* @param helper Data structure to pass program data between functions.
+* @param name The path.
+* @return The ID of the path.
+*/
+uint32_t path_intern(void *helper, char *name) {
+    struct helper *svc = (struct helper *)helper;
+    size_t id = table_get(&svc->path_table, name);
+    if (id != NULL_ID) {
+        return id;
     }
+    size_t len = strlen(name);
+    struct path_entry p = {0, hash_bytes((unsigned char *)name, len), NULL,
+                           str_dup(helper, name)};
 
-    // Get the file size and map the file to a region of sufficient size in
-    // the virtual memory space.
-    int fd = open(file_path, O_RDONLY, S_IRUSR | S_IWUSR);
-    struct stat sb;
-    if (fstat(fd, &sb) == -1) {
-        return -2;
-    }
-    unsigned char *c = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-
-    // Modulo operation is quite computationally expensive and impacts
-    // execution time, only run the loop with modulo when the maximum possible
-    // hash for the given file size exceeds the modulus value.
-    // As the maximum byte value is 256, the hash can only exceed the modulus
-    // when the file size is greater than 2000000000/256 = 7812500
-    if (sb.st_size >= 7812500) {
-        for (int i=0; i<sb.st_size; i+=32) {
-            // Computing the addition of multiple numbers increases speed
-            hash += (c[i] + c[i+1] + c[i+2] + c[i+3]
-                    + c[i+4] + c[i+5] + c[i+6] + c[i+7]
-                    + c[i+8] + c[i+9] + c[i+10] + c[i+11]
-                    + c[i+12] + c[i+13] + c[i+14] + c[i+15]
-                    + c[i+16] + c[i+17] + c[i+18] + c[i+19]
-                    + c[i+20] + c[i+21] + c[i+22] + c[i+23]
-                    + c[i+24] + c[i+25] + c[i+26] + c[i+27]
-                    + c[i+28] + c[i+29] + c[i+30] + c[i+31]);
-            // The majority of iterations will not be impacted by the modulo,
-            // so wrapping it in an if statement increases efficiency as
-            // modulo uses significantly more clock cycles than an if statement
-            if (hash >= 2000000000) {
-                hash = hash % 2000000000;
+    // Paths without capitals are their own sort key
+    p.key = p.name;
+    for (size_t i=0; i<len; i++) {
+        if (tolower((unsigned char)name[i]) != (unsigned char)name[i]) {
+            p.key = str_dup(helper, name);
+            for (size_t j=i; j<len; j++) {
+                p.key[j] = tolower((unsigned char)p.key[j]);
             }
-        }
-    } else {
-        for (int i=0; i<sb.st_size; i+=32) {
-            hash += (c[i] + c[i+1] + c[i+2] + c[i+3]
-                    + c[i+4] + c[i+5] + c[i+6] + c[i+7]
-                    + c[i+8] + c[i+9] + c[i+10] + c[i+11]
-                    + c[i+12] + c[i+13] + c[i+14] + c[i+15]
-                    + c[i+16] + c[i+17] + c[i+18] + c[i+19]
-                    + c[i+20] + c[i+21] + c[i+22] + c[i+23]
-                    + c[i+24] + c[i+25] + c[i+26] + c[i+27]
-                    + c[i+28] + c[i+29] + c[i+30] + c[i+31]);
+            break;
         }
     }
-    close(fd);
-    return hash;
+    for (size_t i=0; i<8; i++) {
+        p.prefix = (p.prefix << 8) | (i < len ? (unsigned char)p.key[i] : 0);
+    }
+    svc->paths = array_add(helper, svc->paths, &svc->n_paths, &svc->paths_cap,
+                           &p, sizeof(struct path_entry));
+    table_put(helper, &svc->path_table, p.name, svc->n_paths - 1);
+    return svc->n_paths - 1;
 }
 
 /**
-* Computes the hash of the file at a specified file path.
+* Looks up the ID of a path without adding it to the path pool.
 *
 * @param helper Data structure to pass program data between functions.
-* @param file_path The file path of the file.
+* @param name The path.
+* @return The ID of the path, or NULL_ID if it is not in the pool.
 */
-int file_cmp(const void *p1, const void *p2) {
-    struct file *a = (struct file *)p1;
-    struct file *b = (struct file *)p2;
-    char *a_ptr = a->file_name;
-    char *b_ptr = b->file_name;
-    while (tolower(*a_ptr) == tolower(*b_ptr)) {
-        if (*a_ptr == '\0') {
-            return 0;
-        }
-        a_ptr++;
-        b_ptr++;
-    }
-    return (tolower(*a_ptr) - tolower(*b_ptr));
+uint32_t path_find(void *helper, char *name) {
+    struct helper *svc = (struct helper *)helper;
+    return table_get(&svc->path_table, name);
 }
 
 /**
-* Determines whether there are uncommitted changes by rehashing and comparing
-* the tracked files
+* Returns the string of a path in the path pool.
 *
 * @param helper Data structure to pass program data between functions.
-* @param file_path The file path of the file.
+* @param id The ID of the path.
+* @return The path, or NULL if the ID is NULL_ID.
 */
-int uncommitted_changes(void *helper) {
+char *path_name(void *helper, uint32_t id) {
     struct helper *svc = (struct helper *)helper;
-    if (svc->head != NULL_ID) {
-        if (svc->branches[svc->head].ref_commit != NULL_ID) {
-            if (svc->index_size != svc->commits[svc->branches[svc->head].ref_commit].n_files) {
-                return 1;
-            }
-            for (size_t i=0; i<svc->index_size; i++) {
-                int new_hash = hash_file(helper, svc->commits[svc->branches[svc->head].ref_commit].files[i].file_name);
-                if (svc->commits[svc->branches[svc->head].ref_commit].files[i].hash != svc->index[i].hash
-                    || svc->commits[svc->branches[svc->head].ref_commit].files[i].hash != new_hash) {
-                    return 1;
-                }
-            }
-        } else {
-            if (svc->index_size != 0) {
-                return 1;
-            }
-        }
+    if (id == NULL_ID) {
+        return NULL;
     }
-    return 0;
+    return svc->paths[id].name;
 }
 
 /**
-* Computes the difference between two lists of sorted file objects as an array
-* of change objects. The file lists must be sorted alphabetically. The algorithm
-* used to find changes initialises a reference at the beginning of both arrays.
-* Due to the sorted property, at each iteration a file can be determined as
-* added, removed, modified or unmodified.
+* Compares two paths in the path pool by their sort keys. Paths which only
+* differ in case are ordered by the paths themselves, so that only equal
+* paths compare equal.
 *
 * @param helper Data structure to pass program data between functions.
-* @param changes_ptr A pointer to where the array of changes will be stored.
-* @param n_changes_ptr A pointer to where the number of changes will be stored.
-* @param old_files The list of old files to find changes relative to.
-* @param old_len The length of the old files array.
-* @param new_files The list of new files.
-* @param new_len The length of the new files array.
+* @param a The ID of the first path.
+* @param b The ID of the second path.
+* @return A negative value if the first path comes first, a positive value if
+*         it comes last, or 0 if the paths are the same.
 */
-void get_changes(void *helper, struct change **changes_ptr, size_t *n_changes_ptr,
-                 struct file *old_files, size_t old_len,
-                 struct file *new_files, size_t new_len) {
-
-    // Create the changes array
-    struct change *changes = NULL;
+int path_cmp(void *helper, uint32_t a, uint32_t b) {
+    struct helper *svc = (struct helper *)helper;
+    if (a == b) {
+        return 0;
+    }
+    struct path_entry *pa = svc->paths + a;
+    struct path_entry *pb = svc->paths + b;
+    if (pa->prefix != pb->prefix) {
+        return pa->prefix < pb->prefix ? -1 : 1;
+    }
+    int cmp = strcmp(pa->key, pb->key);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return strcmp(pa->name, pb->name);
+}
+
+/**
+* Checks if a file exists.
+*
+* @param file_path The specified file path.
+* @return 1 if the file exists, otherwise 0.
+*/
+int file_exists(char *file_path) {
+    struct stat buffer;
+    int exists = stat(file_path, &buffer);
+    if (exists == 0) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+* Removes a file if it has other hard links, such as a file checked out as a
+* link to a chunk, so that writing to the path does not change the links.
+*
+* @param file_path The path of the file.
+*/
+void file_unshare(char *file_path) {
+    struct stat sb;
+    if (stat(file_path, &sb) == 0 && sb.st_nlink > 1) {
+        unlink(file_path);
+    }
+}
+
+/**
+* Copies a file from one location to another in the filesystem. The copy is
+* made with a reflink where the file system supports it, so the new file
+* shares the source's blocks, and otherwise inside the kernel.
+*
+* @param helper Data structure to pass program data between functions.
+* @param file_path The file path of the source file.
+* @param new_file_path The destination file path to place the copied file.
+*/
+void file_copy(void *helper, char *file_path, char *new_file_path) {
+    int src_fd = open(file_path, O_RDONLY);
+    struct stat sb;
+    if (src_fd == -1 || fstat(src_fd, &sb) == -1) {
+        if (src_fd != -1) {
+            close(src_fd);
+        }
+        return;
+    }
+    file_unshare(new_file_path);
+    int dest_fd = open(new_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (dest_fd != -1) {
+        if (file_clone(helper, src_fd, dest_fd) == -1) {
+            copy_bytes(helper, src_fd, 0, dest_fd, 0, sb.st_size);
+        }
+        close(dest_fd);
+    }
+    close(src_fd);
+}
+
+/**
+* Reads exactly n bytes from a file descriptor, retrying short reads.
+*
+* @param fd The file descriptor to read from.
+* @param buf The destination buffer.
+* @param n The number of bytes to read.
+* @return 0 if successful, otherwise -1.
+*/
+int read_full(int fd, void *buf, size_t n) {
+    while (n > 0) {
+        ssize_t n_read = read(fd, buf, n);
+        if (n_read <= 0) {
+            return -1;
+        }
+        buf += n_read;
+        n -= n_read;
+    }
+    return 0;
+}
+
+/**
+* Writes exactly n bytes at an offset in a file, retrying short writes.
+*
+* @param fd The file descriptor to write to.
+* @param buf The source buffer.
+* @param n The number of bytes to write.
+* @param offset The offset in the file to write at.
+* @return 0 if successful, otherwise -1.
+*/
+int pwrite_full(int fd, const void *buf, size_t n, off_t offset) {
+    while (n > 0) {
+        ssize_t n_written = pwrite(fd, buf, n, offset);
+        if (n_written <= 0) {
+            if (n_written == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf = (const char *)buf + n_written;
+        n -= n_written;
+        offset += n_written;
+    }
+    return 0;
+}
+
+/**
+* Writes exactly n bytes to a file descriptor, retrying short writes.
+*
+* @param fd The file descriptor to write to.
+* @param buf The source buffer.
+* @param n The number of bytes to write.
+* @return 0 if successful, otherwise -1.
+*/
+int write_full(int fd, const void *buf, size_t n) {
+    while (n > 0) {
+        ssize_t n_written = write(fd, buf, n);
+        if (n_written <= 0) {
+            if (n_written == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n_written;
+        n -= n_written;
+    }
+    return 0;
+}
+
+/**
+* Makes a file share all the blocks of another file with a reflink, on file
+* systems such as btrfs and XFS. No data is copied. Once the kernel or file
+* system reports that reflinks are not supported, they are not tried again.
+*
+* @param helper Data structure to pass program data between functions.
+* @param src_fd The file descriptor of the source file.
+* @param dest_fd The file descriptor of the destination file, open for writing.
+* @return 0 if successful, otherwise -1.
+*/
+int file_clone(void *helper, int src_fd, int dest_fd) {
+    struct helper *svc = (struct helper *)helper;
+    if (svc->clone_unsupported) {
+        return -1;
+    }
+    if (ioctl(dest_fd, FICLONE, src_fd) == 0) {
+        return 0;
+    }
+    // Files on different file systems may still be cloned on others
+    if (errno != EXDEV) {
+        svc->clone_unsupported = errno == EOPNOTSUPP || errno == ENOTTY || errno == ENOSYS;
+    }
+    return -1;
+}
+
+/**
+* Copies bytes from one file to another without passing them through user
+* space, using copy_file_range() and then sendfile(). File systems may share
+* the blocks rather than copying them. If neither can be used, the bytes are
+* copied through a buffer. copy_file_range() is not tried again once it is
+* reported to be unsupported.
+*
+* @param helper Data structure to pass program data between functions.
+* @param src_fd The file descriptor of the source file.
+* @param src_offset The offset in the source file to copy from.
+* @param dest_fd The file descriptor of the destination file.
+* @param dest_offset The offset in the destination file to copy to.
+* @param n The number of bytes to copy.
+* @return 0 if successful, otherwise -1.
+*/
+int copy_bytes(void *helper, int src_fd, off_t src_offset, int dest_fd, off_t dest_offset,
+               size_t n) {
+    struct helper *svc = (struct helper *)helper;
+    while (n > 0 && !svc->copy_range_unsupported) {
+        ssize_t n_copied = copy_file_range(src_fd, &src_offset, dest_fd, &dest_offset, n, 0);
+        if (n_copied > 0) {
+            n -= n_copied;
+        } else if (n_copied == 0 || errno != EINTR) {
+            svc->copy_range_unsupported = n_copied == -1
+                                          && (errno == ENOSYS || errno == EOPNOTSUPP);
+            break;
+        }
+    }
+
+    // sendfile() writes at the destination's file position
+    if (n > 0 && lseek(dest_fd, dest_offset, SEEK_SET) != -1) {
+        while (n > 0) {
+            ssize_t n_sent = sendfile(dest_fd, src_fd, &src_offset, n);
+            if (n_sent > 0) {
+                n -= n_sent;
+                dest_offset += n_sent;
+            } else if (n_sent == 0 || errno != EINTR) {
+                break;
+            }
+        }
+    }
+
+    unsigned char buf[65536];
+    while (n > 0) {
+        ssize_t n_read = pread(src_fd, buf, n < sizeof(buf) ? n : sizeof(buf), src_offset);
+        if (n_read <= 0 || pwrite(dest_fd, buf, n_read, dest_offset) != n_read) {
+            return -1;
+        }
+        n -= n_read;
+        src_offset += n_read;
+        dest_offset += n_read;
+    }
+    return 0;
+}
+
+// Table of random values used by the gear rolling hash, one per byte value.
+static uint64_t gear_table[256];
+
+// Random bytes mixed into the content hash. Each stripe of a block uses the
+// secret at a different offset, so reordering stripes changes the hash.
+static unsigned char hash_secret[HASH_SECRET_SIZE];
+
+/**
+* Reads an unaligned 64-bit value from memory.
+*
+* @param ptr The address to read from.
+* @return The value read.
+*/
+static inline uint64_t read64(const unsigned char *ptr) {
+    uint64_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+/**
+* Reads an unaligned 32-bit value from memory.
+*
+* @param ptr The address to read from.
+* @return The value read.
+*/
+static inline uint32_t read32(const unsigned char *ptr) {
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+/**
+* Accumulates one 64 byte stripe into the eight hash accumulators. Each lane
+* adds the stripe data to its neighbour and the product of the two halves of
+* the data mixed with the secret to itself.
+*
+* @param acc The eight hash accumulators.
+* @param data The 64 bytes of the stripe.
+* @param secret The secret for the stripe's position in the block.
+*/
+static inline void hash_stripe_scalar(uint64_t *acc, const unsigned char *data,
+                                      const unsigned char *secret) {
+    for (int i=0; i<8; i++) {
+        uint64_t value = read64(data + 8*i);
+        uint64_t key = value ^ read64(secret + 8*i);
+        acc[i ^ 1] += value;
+        acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+    }
+}
+
+/**
+* Scrambles the accumulators at the end of each block so that the order of
+* blocks affects the hash.
+*
+* @param acc The eight hash accumulators.
+* @param secret The secret to mix into the accumulators.
+*/
+static inline void hash_scramble_scalar(uint64_t *acc, const unsigned char *secret) {
+    for (int i=0; i<8; i++) {
+        uint64_t value = acc[i];
+        value ^= value >> 47;
+        value ^= read64(secret + 8*i);
+        acc[i] = value * HASH_PRIME32_1;
+    }
+}
+
+/**
+* Hashes whole blocks one stripe at a time, used when no vector unit is
+* available. Every kernel produces exactly the same accumulators.
+*
+* @param acc The eight hash accumulators.
+* @param data The start of the first block.
+* @param n_blocks The number of blocks to hash.
+*/
+void hash_blocks_scalar(uint64_t *acc, const unsigned char *data, size_t n_blocks) {
+    for (size_t b=0; b<n_blocks; b++) {
+        for (int s=0; s<HASH_STRIPES; s++) {
+            hash_stripe_scalar(acc, data + s*HASH_STRIPE, hash_secret + 8*s);
+        }
+        hash_scramble_scalar(acc, hash_secret + HASH_SECRET_SIZE - HASH_STRIPE);
+        data += HASH_BLOCK;
+    }
+}
+
+#if defined(__x86_64__)
+
+/**
+* Hashes whole blocks with SSE2, two accumulators per register.
+*
+* @param acc The eight hash accumulators.
+* @param data The start of the first block.
+* @param n_blocks The number of blocks to hash.
+*/
+__attribute__((target("sse2")))
+void hash_blocks_sse2(uint64_t *acc, const unsigned char *data, size_t n_blocks) {
+    __m128i a[4];
+    for (int i=0; i<4; i++) {
+        a[i] = _mm_loadu_si128((const __m128i *)acc + i);
+    }
+    const __m128i prime = _mm_set1_epi32(HASH_PRIME32_1);
+    const unsigned char *scramble = hash_secret + HASH_SECRET_SIZE - HASH_STRIPE;
+    for (size_t b=0; b<n_blocks; b++) {
+        for (int s=0; s<HASH_STRIPES; s++) {
+            const __m128i *stripe = (const __m128i *)(data + s*HASH_STRIPE);
+            const __m128i *secret = (const __m128i *)(hash_secret + 8*s);
+            for (int i=0; i<4; i++) {
+                __m128i value = _mm_loadu_si128(stripe + i);
+                __m128i key = _mm_xor_si128(value, _mm_loadu_si128(secret + i));
+                __m128i key_hi = _mm_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1));
+                __m128i product = _mm_mul_epu32(key, key_hi);
+                __m128i swapped = _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+                a[i] = _mm_add_epi64(a[i], _mm_add_epi64(product, swapped));
+            }
+        }
+        for (int i=0; i<4; i++) {
+            __m128i value = _mm_xor_si128(a[i], _mm_srli_epi64(a[i], 47));
+            value = _mm_xor_si128(value, _mm_loadu_si128((const __m128i *)scramble + i));
+            __m128i lo = _mm_mul_epu32(value, prime);
+            __m128i hi = _mm_mul_epu32(_mm_srli_epi64(value, 32), prime);
+            a[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+        }
+        data += HASH_BLOCK;
+    }
+    for (int i=0; i<4; i++) {
+        _mm_storeu_si128((__m128i *)acc + i, a[i]);
+    }
+}
+
+/**
+* Hashes whole blocks with AVX2, four accumulators per register.
+*
+* @param acc The eight hash accumulators.
+* @param data The start of the first block.
+* @param n_blocks The number of blocks to hash.
+*/
+__attribute__((target("avx2")))
+void hash_blocks_avx2(uint64_t *acc, const unsigned char *data, size_t n_blocks) {
+    __m256i a[2];
+    for (int i=0; i<2; i++) {
+        a[i] = _mm256_loadu_si256((const __m256i *)acc + i);
+    }
+    const __m256i prime = _mm256_set1_epi32(HASH_PRIME32_1);
+    const unsigned char *scramble = hash_secret + HASH_SECRET_SIZE - HASH_STRIPE;
+    for (size_t b=0; b<n_blocks; b++) {
+        for (int s=0; s<HASH_STRIPES; s++) {
+            const __m256i *stripe = (const __m256i *)(data + s*HASH_STRIPE);
+            const __m256i *secret = (const __m256i *)(hash_secret + 8*s);
+            for (int i=0; i<2; i++) {
+                __m256i value = _mm256_loadu_si256(stripe + i);
+                __m256i key = _mm256_xor_si256(value, _mm256_loadu_si256(secret + i));
+                __m256i key_hi = _mm256_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1));
+                __m256i product = _mm256_mul_epu32(key, key_hi);
+                __m256i swapped = _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+                a[i] = _mm256_add_epi64(a[i], _mm256_add_epi64(product, swapped));
+            }
+        }
+        for (int i=0; i<2; i++) {
+            __m256i value = _mm256_xor_si256(a[i], _mm256_srli_epi64(a[i], 47));
+            value = _mm256_xor_si256(value, _mm256_loadu_si256((const __m256i *)scramble + i));
+            __m256i lo = _mm256_mul_epu32(value, prime);
+            __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(value, 32), prime);
+            a[i] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+        }
+        data += HASH_BLOCK;
+    }
+    for (int i=0; i<2; i++) {
+        _mm256_storeu_si256((__m256i *)acc + i, a[i]);
+    }
+}
+
+/**
+* Hashes whole blocks with AVX-512, all eight accumulators in one register.
+*
+* @param acc The eight hash accumulators.
+* @param data The start of the first block.
+* @param n_blocks The number of blocks to hash.
+*/
+__attribute__((target("avx512f")))
+void hash_blocks_avx512(uint64_t *acc, const unsigned char *data, size_t n_blocks) {
+    __m512i a = _mm512_loadu_si512(acc);
+    const __m512i prime = _mm512_set1_epi32(HASH_PRIME32_1);
+    const __m512i scramble = _mm512_loadu_si512(hash_secret + HASH_SECRET_SIZE - HASH_STRIPE);
+    for (size_t b=0; b<n_blocks; b++) {
+        for (int s=0; s<HASH_STRIPES; s++) {
+            __m512i value = _mm512_loadu_si512(data + s*HASH_STRIPE);
+            __m512i key = _mm512_xor_si512(value, _mm512_loadu_si512(hash_secret + 8*s));
+            __m512i key_hi = _mm512_shuffle_epi32(key, _MM_PERM_CDAB);
+            __m512i product = _mm512_mul_epu32(key, key_hi);
+            __m512i swapped = _mm512_shuffle_epi32(value, _MM_PERM_BADC);
+            a = _mm512_add_epi64(a, _mm512_add_epi64(product, swapped));
+        }
+        __m512i value = _mm512_xor_si512(a, _mm512_srli_epi64(a, 47));
+        value = _mm512_xor_si512(value, scramble);
+        __m512i lo = _mm512_mul_epu32(value, prime);
+        __m512i hi = _mm512_mul_epu32(_mm512_srli_epi64(value, 32), prime);
+        a = _mm512_add_epi64(lo, _mm512_slli_epi64(hi, 32));
+        data += HASH_BLOCK;
+    }
+    _mm512_storeu_si512(acc, a);
+}
+
+#endif
+
+// The block hashing kernel selected for the running processor.
+static void (*hash_blocks)(uint64_t *, const unsigned char *, size_t) = hash_blocks_scalar;
+
+/**
+* Selects the block hashing kernel by name. All kernels produce the same
+* hashes, so this only affects speed.
+*
+* @param kernel One of "scalar", "sse2", "avx2" or "avx512".
+* @return 0 if the kernel is supported by the processor, otherwise -1.
+*/
+int hash_set_kernel(char *kernel) {
+    if (strcmp(kernel, "scalar") == 0) {
+        hash_blocks = hash_blocks_scalar;
+        return 0;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (strcmp(kernel, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        hash_blocks = hash_blocks_sse2;
+        return 0;
+    }
+    if (strcmp(kernel, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        hash_blocks = hash_blocks_avx2;
+        return 0;
+    }
+    if (strcmp(kernel, "avx512") == 0 && __builtin_cpu_supports("avx512f")) {
+        hash_blocks = hash_blocks_avx512;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+/**
+* Fills the secret and gear tables with a fixed pseudorandom sequence so that
+* hashes and chunk boundaries are the same between runs, and selects the
+* fastest hashing kernel supported by the processor.
+*/
+void hash_init(void) {
+    uint64_t state = 0x2545f4914f6cdd1dULL;
+    for (int i=0; i<256 + HASH_SECRET_SIZE/8; i++) {
+        state += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z = z ^ (z >> 31);
+        if (i < 256) {
+            gear_table[i] = z | 1;
+        } else {
+            memcpy(hash_secret + 8*(i - 256), &z, sizeof(z));
+        }
+    }
+    if (hash_set_kernel("avx512") == -1 && hash_set_kernel("avx2") == -1
+        && hash_set_kernel("sse2") == -1) {
+        hash_set_kernel("scalar");
+    }
+}
+
+/**
+* Computes a strong 64-bit hash of a block of memory. Whole 1 KiB blocks are
+* hashed by the selected vector kernel. The remaining stripes are hashed one
+* at a time and the final partial stripe is zero padded, with the length
+* mixed into the result so that padding cannot cause collisions.
+*
+* @param data The bytes to hash.
+* @param n The number of bytes.
+* @return The hash value.
+*/
+uint64_t hash_bytes(const unsigned char *data, size_t n) {
+    uint64_t acc[8] = {HASH_PRIME32_3, HASH_PRIME64_1, HASH_PRIME64_2,
+                       HASH_PRIME64_3, HASH_PRIME64_4, HASH_PRIME32_2,
+                       HASH_PRIME64_5, HASH_PRIME32_1};
+    size_t n_blocks = n / HASH_BLOCK;
+    hash_blocks(acc, data, n_blocks);
+
+    // Hash the whole stripes remaining after the last block
+    const unsigned char *tail = data + n_blocks*HASH_BLOCK;
+    size_t remaining = n - n_blocks*HASH_BLOCK;
+    size_t s = 0;
+    for (; (s + 1)*HASH_STRIPE <= remaining; s++) {
+        hash_stripe_scalar(acc, tail + s*HASH_STRIPE, hash_secret + 8*s);
+    }
+
+    // Hash the last partial stripe, padded with zeros
+    unsigned char last[HASH_STRIPE] = {0};
+    memcpy(last, tail + s*HASH_STRIPE, remaining - s*HASH_STRIPE);
+    hash_stripe_scalar(acc, last, hash_secret + HASH_SECRET_SIZE - HASH_STRIPE - 7);
+
+    // Merge the accumulators and the length into a single value
+    uint64_t hash = n * HASH_PRIME64_1;
+    for (int i=0; i<4; i++) {
+        __uint128_t product = (__uint128_t)(acc[2*i] ^ read64(hash_secret + 11 + 16*i))
+                              * (acc[2*i + 1] ^ read64(hash_secret + 19 + 16*i));
+        hash += (uint64_t)product ^ (uint64_t)(product >> 64);
+    }
+    hash ^= hash >> 37;
+    hash *= 0x165667919E3779F9ULL;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/**
+* Finds the end of the next chunk using a gear rolling hash, so boundaries
+* depend only on the nearby contents. An edit to a file therefore only
+* changes the chunks around the edit, and all other chunks are shared with
+* the previous version of the file.
+*
+* @param data The remaining bytes of the file.
+* @param n The number of remaining bytes.
+* @return The length of the next chunk.
+*/
+size_t chunk_boundary(const unsigned char *data, size_t n) {
+    if (n <= CHUNK_MIN) {
+        return n;
+    }
+    size_t limit = n < CHUNK_MAX ? n : CHUNK_MAX;
+    uint64_t hash = 0;
+    for (size_t i=CHUNK_MIN; i<limit; i++) {
+        hash = (hash << 1) + gear_table[data[i]];
+        if ((hash & CHUNK_MASK) == 0) {
+            return i + 1;
+        }
+    }
+    return limit;
+}
+
+/**
+* Writes the extension bytes of a literal or match length which did not fit
+* in its 4-bit field, as a run of 255s ending with a smaller byte.
+*
+* @param out The output position, which is advanced past the bytes written.
+* @param length The part of the length remaining after the 4-bit field.
+*/
+static inline void lz_put_length(unsigned char **out, size_t length) {
+    for (; length >= 255; length -= 255) {
+        *(*out)++ = 255;
+    }
+    *(*out)++ = length;
+}
+
+/**
+* Reads the extension bytes of a literal or match length.
+*
+* @param in The input position, which is advanced past the bytes read.
+* @param end The end of the input.
+* @param length The length from the 4-bit field, which is extended.
+* @return 0 if successful, otherwise -1 if the input ends early.
+*/
+static inline int lz_get_length(const unsigned char **in, const unsigned char *end,
+                                size_t *length) {
+    unsigned char byte;
+    do {
+        if (*in == end) {
+            return -1;
+        }
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/**
+* Compresses a chunk with a byte-oriented LZ77 codec. The output is a list of
+* sequences, each made of a token holding a literal length and a match
+* length, the literal bytes, and a 16-bit offset back to the match. Matches
+* are found through a hash table of the last position of each 4-byte
+* sequence, and positions are skipped faster the longer no match is found,
+* so data that does not compress is passed over quickly.
+*
+* @param src The bytes to compress.
+* @param n The number of bytes, which is at most CHUNK_MAX.
+* @param dest The output buffer.
+* @param limit The size of the output buffer.
+* @return The compressed size, or 0 if it would be larger than limit.
+*/
+size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dest, size_t limit) {
+    uint32_t table[1 << LZ_HASH_BITS] = {0};
+    unsigned char *out = dest;
+    unsigned char *out_end = dest + limit;
+    size_t anchor = 0;
+    size_t i = 1;
+    while (i + LZ_MIN_MATCH <= n) {
+        uint32_t sequence = read32(src + i);
+        uint32_t h = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[h];
+        table[h] = i;
+        if (i - candidate > LZ_MAX_OFFSET || read32(src + candidate) != sequence) {
+            i += 1 + ((i - anchor) >> LZ_SKIP_SHIFT);
+            continue;
+        }
+
+        // Extend the match forwards, then backwards over the literals
+        size_t length = LZ_MIN_MATCH;
+        while (i + length < n && src[candidate + length] == src[i + length]) {
+            length++;
+        }
+        while (i > anchor && candidate > 0 && src[i - 1] == src[candidate - 1]) {
+            i--;
+            candidate--;
+            length++;
+        }
+
+        // Worst case size of the sequence, with both lengths extended
+        size_t literals = i - anchor;
+        if ((size_t)(out_end - out) < 1 + literals/255 + 1 + literals + 2 + length/255 + 1) {
+            return 0;
+        }
+        unsigned char *token = out++;
+        *token = (literals < 15 ? literals : 15) << 4;
+        if (literals >= 15) {
+            lz_put_length(&out, literals - 15);
+        }
+        memcpy(out, src + anchor, literals);
+        out += literals;
+        size_t offset = i - candidate;
+        *out++ = offset;
+        *out++ = offset >> 8;
+        size_t extra = length - LZ_MIN_MATCH;
+        *token |= extra < 15 ? extra : 15;
+        if (extra >= 15) {
+            lz_put_length(&out, extra - 15);
+        }
+        i += length;
+        anchor = i;
+    }
+
+    // The last sequence is only literals, with no offset
+    size_t literals = n - anchor;
+    if ((size_t)(out_end - out) < 1 + literals/255 + 1 + literals) {
+        return 0;
+    }
+    *out++ = (literals < 15 ? literals : 15) << 4;
+    if (literals >= 15) {
+        lz_put_length(&out, literals - 15);
+    }
+    memcpy(out, src + anchor, literals);
+    out += literals;
+    return out - dest;
+}
+
+/**
+* Decompresses a chunk compressed by lz_compress(). Every length and offset
+* is checked against the input and output, so a damaged chunk is detected
+* rather than written outside the output.
+*
+* @param src The compressed bytes.
+* @param n The number of compressed bytes.
+* @param dest The output buffer.
+* @param length The size of the chunk before compression.
+* @return 0 if the chunk decompressed to exactly length bytes, otherwise -1.
+*/
+int lz_decompress(const unsigned char *src, size_t n, unsigned char *dest, size_t length) {
+    const unsigned char *in = src;
+    const unsigned char *in_end = src + n;
+    unsigned char *out = dest;
+    unsigned char *out_end = dest + length;
+    while (in < in_end) {
+        unsigned char token = *in++;
+        size_t literals = token >> 4;
+        if (literals == 15 && lz_get_length(&in, in_end, &literals) == -1) {
+            return -1;
+        }
+        if (literals > (size_t)(in_end - in) || literals > (size_t)(out_end - out)) {
+            return -1;
+        }
+        memcpy(out, in, literals);
+        in += literals;
+        out += literals;
+        if (in == in_end) {
+            break;
+        }
+
+        if (in_end - in < 2) {
+            return -1;
+        }
+        size_t offset = in[0] | (size_t)in[1] << 8;
+        in += 2;
+        size_t match = token & 15;
+        if (match == 15 && lz_get_length(&in, in_end, &match) == -1) {
+            return -1;
+        }
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(out - dest) || match > (size_t)(out_end - out)) {
+            return -1;
+        }
+
+        // Matches may overlap the bytes they produce, so distant matches are
+        // copied 8 bytes at a time and close ones a byte at a time
+        const unsigned char *from = out - offset;
+        if (offset >= 8) {
+            size_t k = 0;
+            for (; k + 8 <= match; k += 8) {
+                memcpy(out + k, from + k, 8);
+            }
+            for (; k < match; k++) {
+                out[k] = from[k];
+            }
+        } else {
+            for (size_t k=0; k<match; k++) {
+                out[k] = from[k];
+            }
+        }
+        out += match;
+    }
+    return out == out_end ? 0 : -1;
+}
+
+/**
+* Compresses a chunk for storage if it compresses well.
+*
+* @param src The chunk contents.
+* @param n The length of the chunk.
+* @param dest The output buffer, of at least n bytes.
+* @return The compressed size, or 0 if the chunk should be stored raw.
+*/
+size_t chunk_compress(const unsigned char *src, size_t n, unsigned char *dest) {
+    if (n <= LZ_MIN_SAVING) {
+        return 0;
+    }
+    return lz_compress(src, n, dest, n - n/LZ_MIN_SAVING - 1);
+}
+
+/**
+* Maps every pack in the pack directory, replacing any packs already mapped.
+* A pack is only used once its index exists, and the index is written after
+* the pack is complete.
+*
+* @param helper Data structure to pass program data between functions.
+*/
+void pack_load(void *helper) {
+    struct helper *svc = (struct helper *)helper;
+    pack_unload(helper);
+    svc->packs_loaded = 1;
+    DIR *dir = opendir(PACK_DIR);
+    if (dir == NULL) {
+        return;
+    }
+    size_t n_indexes = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        n_indexes += pack_name_valid(entry->d_name, ".idx");
+    }
+    if (n_indexes == 0) {
+        closedir(dir);
+        return;
+    }
+    svc->packs = mmap(NULL, n_indexes * sizeof(struct pack), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    svc->packs_cap = n_indexes;
+    rewinddir(dir);
+    while ((entry = readdir(dir)) != NULL && svc->n_packs < n_indexes) {
+        if (!pack_name_valid(entry->d_name, ".idx")) {
+            continue;
+        }
+        struct pack *pack = svc->packs + svc->n_packs;
+        memset(pack, 0, sizeof(struct pack));
+        memcpy(pack->name, entry->d_name, 16);
+        if (pack_open(pack) == 0) {
+            svc->n_packs++;
+        }
+    }
+    closedir(dir);
+}
+
+/**
+* Checks whether a directory entry is a pack file of the given kind, named by
+* 16 hexadecimal digits.
+*
+* @param name The name of the directory entry.
+* @param suffix ".pack" or ".idx".
+* @return 1 if the name matches, otherwise 0.
+*/
+int pack_name_valid(char *name, char *suffix) {
+    return strspn(name, "0123456789abcdef") == 16 && strcmp(name + 16, suffix) == 0;
+}
+
+/**
+* Maps a pack and its index, checking that every entry lies inside the pack.
+*
+* @param pack The pack, with its name set.
+* @return 0 if successful, otherwise -1.
+*/
+int pack_open(struct pack *pack) {
+    char path[40];
+    struct stat sb;
+    sprintf(path, PACK_DIR "/%s.idx", pack->name);
+    int index_fd = open(path, O_RDONLY);
+    if (index_fd == -1 || fstat(index_fd, &sb) == -1
+        || (size_t)sb.st_size < sizeof(struct pack_index)) {
+        if (index_fd != -1) {
+            close(index_fd);
+        }
+        return -1;
+    }
+    pack->index_size = sb.st_size;
+    pack->index = mmap(NULL, pack->index_size, PROT_READ, MAP_PRIVATE, index_fd, 0);
+    close(index_fd);
+    if (pack->index == MAP_FAILED) {
+        return -1;
+    }
+    pack->entries = (struct pack_entry *)(pack->index + 1);
+
+    sprintf(path, PACK_DIR "/%s.pack", pack->name);
+    pack->fd = open(path, O_RDONLY);
+    int valid = pack->index->magic == PACK_MAGIC
+                && pack->index_size == sizeof(struct pack_index)
+                   + pack->index->n_entries * sizeof(struct pack_entry)
+                && pack->fd != -1 && fstat(pack->fd, &sb) == 0;
+    pack->data_size = valid ? sb.st_size : 0;
+    for (size_t i=0; valid && i<pack->index->n_entries; i++) {
+        valid = pack->entries[i].offset + pack->entries[i].size <= pack->data_size;
+    }
+    if (valid && pack->data_size > 0) {
+        pack->data = mmap(NULL, pack->data_size, PROT_READ, MAP_PRIVATE, pack->fd, 0);
+        valid = pack->data != MAP_FAILED;
+    }
+    if (!valid) {
+        munmap(pack->index, pack->index_size);
+        if (pack->fd != -1) {
+            close(pack->fd);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+* Unmaps every pack, so that the pack directory is read again on next use.
+*
+* @param helper Data structure to pass program data between functions.
+*/
+void pack_unload(void *helper) {
+    struct helper *svc = (struct helper *)helper;
+    for (size_t i=0; i<svc->n_packs; i++) {
+        struct pack *pack = svc->packs + i;
+        munmap(pack->index, pack->index_size);
+        if (pack->data_size > 0) {
+            munmap(pack->data, pack->data_size);
+        }
+        close(pack->fd);
+    }
+    if (svc->packs != NULL) {
+        munmap(svc->packs, svc->packs_cap * sizeof(struct pack));
+    }
+    svc->packs = NULL;
+    svc->n_packs = 0;
+    svc->packs_cap = 0;
+    svc->packs_loaded = 0;
+    delta_cache_clear(helper);
+}
+
+/**
+* Finds an object in the packs. The fanout table gives the entries sharing
+* the first byte of the id, which are then binary searched.
+*
+* @param helper Data structure to pass program data between functions.
+* @param id The hash of the object.
+* @param type OBJECT_MANIFEST or OBJECT_CHUNK.
+* @param pack_out Set to the pack holding the object.
+* @return The index entry of the object, or NULL if it is not packed.
+*/
+struct pack_entry *pack_find(void *helper, uint64_t id, unsigned int type,
+                             struct pack **pack_out) {
+    struct helper *svc = (struct helper *)helper;
+    if (!svc->packs_loaded) {
+        pack_load(helper);
+    }
+    unsigned int first = id >> 56;
+    for (size_t p=0; p<svc->n_packs; p++) {
+        struct pack *pack = svc->packs + p;
+        size_t lo = first == 0 ? 0 : pack->index->fanout[first - 1];
+        size_t hi = pack->index->fanout[first];
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            struct pack_entry *entry = pack->entries + mid;
+            if (entry->id < id || (entry->id == id && (entry->type & ~OBJECT_DELTA) < type)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < pack->index->n_entries && pack->entries[lo].id == id
+            && (pack->entries[lo].type & ~OBJECT_DELTA) == type) {
+            *pack_out = pack;
+            return pack->entries + lo;
+        }
+    }
+    return NULL;
+}
+
+/**
+* Writes the path of an object stored as a file of its own.
+*
+* @param path The output buffer, of at least 40 bytes.
+* @param id The hash of the object.
+* @param type OBJECT_MANIFEST or OBJECT_CHUNK.
+*/
+void object_path(char *path, uint64_t id, unsigned int type) {
+    if (type == OBJECT_CHUNK) {
+        sprintf(path, CHUNK_DIR "/%016lx", id);
+    } else {
+        sprintf(path, "svc_db/%016lx", id);
+    }
+}
+
+/**
+* Opens an object in the database, whether it is a file of its own or packed.
+* Objects stored as deltas are decoded into the scratch arena, and have no
+* file descriptor.
+*
+* @param helper Data structure to pass program data between functions.
+* @param id The hash of the object.
+* @param type OBJECT_MANIFEST or OBJECT_CHUNK.
+* @param object The object to open.
+* @return 0 if successful, otherwise -1 if the object is not stored.
+*/
+int object_open(void *helper, uint64_t id, unsigned int type, struct object *object) {
+    char path[40];
+    object_path(path, id, type);
+    object->data = NULL;
+    object->offset = 0;
+    object->fd = open(path, O_RDONLY);
+    if (object->fd != -1) {
+        struct stat sb;
+        if (fstat(object->fd, &sb) == -1) {
+            close(object->fd);
+            return -1;
+        }
+        object->size = sb.st_size;
+        object->loose = 1;
+        return 0;
+    }
+    struct pack *pack;
+    struct pack_entry *entry = pack_find(helper, id, type, &pack);
+    if (entry == NULL) {
+        return -1;
+    }
+    object->loose = 0;
+    if (entry->type & OBJECT_DELTA) {
+        size_t size;
+        const unsigned char *contents = pack_decode(helper, pack, entry - pack->entries,
+                                                    0, &size, 0);
+        if (contents == NULL) {
+            return -1;
+        }
+        unsigned char *copy = scratch_alloc(helper, size);
+        memcpy(copy, contents, size);
+        object->fd = -1;
+        object->size = size;
+        object->data = copy;
+        return 0;
+    }
+    object->fd = pack->fd;
+    object->offset = entry->offset;
+    object->size = entry->size;
+    object->data = pack->data + entry->offset;
+    return 0;
+}
+
+/**
+* Returns the contents of an object, mapping it if it is a file of its own.
+*
+* @param object The open object.
+* @return The contents, or NULL if the object is empty or cannot be mapped.
+*/
+const unsigned char *object_data(struct object *object) {
+    if (object->data == NULL && object->loose && object->size > 0) {
+        void *data = mmap(NULL, object->size, PROT_READ, MAP_PRIVATE, object->fd, 0);
+        object->data = data == MAP_FAILED ? NULL : data;
+    }
+    return object->data;
+}
+
+/**
+* Closes an object opened with object_open().
+*
+* @param object The open object.
+*/
+void object_close(struct object *object) {
+    if (object->loose) {
+        if (object->data != NULL) {
+            munmap((void *)object->data, object->size);
+        }
+        close(object->fd);
+    }
+}
+
+/**
+* Checks whether an object is stored, either as a file of its own or packed.
+*
+* @param helper Data structure to pass program data between functions.
+* @param id The hash of the object.
+* @param type OBJECT_MANIFEST or OBJECT_CHUNK.
+* @return 1 if the object is stored, otherwise 0.
+*/
+int object_exists(void *helper, uint64_t id, unsigned int type) {
+    char path[40];
+    object_path(path, id, type);
+    struct pack *pack;
+    return file_exists(path) == 1 || pack_find(helper, id, type, &pack) != NULL;
+}
+
+/**
+* Writes a value as a variable-length integer, 7 bits per byte with the high
+* bit set on every byte but the last.
+*
+* @param out The output position, which is advanced past the bytes written.
+* @param value The value to write.
+*/
+static inline void put_varint(unsigned char **out, size_t value) {
+    for (; value >= 0x80; value >>= 7) {
+        *(*out)++ = value | 0x80;
+    }
+    *(*out)++ = value;
+}
+
+/**
+* Reads a variable-length integer written by put_varint().
+*
+* @param in The input position, which is advanced past the bytes read.
+* @param end The end of the input.
+* @param value Where the value is stored.
+* @return 0 if successful, otherwise -1 if the input ends early.
+*/
+static inline int get_varint(const unsigned char **in, const unsigned char *end,
+                             size_t *value) {
+    *value = 0;
+    for (int shift=0; shift<64; shift+=7) {
+        if (*in == end) {
+            return -1;
+        }
+        unsigned char byte = *(*in)++;
+        *value |= (size_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+* Encodes an object as a delta against a base object. The delta is a list of
+* instructions which either copy a range of the base or insert new bytes,
+* each led by a variable-length integer holding the length and, in its low
+* bit, the kind of instruction. Copies are found through a hash table of the
+* 8-byte sequences of the base.
+*
+* @param helper Data structure to pass program data between functions.
+* @param base The contents of the base object.
+* @param base_n The size of the base object.
+* @param target The contents of the object to encode.
+* @param n The size of the object to encode.
+* @param dest The output buffer.
+* @param limit The size of the output buffer.
+* @return The size of the delta, or 0 if it would be larger than limit.
+*/
+size_t delta_encode(void *helper, const unsigned char *base, size_t base_n,
+                    const unsigned char *target, size_t n, unsigned char *dest, size_t limit) {
+    size_t mark = scratch_mark(helper);
+    uint32_t *table = scratch_alloc(helper, sizeof(uint32_t) << DELTA_HASH_BITS);
+    memset(table, 0xff, sizeof(uint32_t) << DELTA_HASH_BITS);
+    for (size_t p=0; p + DELTA_MIN_MATCH <= base_n; p++) {
+        table[(read64(base + p) * 0x9E3779B97F4A7C15ULL) >> (64 - DELTA_HASH_BITS)] = p;
+    }
+
+    unsigned char *out = dest;
+    unsigned char *out_end = dest + limit;
+    size_t pending = 0;
+    size_t copy_end = 0;
+    size_t i = 0;
+    while (i + DELTA_MIN_MATCH <= n) {
+        // An edit usually replaces bytes in place, so the base is first
+        // checked where the last copy would continue past the new bytes
+        uint64_t sequence = read64(target + i);
+        size_t candidate = copy_end + (i - pending);
+        if (candidate + DELTA_MIN_MATCH > base_n || read64(base + candidate) != sequence) {
+            candidate = table[(sequence * 0x9E3779B97F4A7C15ULL) >> (64 - DELTA_HASH_BITS)];
+        }
+        if (candidate == UINT32_MAX || read64(base + candidate) != sequence) {
+            i++;
+            continue;
+        }
+
+        // Extend the copy forwards, then backwards over the pending bytes
+        size_t c = candidate;
+        size_t length = DELTA_MIN_MATCH;
+        while (c + length < base_n && i + length < n && base[c + length] == target[i + length]) {
+            length++;
+        }
+        while (i > pending && c > 0 && base[c - 1] == target[i - 1]) {
+            i--;
+            c--;
+            length++;
+        }
+
+        // Worst case size of an insert and a copy
+        size_t inserted = i - pending;
+        if ((size_t)(out_end - out) < 10 + inserted + 20) {
+            scratch_release(helper, mark);
+            return 0;
+        }
+        if (inserted > 0) {
+            put_varint(&out, inserted << 1);
+            memcpy(out, target + pending, inserted);
+            out += inserted;
+        }
+        put_varint(&out, length << 1 | 1);
+        put_varint(&out, c);
+        i += length;
+        pending = i;
+        copy_end = c + length;
+    }
+    size_t inserted = n - pending;
+    scratch_release(helper, mark);
+    if ((size_t)(out_end - out) < 10 + inserted) {
+        return 0;
+    }
+    if (inserted > 0) {
+        put_varint(&out, inserted << 1);
+        memcpy(out, target + pending, inserted);
+        out += inserted;
+    }
+    return out - dest;
+}
+
+/**
+* Rebuilds an object from its base and a delta made by delta_encode(). Every
+* instruction is checked against the base and the output.
+*
+* @param base The contents of the base object.
+* @param base_n The size of the base object.
+* @param delta The delta instructions.
+* @param delta_n The size of the delta.
+* @param dest The output buffer.
+* @param n The size of the object.
+* @return 0 if the delta rebuilt exactly n bytes, otherwise -1.
+*/
+int delta_apply(const unsigned char *base, size_t base_n, const unsigned char *delta,
+                size_t delta_n, unsigned char *dest, size_t n) {
+    const unsigned char *in = delta;
+    const unsigned char *in_end = delta + delta_n;
+    size_t o = 0;
+    while (in < in_end) {
+        size_t op;
+        if (get_varint(&in, in_end, &op) == -1) {
+            return -1;
+        }
+        size_t length = op >> 1;
+        if (length > n - o) {
+            return -1;
+        }
+        if (op & 1) {
+            size_t offset;
+            if (get_varint(&in, in_end, &offset) == -1 || offset > base_n
+                || length > base_n - offset) {
+                return -1;
+            }
+            memcpy(dest + o, base + offset, length);
+        } else {
+            if (length > (size_t)(in_end - in)) {
+                return -1;
+            }
+            memcpy(dest + o, in, length);
+            in += length;
+        }
+        o += length;
+    }
+    return o == n ? 0 : -1;
+}
+
+/**
+* Frees the delta base cache. Cached objects are named by their pack, so the
+* cache is cleared whenever the packs are unmapped.
+*
+* @param helper Data structure to pass program data between functions.
+*/
+void delta_cache_clear(void *helper) {
+    struct helper *svc = (struct helper *)helper;
+    struct delta_cache *cache = svc->delta_cache;
+    if (cache == NULL) {
+        return;
+    }
+    for (size_t i=0; i<DELTA_CACHE_SLOTS; i++) {
+        if (cache->slots[i].cap > 0) {
+            munmap(cache->slots[i].data, cache->slots[i].cap);
+        }
+    }
+    munmap(cache, sizeof(struct delta_cache));
+    svc->delta_cache = NULL;
+}
+
+/**
+* Returns the slot of the delta base cache that may hold an object, setting
+* up the cache on first use.
+*
+* @param helper Data structure to pass program data between functions.
+* @param pack The pack holding the object.
+* @param index The index entry of the object in the pack.
+* @return The slot.
+*/
+struct delta_cache_slot *delta_cache_slot(void *helper, struct pack *pack, uint32_t index) {
+    struct helper *svc = (struct helper *)helper;
+    if (svc->delta_cache == NULL) {
+        svc->delta_cache = mmap(NULL, sizeof(struct delta_cache), PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    uint64_t key = ((uint64_t)(pack - svc->packs) << 32 | index) * 0x9E3779B97F4A7C15ULL;
+    return svc->delta_cache->slots + (key >> 32) % DELTA_CACHE_SLOTS;
+}
+
+/**
+* Decodes an object in a pack into its contents. Objects stored as deltas
+* are rebuilt from their base, which is decoded first, and the rebuilt
+* objects are kept in the delta base cache, so walking through the versions
+* of a file decodes each version once. Compressed chunks are decompressed.
+*
+* @param helper Data structure to pass program data between functions.
+* @param pack The pack holding the object.
+* @param index The index entry of the object in the pack.
+* @param length The size of the contents if known, which tells compressed
+*               chunks apart, otherwise 0.
+* @param size Where the size of the contents is stored.
+* @param depth The number of deltas already being decoded.
+* @return The contents, which are valid until the next call, or NULL if the
+*         object is damaged.
+*/
+const unsigned char *pack_decode(void *helper, struct pack *pack, uint32_t index,
+                                 size_t length, size_t *size, unsigned int depth) {
+    struct helper *svc = (struct helper *)helper;
+    struct pack_entry *entry = pack->entries + index;
+    const unsigned char *stored = pack->data + entry->offset;
+    if (!(entry->type & OBJECT_DELTA)) {
+        if (length <= entry->size) {
+            *size = entry->size;
+            return stored;
+        }
+        unsigned char *contents = scratch_alloc(helper, length);
+        if (lz_decompress(stored, entry->size, contents, length) == -1) {
+            return NULL;
+        }
+        *size = length;
+        return contents;
+    }
+
+    struct delta_cache_slot *slot = delta_cache_slot(helper, pack, index);
+    if (slot->pack == pack && slot->index == index) {
+        svc->delta_cache->hits++;
+        *size = slot->size;
+        return slot->data;
+    }
+    svc->delta_cache->misses++;
+    struct delta_header header;
+    if (entry->size < sizeof(header) || depth >= DELTA_MAX_DEPTH) {
+        return NULL;
+    }
+    memcpy(&header, stored, sizeof(header));
+    if (header.base >= pack->index->n_entries) {
+        return NULL;
+    }
+    size_t base_size;
+    const unsigned char *base = pack_decode(helper, pack, header.base, header.base_length,
+                                            &base_size, depth + 1);
+    unsigned char *contents = scratch_alloc(helper, header.length);
+    if (base == NULL || delta_apply(base, base_size, stored + sizeof(header),
+                                    entry->size - sizeof(header), contents,
+                                    header.length) == -1) {
+        return NULL;
+    }
+
+    // Keep the object, growing the slot's buffer by whole pages
+    if (slot->cap < header.length) {
+        if (slot->cap > 0) {
+            munmap(slot->data, slot->cap);
+        }
+        slot->cap = (header.length + svc->page_size - 1) / svc->page_size * svc->page_size;
+        slot->data = mmap(NULL, slot->cap, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    memcpy(slot->data, contents, header.length);
+    slot->pack = pack;
+    slot->index = index;
+    slot->size = header.length;
+    *size = header.length;
+    return contents;
+}
+
+/**
+* Stores a chunk in the chunk directory if it is not already stored, either
+* there or in a pack. A chunk which compresses well is stored compressed.
+* Other chunks are copied from the file inside the kernel, and a chunk
+* holding the whole file is made a reflink of the file where possible. The
+* chunk is written under a temporary name and renamed into place, so a chunk
+* only exists once it is complete.
+*
+* @param helper Data structure to pass program data between functions.
+* @param id The hash of the chunk contents.
+* @param src_fd The file descriptor of the file the chunk is from.
+* @param data The contents of the chunk.
+* @param offset The offset of the chunk in the file.
+* @param n The length of the chunk.
+* @param whole 1 if the chunk is the whole file, otherwise 0.
+* @return 0 if the chunk is stored, or -1 if it could not be written.
+*/
+int store_chunk(void *helper, uint64_t id, int src_fd, const unsigned char *data,
+                size_t offset, size_t n, int whole) {
+    struct pack *pack;
+    char chunk_path[40];
+    object_path(chunk_path, id, OBJECT_CHUNK);
+    if (pack_find(helper, id, OBJECT_CHUNK, &pack) != NULL || access(chunk_path, F_OK) == 0) {
+        return 0;
+    }
+
+    // A temporary file left by an interrupted store is read-only, so it is
+    // removed rather than truncated
+    char tmp_path[48];
+    sprintf(tmp_path, "%s.tmp", chunk_path);
+    unlink(tmp_path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0444);
+    if (fd == -1) {
+        return -1;
+    }
+    unsigned char packed[CHUNK_MAX];
+    size_t packed_size = chunk_compress(data, n, packed);
+    int result;
+    if (packed_size > 0) {
+        result = write_full(fd, packed, packed_size);
+    } else if (!whole || file_clone(helper, src_fd, fd) == -1) {
+        result = copy_bytes(helper, src_fd, offset, fd, 0, n);
+    } else {
+        result = 0;
+    }
+    close(fd);
+    if (result == 0 && rename(tmp_path, chunk_path) == 0) {
+        return 0;
+    }
+    unlink(tmp_path);
+    return -1;
+}
+
+/**
+* Splits a file into content-defined chunks, stores each chunk that is not
+* already in the database and writes a manifest listing the chunks in order.
+*
+* @param helper Data structure to pass program data between functions.
+* @param file_path The file path of the file to be stored.
+* @param hash The hash of the file, which names its manifest.
+* @return 0 if the file is stored, or -1 if the file could not be read or a
+*         chunk or the manifest could not be written.
+*/
+int store_file(void *helper, char *file_path, uint64_t hash) {
+    int src_fd = open(file_path, O_RDONLY);
+    if (src_fd == -1) {
+        return -1;
+    }
+    struct stat sb;
+    if (fstat(src_fd, &sb) == -1) {
+        close(src_fd);
+        return -1;
+    }
+    size_t file_size = sb.st_size;
+    unsigned char *src = NULL;
+    if (file_size > 0) {
+        src = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, src_fd, 0);
+        if (src == MAP_FAILED) {
+            close(src_fd);
+            return -1;
+        }
+        madvise(src, file_size, MADV_SEQUENTIAL);
+    }
+
+    // The manifest is built in memory, with at most one chunk per CHUNK_MIN
+    // bytes, then written to the database in a single write.
+    size_t max_chunks = file_size / CHUNK_MIN + 1;
+    size_t manifest_size = sizeof(struct manifest)
+                           + max_chunks * sizeof(struct chunk_ref);
+    struct manifest *m = mmap(NULL, manifest_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) {
+        if (src != NULL) {
+            munmap(src, file_size);
+        }
+        close(src_fd);
+        return -1;
+    }
+    struct chunk_ref *refs = (struct chunk_ref *)(m + 1);
+    m->magic = MANIFEST_MAGIC;
+    m->n_chunks = 0;
+    m->file_size = file_size;
+
+    int result = 0;
+    size_t offset = 0;
+    while (offset < file_size && result == 0) {
+        size_t length = chunk_boundary(src + offset, file_size - offset);
+        uint64_t id = hash_bytes(src + offset, length);
+        result = store_chunk(helper, id, src_fd, src + offset, offset, length,
+                             length == file_size);
+        struct chunk_ref ref = {id, length};
+        refs[m->n_chunks] = ref;
+        m->n_chunks++;
+        offset += length;
+    }
+
+    // Write the manifest under a temporary name and rename it into place, so
+    // a manifest only exists once all of its chunks have been stored. No
+    // manifest is written if a chunk could not be stored.
+    if (result == 0) {
+        char manifest_path[40];
+        char tmp_path[48];
+        object_path(manifest_path, hash, OBJECT_MANIFEST);
+        sprintf(tmp_path, "%s.tmp", manifest_path);
+        unlink(tmp_path);
+        int dest_fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0444);
+        size_t used = sizeof(struct manifest) + m->n_chunks * sizeof(struct chunk_ref);
+        result = dest_fd == -1 ? -1 : write_full(dest_fd, m, used);
+        if (dest_fd != -1) {
+            close(dest_fd);
+        }
+        if (result == 0) {
+            result = rename(tmp_path, manifest_path);
+        }
+        if (result == -1) {
+            unlink(tmp_path);
+        }
+    }
+
+    munmap(m, manifest_size);
+    if (src != NULL) {
+        munmap(src, file_size);
+    }
+    close(src_fd);
+    return result;
+}
+
+/**
+* Rebuilds a file from the chunks listed in its manifest. Each raw chunk is
+* copied into its position in the file inside the kernel, and compressed
+* chunks are decompressed straight into a mapping of the file. A file made of
+* a single raw chunk is a reflink of the chunk where possible, or optionally
+* a hard link to it. Manifests and chunks are read from their own files or
+* from a pack. Objects stored before chunking was introduced are copied as a
+* whole.
+*
+* @param helper Data structure to pass program data between functions.
+* @param hash The hash of the file version to restore.
+* @param file_path The destination file path to restore the file to.
+* @param link 1 to restore files made of a single chunk as hard links to the
+*             chunk, which are read-only and must not be edited in place.
+* @return 0 if successful, or -1 if the manifest or a chunk is missing or
+*         damaged, or the file could not be written.
+*/
+int restore_file(void *helper, uint64_t hash, char *file_path, int link) {
+    size_t mark = scratch_mark(helper);
+    struct object manifest;
+    if (object_open(helper, hash, OBJECT_MANIFEST, &manifest) == -1) {
+        return -1;
+    }
+    const struct manifest *m = NULL;
+    if (manifest.size >= sizeof(struct manifest)) {
+        m = (const struct manifest *)object_data(&manifest);
+    }
+    if (m == NULL || m->magic != MANIFEST_MAGIC) {
+        file_unshare(file_path);
+        int dest_fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        int result = -1;
+        if (dest_fd != -1) {
+            if (!manifest.loose || (result = file_clone(helper, manifest.fd, dest_fd)) == -1) {
+                result = copy_bytes(helper, manifest.fd, manifest.offset, dest_fd, 0,
+                                    manifest.size);
+            }
+            close(dest_fd);
+        }
+        object_close(&manifest);
+        scratch_release(helper, mark);
+        return result;
+    }
+    const struct chunk_ref *refs = (const struct chunk_ref *)(m + 1);
+    struct object chunk;
+    if (link && m->n_chunks == 1
+        && object_open(helper, refs[0].id, OBJECT_CHUNK, &chunk) == 0) {
+        // Only raw chunks in files of their own can be linked
+        int linked = 0;
+        if (chunk.loose && chunk.size == refs[0].length) {
+            char chunk_path[40];
+            object_path(chunk_path, refs[0].id, OBJECT_CHUNK);
+            unlink(file_path);
+            linked = linkat(AT_FDCWD, chunk_path, AT_FDCWD, file_path, 0) == 0;
+        }
+        object_close(&chunk);
+        if (linked) {
+            object_close(&manifest);
+            scratch_release(helper, mark);
+            return 0;
+        }
+    }
+
+    // Copy each chunk into its position in the destination file, stopping at
+    // the first chunk which cannot be restored
+    file_unshare(file_path);
+    int dest_fd = open(file_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    int result = dest_fd == -1 ? -1 : 0;
+    unsigned char *dest = NULL;
+    size_t offset = 0;
+    for (unsigned int i=0; i<m->n_chunks && result == 0; i++) {
+        if (object_open(helper, refs[i].id, OBJECT_CHUNK, &chunk) == -1) {
+            result = -1;
+            break;
+        }
+        if (chunk.size < refs[i].length || chunk.fd == -1) {
+            // The file is sized and mapped at the first chunk which is
+            // compressed or was decoded from a delta
+            if (dest == NULL && ftruncate(dest_fd, m->file_size) == 0) {
+                dest = mmap(NULL, m->file_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, dest_fd, 0);
+            }
+            const unsigned char *packed = object_data(&chunk);
+            if (dest == NULL || dest == MAP_FAILED || packed == NULL) {
+                result = -1;
+            } else if (chunk.fd != -1) {
+                result = lz_decompress(packed, chunk.size, dest + offset, refs[i].length);
+            } else if (chunk.size == refs[i].length) {
+                memcpy(dest + offset, packed, refs[i].length);
+            } else {
+                result = -1;
+            }
+        } else if (m->n_chunks > 1 || !chunk.loose || file_clone(helper, chunk.fd, dest_fd) == -1) {
+            result = copy_bytes(helper, chunk.fd, chunk.offset, dest_fd, offset, refs[i].length);
+        }
+        object_close(&chunk);
+        offset += refs[i].length;
+    }
+    if (dest != NULL && dest != MAP_FAILED) {
+        munmap(dest, m->file_size);
+    }
+    if (dest_fd != -1) {
+        close(dest_fd);
+    }
+    object_close(&manifest);
+    scratch_release(helper, mark);
+    return result;
+}
+
+/**
+* Given an array of file objects, updates the database directory to contain
+* those files. All files are stored in the database as their hash to ensure
+* different file versions are distinguishable. Each file version is stored as
+* a manifest of content-defined chunks, and chunks are shared between all
+* file versions, so only the chunks containing changed bytes are written.
+* Files are stored through io_uring in batches if it is available.
+*
+* @param helper Data structure to pass program data between functions.
+* @param files The array of file objects to write to the database.
+* @param n_files The size of the file array.
+* @return 0 if successful, or -1 if a file could not be stored.
+*/
+int update_database(void *helper, struct file *files, size_t n_files) {
+    if (uring_get(helper) != NULL) {
+        return uring_store_files(helper, files, n_files);
+    }
+    int result = 0;
+    for (size_t i=0; i<n_files; i++) {
+        if (object_exists(helper, files[i].hash, OBJECT_MANIFEST)) {
+            continue;
+        }
+        if (store_file(helper, path_name(helper, files[i].path), files[i].hash) == -1) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/**
+* Given an array of file objects, restores the working directory to match the
+* files specified in the array. The restored files are rebuilt from their
+* chunks in the database directory without reading the chunks into memory,
+* or through io_uring in batches of small files if it is available.
+*
+* @param helper Data structure to pass program data between functions.
+* @param files The array of file objects to be restored.
+* @param n_files The size of the file array.
+* @param overwrite Restoration will overwrite existing files if overwrite is 1.
+* @return 0 if successful, or -1 if a file could not be restored.
+*/
+int update_working_directory(void *helper, struct file *files, size_t n_files,
+                             int overwrite) {
+    struct helper *svc = (struct helper *)helper;
+    if (overwrite == 1 && !svc->link_objects && uring_get(helper) != NULL) {
+        return uring_restore_files(helper, files, n_files);
+    }
+    int result = 0;
+    for (size_t i=0; i<n_files; i++) {
+        char *file_name = path_name(helper, files[i].path);
+        if (overwrite == 0) {
+            if (file_exists(file_name)) {
+                continue;
+            }
+        }
+        if (restore_file(helper, files[i].hash, file_name, svc->link_objects) == -1) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/**
+* Counts or lists the objects stored as files of their own in one directory.
+*
+* @param dir_path The database directory or the chunk directory.
+* @param type The type of the objects in the directory.
+* @param items The array to list the objects into, or NULL to count them.
+* @return The number of objects.
+*/
+size_t repack_list_loose(char *dir_path, unsigned int type, struct pack_item *items) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        return 0;
+    }
+    size_t n_items = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char *name = entry->d_name;
+        if (strlen(name) != 16 || strspn(name, "0123456789abcdef") != 16) {
+            continue;
+        }
+        if (items == NULL) {
+            n_items++;
+            continue;
+        }
+
+        // Objects too large for a pack entry stay as files of their own
+        struct stat sb;
+        char path[40];
+        uint64_t id = strtoull(name, NULL, 16);
+        object_path(path, id, type);
+        if (stat(path, &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_size > UINT32_MAX) {
+            continue;
+        }
+        struct pack_entry object = {id, 0, sb.st_size, type};
+        items[n_items].entry = object;
+        items[n_items].pack = NULL;
+        n_items++;
+    }
+    closedir(dir);
+    return n_items;
+}
+
+/**
+* Orders objects for a pack by id and type, with objects stored as files of
+* their own before packed copies of the same object.
+*/
+int pack_item_cmp(const void *a, const void *b) {
+    const struct pack_item *x = (const struct pack_item *)a;
+    const struct pack_item *y = (const struct pack_item *)b;
+    if (x->entry.id != y->entry.id) {
+        return x->entry.id < y->entry.id ? -1 : 1;
+    }
+    unsigned int x_type = x->entry.type & ~OBJECT_DELTA;
+    unsigned int y_type = y->entry.type & ~OBJECT_DELTA;
+    if (x_type != y_type) {
+        return x_type < y_type ? -1 : 1;
+    }
+    return (x->pack != NULL) - (y->pack != NULL);
+}
+
+/**
+* Finds an object among the sorted objects being packed.
+*
+* @param items The sorted objects, with one copy of each.
+* @param n_items The number of objects.
+* @param id The hash of the object.
+* @param type OBJECT_MANIFEST or OBJECT_CHUNK.
+* @return The index of the object, or NULL_ID if it is not being packed.
+*/
+uint32_t pack_item_find(struct pack_item *items, size_t n_items, uint64_t id,
+                        unsigned int type) {
+    size_t lo = 0;
+    size_t hi = n_items;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        struct pack_entry *entry = &items[mid].entry;
+        if (entry->id < id || (entry->id == id && (entry->type & ~OBJECT_DELTA) < type)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < n_items && items[lo].entry.id == id
+        && (items[lo].entry.type & ~OBJECT_DELTA) == type) {
+        return lo;
+    }
+    return NULL_ID;
+}
+
+/**
+* Picks delta bases for the objects of a file version from the previous
+* version of the same path. The manifest's base is the previous manifest,
+* and each new chunk's base is the previous chunk at the same offset in the
+* file. Objects keep the first base picked for them.
+*
+* @param helper Data structure to pass program data between functions.
+* @param items The sorted objects being packed.
+* @param n_items The number of objects.
+* @param old_hash The hash of the previous version.
+* @param new_hash The hash of the new version.
+*/
+void repack_pair(void *helper, struct pack_item *items, size_t n_items,
+                 uint64_t old_hash, uint64_t new_hash) {
+    uint32_t old_index = pack_item_find(items, n_items, old_hash, OBJECT_MANIFEST);
+    uint32_t new_index = pack_item_find(items, n_items, new_hash, OBJECT_MANIFEST);
+    if (old_index == NULL_ID || new_index == NULL_ID) {
+        return;
+    }
+    struct object old_object;
+    struct object new_object;
+    if (object_open(helper, old_hash, OBJECT_MANIFEST, &old_object) == -1) {
+        return;
+    }
+    if (object_open(helper, new_hash, OBJECT_MANIFEST, &new_object) == -1) {
+        object_close(&old_object);
+        return;
+    }
+    const struct manifest *old_m = (const struct manifest *)object_data(&old_object);
+    const struct manifest *new_m = (const struct manifest *)object_data(&new_object);
+
+    // Objects stored before chunking was introduced are never deltas
+    if (old_object.size >= sizeof(struct manifest) && new_object.size >= sizeof(struct manifest)
+        && old_m != NULL && new_m != NULL && old_m->magic == MANIFEST_MAGIC
+        && new_m->magic == MANIFEST_MAGIC) {
+        if (items[new_index].base == NULL_ID) {
+            items[new_index].base = old_index;
+        }
+        const struct chunk_ref *old_refs = (const struct chunk_ref *)(old_m + 1);
+        const struct chunk_ref *new_refs = (const struct chunk_ref *)(new_m + 1);
+        size_t j = 0;
+        size_t old_offset = 0;
+        size_t new_offset = 0;
+        for (size_t i=0; i<new_m->n_chunks && old_m->n_chunks > 0; i++) {
+            // Find the previous chunk covering this chunk's offset
+            while (j + 1 < old_m->n_chunks && old_offset + old_refs[j].length <= new_offset) {
+                old_offset += old_refs[j].length;
+                j++;
+            }
+            uint32_t target = pack_item_find(items, n_items, new_refs[i].id, OBJECT_CHUNK);
+            uint32_t base = pack_item_find(items, n_items, old_refs[j].id, OBJECT_CHUNK);
+            if (target != NULL_ID && base != NULL_ID && target != base
+                && items[target].base == NULL_ID) {
+                items[target].base = base;
+                items[target].length = new_refs[i].length;
+                items[base].length = old_refs[j].length;
+            }
+            new_offset += new_refs[i].length;
+        }
+    }
+    object_close(&new_object);
+    object_close(&old_object);
+}
+
+/**
+* Limits the length of delta chains. Following bases from each object, an
+* object whose chain would be longer than DELTA_MAX_DEPTH, or would lead back
+* to itself, is stored whole instead, which starts a new chain.
+*
+* @param helper Data structure to pass program data between functions.
+* @param items The objects being packed, with their bases picked.
+* @param n_items The number of objects.
+*/
+void repack_depths(void *helper, struct pack_item *items, size_t n_items) {
+    size_t mark = scratch_mark(helper);
+    uint32_t *chain = scratch_alloc(helper, n_items * sizeof(uint32_t));
+    for (size_t i=0; i<n_items; i++) {
+        items[i].depth = items[i].base == NULL_ID ? 0 : -1;
+    }
+    for (size_t i=0; i<n_items; i++) {
+        while (items[i].depth == -1) {
+            // Walk to an object whose depth is known, marking the chain
+            size_t n_chain = 0;
+            uint32_t k = i;
+            while (items[k].depth == -1) {
+                items[k].depth = -2;
+                chain[n_chain++] = k;
+                k = items[k].base;
+            }
+
+            // A chain leading back to an object on it is broken there
+            if (items[k].depth == -2) {
+                for (size_t c=0; c<n_chain; c++) {
+                    items[chain[c]].depth = -1;
+                }
+                items[k].base = NULL_ID;
+                items[k].depth = 0;
+                continue;
+            }
+            int depth = items[k].depth;
+            while (n_chain > 0) {
+                k = chain[--n_chain];
+                depth = depth == DELTA_MAX_DEPTH ? 0 : depth + 1;
+                if (depth == 0) {
+                    items[k].base = NULL_ID;
+                }
+                items[k].depth = depth;
+            }
+        }
+    }
+    scratch_release(helper, mark);
+}
+
+/**
+* Reads the contents of an object being packed into the scratch arena,
+* decoding deltas and decompressing chunks.
+*
+* @param helper Data structure to pass program data between functions.
+* @param item The object.
+* @param size Where the size of the contents is stored.
+* @return The contents, or NULL if the object cannot be read.
+*/
+unsigned char *repack_load(void *helper, struct pack_item *item, size_t *size) {
+    struct object object;
+    unsigned int type = item->entry.type & ~OBJECT_DELTA;
+    if (object_open(helper, item->entry.id, type, &object) == -1) {
+        return NULL;
+    }
+    const unsigned char *data = object_data(&object);
+    unsigned char *contents = NULL;
+    if (object.fd != -1 && type == OBJECT_CHUNK && item->length > object.size) {
+        contents = scratch_alloc(helper, item->length);
+        *size = item->length;
+        if (data == NULL || lz_decompress(data, object.size, contents, item->length) == -1) {
+            contents = NULL;
+        }
+    } else if (data != NULL || object.size == 0) {
+        contents = scratch_alloc(helper, object.size);
+        memcpy(contents, data, object.size);
+        *size = object.size;
+    }
+    object_close(&object);
+    return contents;
+}
+
+/**
+* Writes an object to a new pack. Objects with a base are encoded as a delta
+* if the delta is much smaller than the object as stored. Objects that were
+* deltas in an old pack and have no base now are decoded, and compressed if
+* they are chunks. Other objects are copied inside the kernel.
+*
+* @param helper Data structure to pass program data between functions.
+* @param items The objects being packed.
+* @param i The index of the object to write.
+* @param entry The object's entry in the new index, whose offset is set. Its
+*              size and type are updated.
+* @param pack_fd The file descriptor of the new pack.
+* @return 0 if successful, otherwise -1.
+*/
+int repack_write(void *helper, struct pack_item *items, size_t i, struct pack_entry *entry,
+                 int pack_fd) {
+    struct pack_item *item = items + i;
+    size_t mark = scratch_mark(helper);
+    unsigned char *contents = NULL;
+    size_t size = 0;
+    if (item->base != NULL_ID || (item->entry.type & OBJECT_DELTA)) {
+        contents = repack_load(helper, item, &size);
+        if (contents == NULL) {
+            scratch_release(helper, mark);
+            return -1;
+        }
+    }
+
+    // Encode a delta against the base, which must save a quarter of the size
+    if (item->base != NULL_ID) {
+        size_t base_size;
+        unsigned char *base = repack_load(helper, items + item->base, &base_size);
+        size_t stored = item->entry.type & OBJECT_DELTA ? size : item->entry.size;
+        size_t limit = stored - stored/DELTA_MIN_SAVING;
+        unsigned char *delta = scratch_alloc(helper, sizeof(struct delta_header) + limit);
+        size_t delta_size = 0;
+        if (base != NULL && limit > sizeof(struct delta_header)) {
+            delta_size = delta_encode(helper, base, base_size, contents, size,
+                                      delta + sizeof(struct delta_header),
+                                      limit - sizeof(struct delta_header));
+        }
+        if (delta_size > 0) {
+            struct delta_header header = {item->base, base_size, size};
+            memcpy(delta, &header, sizeof(header));
+            entry->type = (item->entry.type & ~OBJECT_DELTA) | OBJECT_DELTA;
+            entry->size = sizeof(header) + delta_size;
+            int result = pwrite_full(pack_fd, delta, entry->size, entry->offset);
+            scratch_release(helper, mark);
+            return result;
+        }
+        item->base = NULL_ID;
+    }
+    entry->type = item->entry.type & ~OBJECT_DELTA;
+    if (contents == NULL) {
+        entry->size = item->entry.size;
+        int result = 0;
+        if (item->pack != NULL) {
+            result = copy_bytes(helper, item->pack->fd, item->entry.offset, pack_fd, entry->offset,
+                                entry->size);
+        } else {
+            char path[40];
+            object_path(path, entry->id, entry->type);
+            int fd = open(path, O_RDONLY);
+            result = fd == -1 ? -1 : copy_bytes(helper, fd, 0, pack_fd, entry->offset, entry->size);
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+        scratch_release(helper, mark);
+        return result;
+    }
+
+    // Write the decoded object, compressing chunks that compress well
+    if (entry->type == OBJECT_CHUNK && size <= CHUNK_MAX) {
+        unsigned char *packed = scratch_alloc(helper, size);
+        size_t packed_size = chunk_compress(contents, size, packed);
+        if (packed_size > 0) {
+            contents = packed;
+            size = packed_size;
+        }
+    }
+    entry->size = size;
+    int result = pwrite_full(pack_fd, contents, size, entry->offset);
+    scratch_release(helper, mark);
+    return result;
+}
+
+/**
+* Consolidates the objects stored as files of their own and every existing
+* pack into a single pack, then removes the files and the old packs. Each
+* commit's modified files pick the previous version of the same path as the
+* delta base of their manifest and new chunks, with chains limited to
+* DELTA_MAX_DEPTH. Other objects are copied into the pack inside the kernel.
+* The pack is named by the hash of its index, and the index is written last,
+* so a pack is only used once it is complete. The pack, the index and the
+* pack directory are synced before the old copies of the objects are removed.
+*
+* @param helper Data structure to pass program data between functions.
+* @return The number of objects in the pack, or -1 if it cannot be written.
+*/
+int svc_repack(void *helper) {
+    return repack_objects(helper, NULL);
+}
+
+/**
+* Writes the pack for svc_repack(), leaving out the objects that a garbage
+* collection did not mark.
+*
+* @param helper Data structure to pass program data between functions.
+* @param marks The objects to keep, or NULL to keep every object.
+* @return The number of objects in the pack, or -1 if it cannot be written.
+*/
+int repack_objects(void *helper, struct gc_marks *marks) {
+    struct helper *svc = (struct helper *)helper;
+    if (!svc->packs_loaded) {
+        pack_load(helper);
+    }
+    size_t mark = scratch_mark(helper);
+
+    // List the loose objects followed by the objects in every pack
+    size_t n_loose = repack_list_loose("svc_db", OBJECT_MANIFEST, NULL)
+                     + repack_list_loose(CHUNK_DIR, OBJECT_CHUNK, NULL);
+    size_t n_items = n_loose;
+    for (size_t p=0; p<svc->n_packs; p++) {
+        n_items += svc->packs[p].index->n_entries;
+    }
+    if (marks == NULL && n_loose == 0 && svc->n_packs <= 1) {
+        scratch_release(helper, mark);
+        return svc->n_packs == 1 ? (int)svc->packs[0].index->n_entries : 0;
+    }
+    struct pack_item *items = scratch_alloc(helper, n_items * sizeof(struct pack_item));
+    n_loose = repack_list_loose("svc_db", OBJECT_MANIFEST, items);
+    n_loose += repack_list_loose(CHUNK_DIR, OBJECT_CHUNK, items + n_loose);
+    n_items = n_loose;
+    for (size_t p=0; p<svc->n_packs; p++) {
+        struct pack *pack = svc->packs + p;
+        for (size_t i=0; i<pack->index->n_entries; i++) {
+            items[n_items].entry = pack->entries[i];
+            items[n_items].pack = pack;
+            n_items++;
+        }
+    }
+
+    // Leave out the objects a garbage collection found unreachable
+    if (marks != NULL) {
+        size_t n_kept = 0;
+        for (size_t i=0; i<n_items; i++) {
+            if (gc_marked(marks, items[i].entry.id, items[i].entry.type & ~OBJECT_DELTA)) {
+                items[n_kept++] = items[i];
+            }
+        }
+        n_items = n_kept;
+    }
+
+    // Sort the objects, keeping one copy of each
+    qsort(items, n_items, sizeof(struct pack_item), pack_item_cmp);
+    size_t n_entries = 0;
+    for (size_t i=0; i<n_items; i++) {
+        if (n_entries > 0 && items[i].entry.id == items[n_entries - 1].entry.id
+            && ((items[i].entry.type ^ items[n_entries - 1].entry.type) & ~OBJECT_DELTA) == 0) {
+            continue;
+        }
+        items[n_entries] = items[i];
+        items[n_entries].base = NULL_ID;
+        items[n_entries].length = 0;
+        n_entries++;
+    }
+
+    // Pick delta bases from the files each commit modified
+    for (size_t c=0; c<svc->n_commits; c++) {
+        size_t parent = svc->commits[c].parent;
+        if (parent == NULL_ID) {
+            continue;
+        }
+        size_t commit_mark = scratch_mark(helper);
+        struct file *old_files = tree_map(helper, svc->commits[parent].tree);
+        struct file *new_files = tree_map(helper, svc->commits[c].tree);
+        struct change *changes;
+        size_t n_changes;
+        get_changes(helper, &changes, &n_changes, old_files, svc->commits[parent].n_files,
+                    new_files, svc->commits[c].n_files);
+        for (size_t i=0; i<n_changes; i++) {
+            if (changes[i].removed_file != NULL && changes[i].added_file != NULL) {
+                repack_pair(helper, items, n_entries, changes[i].removed_file->hash,
+                            changes[i].added_file->hash);
+            }
+        }
+        scratch_release(helper, commit_mark);
+    }
+    repack_depths(helper, items, n_entries);
+
+    // Write the objects in order, then build the index
+    char *tmp_path = PACK_DIR "/repack.tmp";
+    int pack_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0444);
+    size_t header_size = sizeof(struct pack_index);
+    struct pack_index *index = scratch_alloc(helper, header_size
+                                             + n_entries * sizeof(struct pack_entry));
+    struct pack_entry *entries = (struct pack_entry *)(index + 1);
+    memset(index, 0, header_size);
+    index->magic = PACK_MAGIC;
+    index->n_entries = n_entries;
+    int failed = pack_fd == -1;
+    uint64_t offset = 0;
+    for (size_t i=0; i<n_entries && !failed; i++) {
+        // Objects start on aligned offsets, so that manifests can be read in
+        // place from the mapped pack
+        entries[i] = items[i].entry;
+        entries[i].offset = offset;
+        failed = repack_write(helper, items, i, entries + i, pack_fd) == -1;
+        offset = (offset + entries[i].size + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+        index->fanout[entries[i].id >> 56]++;
+    }
+    if (pack_fd != -1) {
+        failed = failed || fsync(pack_fd) == -1;
+        close(pack_fd);
+    }
+    for (int b=1; b<256; b++) {
+        index->fanout[b] += index->fanout[b - 1];
+    }
+    size_t index_size = header_size + n_entries * sizeof(struct pack_entry);
+    char name[17];
+    sprintf(name, "%016lx", hash_bytes((unsigned char *)index, index_size));
+    char pack_path[48];
+    char index_path[48];
+    sprintf(pack_path, PACK_DIR "/%s.pack", name);
+    sprintf(index_path, PACK_DIR "/%s.idx", name);
+    if (failed || rename(tmp_path, pack_path) == -1) {
+        unlink(tmp_path);
+        scratch_release(helper, mark);
+        return -1;
+    }
+    int index_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0444);
+    if (index_fd == -1 || write_full(index_fd, index, index_size) == -1
+        || fsync(index_fd) == -1 || rename(tmp_path, index_path) == -1) {
+        if (index_fd != -1) {
+            close(index_fd);
+        }
+        unlink(tmp_path);
+        unlink(pack_path);
+        scratch_release(helper, mark);
+        return -1;
+    }
+    close(index_fd);
+
+    // The new pack and index must be on disk under their names before any
+    // other copy of their objects is removed, or a crash could lose them
+    int dir_fd = open(PACK_DIR, O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1 || fsync(dir_fd) == -1) {
+        if (dir_fd != -1) {
+            close(dir_fd);
+        }
+        scratch_release(helper, mark);
+        return -1;
+    }
+    close(dir_fd);
+
+    // Remove the old packs and the loose objects, which are all in the new
+    // pack. Each old pack's index is removed first, so that it is no longer
+    // used.
+    for (size_t p=0; p<svc->n_packs; p++) {
+        if (strcmp(svc->packs[p].name, name) != 0) {
+            char path[48];
+            sprintf(path, PACK_DIR "/%s.idx", svc->packs[p].name);
+            unlink(path);
+            sprintf(path, PACK_DIR "/%s.pack", svc->packs[p].name);
+            unlink(path);
+        }
+    }
+    for (size_t i=0; i<n_entries; i++) {
+        if (items[i].pack == NULL) {
+            char path[40];
+            object_path(path, entries[i].id, entries[i].type & ~OBJECT_DELTA);
+            unlink(path);
+        }
+    }
+    pack_unload(helper);
+    scratch_release(helper, mark);
+    return n_entries;
+}
+
+/**
+* Sets up an empty mark set in the scratch arena.
+*
+* @param helper Data structure to pass program data between functions.
+* @param set The mark set.
+* @param n_keys The most keys the set must hold.
+*/
+void mark_set_init(void *helper, struct mark_set *set, size_t n_keys) {
+    set->cap = CAP_INIT_TABLE;
+    while (set->cap < n_keys * 2) {
+        set->cap *= CAP_GROWTH;
+    }
+    set->keys = scratch_alloc(helper, set->cap * sizeof(uint64_t));
+    memset((void *)set->keys, 0, set->cap * sizeof(uint64_t));
+    atomic_init(&set->has_zero, 0);
+    atomic_init(&set->full, 0);
+}
+
+/**
+* Adds a key to a mark set. Any number of threads may add keys at once, and
+* exactly one of the threads adding the same key is told that it is new.
+*
+* @param set The mark set.
+* @param key The key to add.
+* @return 1 if the key was not in the set, otherwise 0. If the set is full,
+*         0 is returned and the set's full flag is raised.
+*/
+int mark_set_add(struct mark_set *set, uint64_t key) {
+    if (key == 0) {
+        return atomic_exchange(&set->has_zero, 1) == 0;
+    }
+    size_t mask = set->cap - 1;
+    size_t i = ((key * HASH_PRIME64_1) >> 32) & mask;
+    for (size_t n=0; n<set->cap; n++) {
+        uint64_t current = atomic_load_explicit(set->keys + i, memory_order_relaxed);
+        if (current == 0 && atomic_compare_exchange_strong(set->keys + i, &current, key)) {
+            return 1;
+        }
+        if (current == key) {
+            return 0;
+        }
+        i = (i + 1) & mask;
+    }
+    atomic_store(&set->full, 1);
+    return 0;
+}
+
+/**
+* Checks whether a key is in a mark set.
+*
+* @param set The mark set.
+* @param key The key to look for.
+* @return 1 if the key is in the set, otherwise 0.
+*/
+int mark_set_has(struct mark_set *set, uint64_t key) {
+    if (key == 0) {
+        return atomic_load(&set->has_zero);
+    }
+    size_t mask = set->cap - 1;
+    size_t i = ((key * HASH_PRIME64_1) >> 32) & mask;
+    for (size_t n=0; n<set->cap; n++) {
+        uint64_t current = atomic_load_explicit(set->keys + i, memory_order_relaxed);
+        if (current == key) {
+            return 1;
+        }
+        if (current == 0) {
+            return 0;
+        }
+        i = (i + 1) & mask;
+    }
+    return 0;
+}
+
+/**
+* Checks whether a garbage collection marked an object.
+*
+* @param marks The marks of the collection.
+* @param id The hash of the object.
+* @param type OBJECT_MANIFEST or OBJECT_CHUNK.
+* @return 1 if the object is reachable, otherwise 0.
+*/
+int gc_marked(struct gc_marks *marks, uint64_t id, unsigned int type) {
+    return mark_set_has(type == OBJECT_CHUNK ? &marks->chunks : &marks->manifests, id);
+}
+
+/**
+* Marks the file versions below a tree node. A node shared with a tree that
+* was already walked, possibly by another thread, is not walked again.
+*
+* @param marks The marks of the collection.
+* @param node The tree node, or NULL for an empty tree.
+*/
+void gc_mark_tree(struct gc_marks *marks, struct tree_node *node) {
+    if (node == NULL || !mark_set_add(&marks->nodes, (uint64_t)(uintptr_t)node)) {
+        return;
+    }
+    if (node->level == 0) {
+        struct file *files = node_files(node);
+        for (size_t i=0; i<node->n_entries; i++) {
+            mark_set_add(&marks->manifests, files[i].hash);
+        }
+        return;
+    }
+    struct tree_child *children = node_children(node);
+    for (size_t i=0; i<node->n_entries; i++) {
+        gc_mark_tree(marks, children[i].node);
+    }
+}
+
+/**
+* Marks the chunks listed by a manifest. Objects stored before chunking was
+* introduced have no manifest, and hold the file itself.
+*
+* @param marks The marks of the collection.
+* @param data The contents of the object.
+* @param size The size of the object.
+*/
+void gc_mark_manifest(struct gc_marks *marks, const unsigned char *data, size_t size) {
+    const struct manifest *m = (const struct manifest *)data;
+    if (data == NULL || size < sizeof(struct manifest) || m->magic != MANIFEST_MAGIC
+        || size < sizeof(struct manifest) + m->n_chunks * sizeof(struct chunk_ref)) {
+        return;
+    }
+    const struct chunk_ref *refs = (const struct chunk_ref *)(m + 1);
+    for (size_t i=0; i<m->n_chunks; i++) {
+        mark_set_add(&marks->chunks, refs[i].id);
+    }
+}
+
+/**
+* Marks the chunks of a reachable manifest. A manifest which is not stored,
+* such as that of a file staged since the last commit, has nothing to mark.
+*
+* @param helper Data structure to pass program data between functions.
+* @param marks The marks of the collection.
+* @param id The hash of the manifest.
+* @return 0 if successful, or -1 if the manifest is stored but cannot be read.
+*/
+int gc_mark_object(void *helper, struct gc_marks *marks, uint64_t id) {
+    struct object object;
+    if (object_open(helper, id, OBJECT_MANIFEST, &object) == -1) {
+        return object_exists(helper, id, OBJECT_MANIFEST) ? -1 : 0;
+    }
+    const unsigned char *data = object_data(&object);
+    int result = data == NULL && object.size > 0 ? -1 : 0;
+    if (result == 0) {
+        gc_mark_manifest(marks, data, object.size);
+    }
+    object_close(&object);
+    return result;
+}
+
+// The arguments shared by the tasks marking the objects of a collection.
+// failed is raised if a reachable manifest cannot be read, as its chunks are
+// then not marked.
+struct gc_batch {
+    void *helper;
+    struct gc_marks *marks;
+    size_t *commits;
+    uint64_t *manifests;
+    int *deferred;
+    atomic_int failed;
+};
+
+/**
+* Marks the file versions of one reachable commit, used as a parallel_for()
+* task.
+*
+* @param arg The collection batch.
+* @param i The index of the commit in the batch.
+*/
+void gc_mark_commit_task(void *arg, size_t i) {
+    struct gc_batch *batch = (struct gc_batch *)arg;
+    struct helper *svc = (struct helper *)batch->helper;
+    gc_mark_tree(batch->marks, svc->commits[batch->commits[i]].tree);
+}
+
+/**
+* Marks the chunks of one reachable manifest, used as a parallel_for() task.
+* Manifests packed as deltas are decoded through the scratch arena, which is
+* not shared between threads, so they are marked with deferred and left for
+* the calling thread.
+*
+* @param arg The collection batch.
+* @param i The index of the manifest in the batch.
+*/
+void gc_mark_chunks_task(void *arg, size_t i) {
+    struct gc_batch *batch = (struct gc_batch *)arg;
+    struct pack *pack;
+    struct pack_entry *entry = pack_find(batch->helper, batch->manifests[i],
+                                         OBJECT_MANIFEST, &pack);
+    if (entry != NULL && (entry->type & OBJECT_DELTA)) {
+        batch->deferred[i] = 1;
+        return;
+    }
+    if (gc_mark_object(batch->helper, batch->marks, batch->manifests[i]) == -1) {
+        atomic_store(&batch->failed, 1);
+    }
+}
+
+/**
+* Counts the bytes of the objects stored as files of their own in one
+* directory which a collection did not mark, and removes them.
+*
+* @param dir_path The database directory or the chunk directory.
+* @param type The type of the objects in the directory.
+* @param marks The marks of the collection.
+* @param dry_run 1 to only count the bytes.
+* @return The number of bytes.
+*/
+size_t gc_sweep_loose(char *dir_path, unsigned int type, struct gc_marks *marks,
+                      int dry_run) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        return 0;
+    }
+    size_t n_bytes = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char *name = entry->d_name;
+        uint64_t id = strtoull(name, NULL, 16);
+        if (strlen(name) != 16 || strspn(name, "0123456789abcdef") != 16
+            || gc_marked(marks, id, type)) {
+            continue;
+        }
+        struct stat sb;
+        char path[40];
+        object_path(path, id, type);
+        if (stat(path, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+            continue;
+        }
+        n_bytes += sb.st_size;
+        if (!dry_run) {
+            unlink(path);
+        }
+    }
+    closedir(dir);
+    return n_bytes;
+}
+
+/**
+* Removes the objects in the database which are not used by any commit
+* reachable from a branch, nor by a file in the index. The reachable commits
+* are found by following parents from every branch. Their trees are then
+* walked in parallel, with each node shared between commits walked once, and
+* the manifests of the file versions found are read in parallel to mark their
+* chunks. Unmarked loose objects are removed, and packs holding unmarked
+* objects are repacked without them. Commits which are not reachable keep
+* their place in the history, but their files can no longer be restored.
+*
+* @param helper Data structure to pass program data between functions.
+* @param dry_run 1 to only count the bytes that would be reclaimed.
+* @return The number of bytes taken by the unreachable objects as stored, or
+*         -1 if the objects could not all be marked or the packs could not be
+*         rewritten, in which case nothing is removed.
+*/
+ssize_t svc_gc(void *helper, int dry_run) {
+    struct helper *svc = (struct helper *)helper;
+    pack_load(helper);
+    size_t mark = scratch_mark(helper);
+
+    // Find the commits reachable from the branches, in breadth-first order
+    unsigned char *seen = scratch_alloc(helper, svc->n_commits);
+    memset(seen, 0, svc->n_commits);
+    size_t *commits = scratch_alloc(helper, svc->n_commits * sizeof(size_t));
+    size_t n_commits = 0;
+    for (size_t b=0; b<svc->n_branches; b++) {
+        size_t c = svc->branches[b].ref_commit;
+        if (c != NULL_ID && !seen[c]) {
+            seen[c] = 1;
+            commits[n_commits++] = c;
+        }
+    }
+    for (size_t i=0; i<n_commits; i++) {
+        size_t parents[2] = {svc->commits[commits[i]].parent, svc->commits[commits[i]].parent2};
+        for (int p=0; p<2; p++) {
+            if (parents[p] != NULL_ID && !seen[parents[p]]) {
+                seen[parents[p]] = 1;
+                commits[n_commits++] = parents[p];
+            }
+        }
+    }
+
+    // Size the mark sets by the tree nodes, the files in leaves and index,
+    // and the stored chunks, which bound what can be marked
+    size_t n_files = svc->index_size;
+    for (size_t i=0; i<svc->tree_table_cap; i++) {
+        struct tree_node *node = svc->tree_table[i];
+        if (node != NULL && node->level == 0) {
+            n_files += node->n_entries;
+        }
+    }
+    size_t n_chunks = repack_list_loose(CHUNK_DIR, OBJECT_CHUNK, NULL);
+    for (size_t p=0; p<svc->n_packs; p++) {
+        for (size_t i=0; i<svc->packs[p].index->n_entries; i++) {
+            n_chunks += (svc->packs[p].entries[i].type & ~OBJECT_DELTA) == OBJECT_CHUNK;
+        }
+    }
+    struct gc_marks marks;
+    mark_set_init(helper, &marks.nodes, svc->n_tree_nodes);
+    mark_set_init(helper, &marks.manifests, n_files);
+    mark_set_init(helper, &marks.chunks, n_chunks);
+
+    // Mark the file versions of the commits in parallel, and of the index
+    struct gc_batch batch = {helper, &marks, commits, NULL, NULL, 0};
+    parallel_for(helper, n_commits, gc_mark_commit_task, &batch);
+    for (size_t i=0; i<svc->index_size; i++) {
+        mark_set_add(&marks.manifests, svc->index[i].hash);
+    }
+
+    // Mark the chunks of every marked manifest, in parallel for the
+    // manifests which can be read without decoding a delta
+    uint64_t *manifests = scratch_alloc(helper, (marks.manifests.cap + 1) * sizeof(uint64_t));
+    size_t n_manifests = 0;
+    if (atomic_load(&marks.manifests.has_zero)) {
+        manifests[n_manifests++] = 0;
+    }
+    for (size_t i=0; i<marks.manifests.cap; i++) {
+        if (marks.manifests.keys[i] != 0) {
+            manifests[n_manifests++] = marks.manifests.keys[i];
+        }
+    }
+    int *deferred = scratch_alloc(helper, n_manifests * sizeof(int));
+    memset(deferred, 0, n_manifests * sizeof(int));
+    batch.manifests = manifests;
+    batch.deferred = deferred;
+    parallel_for(helper, n_manifests, gc_mark_chunks_task, &batch);
+    for (size_t i=0; i<n_manifests; i++) {
+        if (deferred[i]) {
+            size_t object_mark = scratch_mark(helper);
+            if (gc_mark_object(helper, &marks, manifests[i]) == -1) {
+                atomic_store(&batch.failed, 1);
+            }
+            scratch_release(helper, object_mark);
+        }
+    }
+    if (atomic_load(&batch.failed) || atomic_load(&marks.nodes.full)
+        || atomic_load(&marks.manifests.full) || atomic_load(&marks.chunks.full)) {
+        scratch_release(helper, mark);
+        return -1;
+    }
+
+    // Count the unmarked objects in packs, and repack without them. Loose
+    // objects are removed after, so that nothing is removed if repacking fails.
+    size_t n_bytes = 0;
+    size_t n_unmarked = 0;
+    for (size_t p=0; p<svc->n_packs; p++) {
+        struct pack *pack = svc->packs + p;
+        for (size_t i=0; i<pack->index->n_entries; i++) {
+            struct pack_entry *entry = pack->entries + i;
+            if (!gc_marked(&marks, entry->id, entry->type & ~OBJECT_DELTA)) {
+                n_bytes += entry->size;
+                n_unmarked++;
+            }
+        }
+    }
+    if (!dry_run && n_unmarked > 0 && repack_objects(helper, &marks) == -1) {
+        scratch_release(helper, mark);
+        return -1;
+    }
+    n_bytes += gc_sweep_loose("svc_db", OBJECT_MANIFEST, &marks, dry_run);
+    n_bytes += gc_sweep_loose(CHUNK_DIR, OBJECT_CHUNK, &marks, dry_run);
+    scratch_release(helper, mark);
+    return n_bytes;
+}
+
+/**
+* Sets up an io_uring instance and maps its rings. The submission and
+* completion rings share a single mapping, which every kernel with the
+* operations used here supports.
+*
+* @param n_entries The number of entries in the submission ring.
+* @return The instance, or NULL if io_uring is not available.
+*/
+struct uring *uring_create(unsigned int n_entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, n_entries, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        return NULL;
+    }
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t rings_size = sq_size > cq_size ? sq_size : cq_size;
+    void *rings = mmap(NULL, rings_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    size_t sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+        if (rings != MAP_FAILED) {
+            munmap(rings, rings_size);
+        }
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        close(fd);
+        return NULL;
+    }
+
+    struct uring *ring = mmap(NULL, sizeof(struct uring), PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->fd = fd;
+    ring->n_entries = p.sq_entries;
+    ring->n_queued = 0;
+    ring->n_inflight = 0;
+    ring->sq_tail_ptr = rings + p.sq_off.tail;
+    ring->sq_tail = *ring->sq_tail_ptr;
+    ring->sq_mask = *(unsigned int *)(rings + p.sq_off.ring_mask);
+    ring->sq_array = rings + p.sq_off.array;
+    ring->sqes = sqes;
+    ring->cq_head_ptr = rings + p.cq_off.head;
+    ring->cq_tail_ptr = rings + p.cq_off.tail;
+    ring->cq_mask = *(unsigned int *)(rings + p.cq_off.ring_mask);
+    ring->cqes = rings + p.cq_off.cqes;
+    ring->rings = rings;
+    ring->rings_size = rings_size;
+    ring->sqes_size = sqes_size;
+    return ring;
+}
+
+/**
+* Closes the helper's io_uring instance if it has been set up.
+*
+* @param helper Data structure to pass program data between functions.
+*/
+void uring_destroy(void *helper) {
+    struct helper *svc = (struct helper *)helper;
+    struct uring *ring = svc->ring;
+    if (ring == NULL) {
+        return;
+    }
+    munmap(ring->rings, ring->rings_size);
+    munmap(ring->sqes, ring->sqes_size);
+    close(ring->fd);
+    munmap(ring, sizeof(struct uring));
+    svc->ring = NULL;
+}
+
+/**
+* Returns the helper's io_uring instance, setting it up on first use.
+*
+* @param helper Data structure to pass program data between functions.
+* @return The instance, or NULL if io_uring is disabled or not available.
+*/
+struct uring *uring_get(void *helper) {
+    struct helper *svc = (struct helper *)helper;
+    if (!svc->use_uring || svc->uring_unavailable) {
+        return NULL;
+    }
+    if (svc->ring == NULL) {
+        svc->ring = uring_create(URING_DEPTH);
+        svc->uring_unavailable = svc->ring == NULL;
+    }
+    return svc->ring;
+}
+
+/**
+* Queues an operation on the submission ring. If the ring is full, the queued
+* operations are submitted and waited for first, so operations queued
+* together must not depend on each other.
+*
+* @param ring The io_uring instance.
+* @param op The IORING_OP_ operation.
+* @param fd The file descriptor field of the operation.
+* @param addr The address field of the operation, such as a path or buffer.
+* @param len The length field of the operation.
+* @param off The offset field of the operation.
+* @param result Where the result of the operation is stored once it completes.
+* @return The submission entry, for setting the operation's flags.
+*/
+struct io_uring_sqe *uring_prep(struct uring *ring, int op, int fd, void *addr,
+                                unsigned int len, uint64_t off, int *result) {
+    if (ring->n_queued + ring->n_inflight == ring->n_entries) {
+        uring_wait(ring);
+    }
+    unsigned int index = ring->sq_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = ring->sqes + index;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = (uint64_t)(uintptr_t)result;
+    ring->sq_array[index] = index;
+    ring->sq_tail++;
+    ring->n_queued++;
+    *result = -ECANCELED;
+    return sqe;
+}
+
+/**
+* Submits the queued operations and waits for every submitted operation to
+* complete, storing the result of each.
+*
+* @param ring The io_uring instance.
+* @return 0 if successful, otherwise -1 if the kernel rejected the operations.
+*/
+int uring_wait(struct uring *ring) {
+    __atomic_store_n(ring->sq_tail_ptr, ring->sq_tail, __ATOMIC_RELEASE);
+    unsigned int to_submit = ring->n_queued;
+    ring->n_inflight += ring->n_queued;
+    ring->n_queued = 0;
+    while (ring->n_inflight > 0) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            ring->n_inflight = 0;
+            return -1;
+        }
+        if (ret > 0) {
+            to_submit -= (unsigned int)ret < to_submit ? (unsigned int)ret : to_submit;
+        }
+        unsigned int head = *ring->cq_head_ptr;
+        unsigned int tail = __atomic_load_n(ring->cq_tail_ptr, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = ring->cqes + (head & ring->cq_mask);
+            *(int *)(uintptr_t)cqe->user_data = cqe->res;
+            ring->n_inflight--;
+        }
+        __atomic_store_n(ring->cq_head_ptr, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/**
+* Restores files from the database through io_uring. Each stage queues one
+* operation for every file of a batch and waits for them together, so a
+* batch of files takes a few system calls rather than several per file.
+* Files that are not a single chunk, or whose operations fail, are restored
+* with restore_file().
+*
+* @param helper Data structure to pass program data between functions.
+* @param files The array of file objects to be restored.
+* @param n_files The size of the file array.
+* @return 0 if successful, or -1 if a file could not be restored.
+*/
+int uring_restore_files(void *helper, struct file *files, size_t n_files) {
+    struct helper *svc = (struct helper *)helper;
+    struct uring *ring = uring_get(helper);
+    int failed = 0;
+    int result = 0;
+    size_t mark = scratch_mark(helper);
+    struct uring_restore *jobs = scratch_alloc(helper, URING_BATCH * sizeof(struct uring_restore));
+    unsigned char *data = scratch_alloc(helper, 2 * URING_BATCH * CHUNK_MAX);
+    for (size_t first=0; first<n_files; first+=URING_BATCH) {
+        size_t n = n_files - first < URING_BATCH ? n_files - first : URING_BATCH;
+
+        // Open the manifests, and check whether the files are hard links
+        // which must not be written through
+        for (size_t i=0; i<n; i++) {
+            struct uring_restore *j = jobs + i;
+            j->file_path = path_name(helper, files[first + i].path);
+            sprintf(j->manifest_path, "svc_db/%016lx", files[first + i].hash);
+            j->data = data + 2 * i * CHUNK_MAX;
+            j->out = j->data + CHUNK_MAX;
+            j->chunk_fd = -1;
+            j->dest_fd = -1;
+            j->sync = 0;
+            uring_prep(ring, IORING_OP_OPENAT, AT_FDCWD, j->manifest_path, 0, 0,
+                       &j->manifest_fd)->open_flags = O_RDONLY;
+            uring_prep(ring, IORING_OP_STATX, AT_FDCWD, j->file_path, STATX_NLINK,
+                       (uint64_t)(uintptr_t)&j->stx, &j->stat_res)->statx_flags = AT_SYMLINK_NOFOLLOW;
+        }
+        failed |= uring_wait(ring);
+
+        // Read the manifests
+        for (size_t i=0; i<n; i++) {
+            struct uring_restore *j = jobs + i;
+            if (j->stat_res == 0 && j->stx.stx_nlink > 1) {
+                unlink(j->file_path);
+            }
+            if (j->manifest_fd < 0) {
+                j->sync = 1;
+                continue;
+            }
+            uring_prep(ring, IORING_OP_READ, j->manifest_fd, j->manifest,
+                       sizeof(j->manifest), 0, &j->res);
+        }
+        failed |= uring_wait(ring);
+
+        // Close the manifests, then open the chunks and the destinations
+        for (size_t i=0; i<n; i++) {
+            struct uring_restore *j = jobs + i;
+            if (j->sync) {
+                continue;
+            }
+            struct manifest *m = (struct manifest *)j->manifest;
+            struct chunk_ref *ref = (struct chunk_ref *)(m + 1);
+            uring_prep(ring, IORING_OP_CLOSE, j->manifest_fd, NULL, 0, 0, &j->manifest_fd);
+            if (j->res < (int)sizeof(struct manifest) || m->magic != MANIFEST_MAGIC
+                || m->n_chunks > 1 || (m->n_chunks == 1 && ref->length > CHUNK_MAX)) {
+                j->sync = 1;
+                continue;
+            }
+            j->length = m->n_chunks == 0 ? 0 : ref->length;
+            if (j->length > 0) {
+                sprintf(j->chunk_path, CHUNK_DIR "/%016lx", ref->id);
+                uring_prep(ring, IORING_OP_OPENAT, AT_FDCWD, j->chunk_path, 0, 0,
+                           &j->chunk_fd)->open_flags = O_RDONLY;
+            }
+            uring_prep(ring, IORING_OP_OPENAT, AT_FDCWD, j->file_path, 0666, 0,
+                       &j->dest_fd)->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+        }
+        failed |= uring_wait(ring);
+
+        // Read the chunks
+        for (size_t i=0; i<n; i++) {
+            struct uring_restore *j = jobs + i;
+            j->res = 0;
+            if (!j->sync && j->length > 0 && j->chunk_fd >= 0) {
+                uring_prep(ring, IORING_OP_READ, j->chunk_fd, j->data, j->length, 0, &j->res);
+            }
+        }
+        failed |= uring_wait(ring);
+
+        // Close the chunks, decompress the compressed chunks and write the
+        // files. Compressed chunks are shorter than their length.
+        for (size_t i=0; i<n; i++) {
+            struct uring_restore *j = jobs + i;
+            if (j->chunk_fd >= 0) {
+                uring_prep(ring, IORING_OP_CLOSE, j->chunk_fd, NULL, 0, 0, &j->chunk_fd);
+            }
+            unsigned char *contents = j->data;
+            if (!j->sync && j->res > 0 && j->res < (int)j->length
+                && lz_decompress(j->data, j->res, j->out, j->length) == 0) {
+                contents = j->out;
+                j->res = j->length;
+            }
+            if (j->sync || j->dest_fd < 0 || j->res != (int)j->length) {
+                j->sync = 1;
+                continue;
+            }
+            if (j->length > 0) {
+                uring_prep(ring, IORING_OP_WRITE, j->dest_fd, contents, j->length, 0, &j->res);
+            }
+        }
+        failed |= uring_wait(ring);
+
+        // Close the files
+        for (size_t i=0; i<n; i++) {
+            struct uring_restore *j = jobs + i;
+            if (j->dest_fd >= 0) {
+                if (j->res != (int)j->length) {
+                    j->sync = 1;
+                }
+                uring_prep(ring, IORING_OP_CLOSE, j->dest_fd, NULL, 0, 0, &j->dest_fd);
+            }
+        }
+        failed |= uring_wait(ring);
+
+        for (size_t i=0; i<n; i++) {
+            if (jobs[i].sync
+                && restore_file(helper, files[first + i].hash, jobs[i].file_path, 0) == -1) {
+                result = -1;
+            }
+        }
+    }
+    scratch_release(helper, mark);
+
+    // A ring the kernel stopped accepting operations on is not used again
+    if (failed) {
+        uring_destroy(helper);
+        svc->uring_unavailable = 1;
+    }
+    return result;
+}
+
+/**
+* Stores files in the database through io_uring, in stages over batches of
+* files like uring_restore_files(). Each file is read whole and split into
+* chunks in memory. The chunks which are not stored yet and the manifest are
+* written under temporary names, then the chunks are renamed into place, and
+* the manifest is renamed once all of its chunks are. Files larger than the
+* largest chunk, or whose operations fail, are stored with store_file().
+*
+* @param helper Data structure to pass program data between functions.
+* @param files The array of file objects to write to the database.
+* @param n_files The size of the file array.
+* @return 0 if successful, or -1 if a file could not be stored.
+*/
+int uring_store_files(void *helper, struct file *files, size_t n_files) {
+    struct helper *svc = (struct helper *)helper;
+    struct uring *ring = uring_get(helper);
+    int failed = 0;
+    int result = 0;
+    size_t mark = scratch_mark(helper);
+    struct uring_store *jobs = scratch_alloc(helper, URING_BATCH * sizeof(struct uring_store));
+    unsigned char *data = scratch_alloc(helper, URING_BATCH * (2*CHUNK_MAX + 1));
+    for (size_t first=0; first<n_files; first+=URING_BATCH) {
+        size_t n = n_files - first < URING_BATCH ? n_files - first : URING_BATCH;
+
+        // Check which manifests exist, and open the files
+        for (size_t i=0; i<n; i++) {
+            struct uring_store *j = jobs + i;
+            j->file_path = path_name(helper, files[first + i].path);
+            sprintf(j->manifest_path, "svc_db/%016lx", files[first + i].hash);
+            sprintf(j->tmp_path, "%s.tmp", j->manifest_path);
+            j->data = data + i * (2*CHUNK_MAX + 1);
+            j->packed = j->data + CHUNK_MAX + 1;
+            j->n_chunks = 0;
+            j->tmp_fd = -1;
+            j->sync = 0;
+
+            // Files with the same contents in a batch are only stored once
+            j->stat_res = -ENOENT;
+            for (size_t k=0; k<i && j->stat_res != 0; k++) {
+                if (files[first + k].hash == files[first + i].hash) {
+                    j->stat_res = 0;
+                }
+            }
+            struct pack *pack;
+            if (pack_find(helper, files[first + i].hash, OBJECT_MANIFEST, &pack) != NULL) {
+                j->stat_res = 0;
+            }
+            j->src_fd = -1;
+            if (j->stat_res != 0) {
+                uring_prep(ring, IORING_OP_STATX, AT_FDCWD, j->manifest_path, STATX_TYPE,
+                           (uint64_t)(uintptr_t)&j->stx, &j->stat_res);
+                uring_prep(ring, IORING_OP_OPENAT, AT_FDCWD, j->file_path, 0, 0,
+                           &j->src_fd)->open_flags = O_RDONLY;
+            }
+        }
+        failed |= uring_wait(ring);
+
+        // Read the files whose manifests do not exist yet
+        for (size_t i=0; i<n; i++) {
+            struct uring_store *j = jobs + i;
+            j->res = -1;
+            if (j->stat_res != 0 && j->src_fd >= 0) {
+                uring_prep(ring, IORING_OP_READ, j->src_fd, j->data, CHUNK_MAX + 1, 0, &j->res);
+            }
+        }
+        failed |= uring_wait(ring);
+
+        // Close the files, split them into chunks and check which chunks
+        // are stored already
+        for (size_t i=0; i<n; i++) {
+            struct uring_store *j = jobs + i;
+            if (j->src_fd >= 0) {
+                uring_prep(ring, IORING_OP_CLOSE, j->src_fd, NULL, 0, 0, &j->src_fd);
+            }
+            if (j->stat_res == 0) {
+                continue;
+            }
+            if (j->res < 0 || j->res > CHUNK_MAX) {
+                j->sync = 1;
+                continue;
+            }
+            j->size = j->res;
+            struct manifest *m = (struct manifest *)j->manifest;
+            struct chunk_ref *refs = (struct chunk_ref *)(m + 1);
+            m->magic = MANIFEST_MAGIC;
+            m->file_size = j->size;
+            size_t offset = 0;
+            while (offset < j->size) {
+                size_t length = chunk_boundary(j->data + offset, j->size - offset);
+                struct chunk_ref ref = {hash_bytes(j->data + offset, length), length};
+                unsigned int c = j->n_chunks;
+                refs[c] = ref;
+                object_path(j->chunk_paths[c], ref.id, OBJECT_CHUNK);
+                sprintf(j->chunk_tmp_paths[c], "%s.tmp", j->chunk_paths[c]);
+                j->chunk_sizes[c] = 0;
+                j->chunk_fds[c] = -1;
+                j->chunk_res[c] = 0;
+
+                // A chunk repeated in the file is only written once. Only the
+                // results of the statx calls are used, so they share a buffer.
+                struct pack *pack;
+                for (unsigned int k=0; k<c && j->chunk_res[c] == 0; k++) {
+                    if (refs[k].id == ref.id) {
+                        j->chunk_res[c] = 1;
+                    }
+                }
+                if (j->chunk_res[c] == 0
+                    && pack_find(helper, ref.id, OBJECT_CHUNK, &pack) == NULL) {
+                    uring_prep(ring, IORING_OP_STATX, AT_FDCWD, j->chunk_paths[c], STATX_TYPE,
+                               (uint64_t)(uintptr_t)&j->stx, j->chunk_res + c);
+                }
+                j->n_chunks++;
+                offset += length;
+            }
+            m->n_chunks = j->n_chunks;
+            uring_prep(ring, IORING_OP_OPENAT, AT_FDCWD, j->tmp_path, 0444, 0,
+                       &j->tmp_fd)->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+        }
+        failed |= uring_wait(ring);
+
+        // Create the chunks which are not stored yet under temporary names
+        for (size_t i=0; i<n; i++) {
+            struct uring_store *j = jobs + i;
+            if (j->stat_res == 0 || j->sync) {
+                continue;
+            }
+            for (unsigned int c=0; c<j->n_chunks; c++) {
+                if (j->chunk_res[c] < 0) {
+                    uring_prep(ring, IORING_OP_OPENAT, AT_FDCWD, j->chunk_tmp_paths[c],
+                               0444, 0, j->chunk_fds + c)->open_flags
+                               = O_WRONLY | O_CREAT | O_TRUNC;
+                }
+            }
+        }
+        failed |= uring_wait(ring);
+
+        // Write the new chunks, compressed if they compress well, and the
+        // manifests
+        for (size_t i=0; i<n; i++) {
+            struct uring_store *j = jobs + i;
+            if (j->stat_res == 0 || j->sync) {
+                continue;
+            }
+            struct chunk_ref *refs = (struct chunk_ref *)(j->manifest + sizeof(struct manifest));
+            size_t offset = 0;
+            unsigned char *packed = j->packed;
+            for (unsigned int c=0; c<j->n_chunks; c++) {
+                if (j->chunk_fds[c] >= 0) {
+                    unsigned char *contents = j->data + offset;
+                    j->chunk_sizes[c] = chunk_compress(contents, refs[c].length, packed);
+                    if (j->chunk_sizes[c] > 0) {
+                        contents = packed;
+                        packed += j->chunk_sizes[c];
+                    } else {
+                        j->chunk_sizes[c] = refs[c].length;
+                    }
+                    uring_prep(ring, IORING_OP_WRITE, j->chunk_fds[c], contents,
+                               j->chunk_sizes[c], 0, j->chunk_res + c);
+                } else if (j->chunk_res[c] < 0) {
+                    j->sync = 1;
+                }
+                offset += refs[c].length;
+            }
+            j->res = -1;
+            if (j->tmp_fd >= 0) {
+                uring_prep(ring, IORING_OP_WRITE, j->tmp_fd, j->manifest,
+                           sizeof(struct manifest) + j->n_chunks * sizeof(struct chunk_ref),
+                           0, &j->res);
+            }
+        }
+        failed |= uring_wait(ring);
+
+        // Close the chunks and the manifests
+        for (size_t i=0; i<n; i++) {
+            struct uring_store *j = jobs + i;
+            if (j->stat_res == 0) {
+                continue;
+            }
+            for (unsigned int c=0; c<j->n_chunks; c++) {
+                if (j->chunk_fds[c] >= 0) {
+                    uring_prep(ring, IORING_OP_CLOSE, j->chunk_fds[c], NULL, 0, 0, j->chunk_fds + c);
+                    if (j->chunk_res[c] != (int)j->chunk_sizes[c]) {
+                        j->sync = 1;
+                    }
+                }
+            }
+            if (j->tmp_fd >= 0) {
+                uring_prep(ring, IORING_OP_CLOSE, j->tmp_fd, NULL, 0, 0, &j->tmp_fd);
+                if (j->res != (int)(sizeof(struct manifest) + j->n_chunks * sizeof(struct chunk_ref))) {
+                    j->sync = 1;
+                }
+            } else {
+                j->sync = 1;
+            }
+        }
+        failed |= uring_wait(ring);
+
+        // Move the chunks which were written whole into place. The chunks
+        // of files which failed are removed.
+        for (size_t i=0; i<n; i++) {
+            struct uring_store *j = jobs + i;
+            if (j->stat_res == 0) {
+                continue;
+            }
+            for (unsigned int c=0; c<j->n_chunks; c++) {
+                if (j->chunk_sizes[c] == 0) {
+                    continue;
+                }
+                if (j->sync) {
+                    unlink(j->chunk_tmp_paths[c]);
+                } else {
+                    uring_prep(ring, IORING_OP_RENAMEAT, AT_FDCWD, j->chunk_tmp_paths[c],
+                               AT_FDCWD, (uint64_t)(uintptr_t)j->chunk_paths[c],
+                               j->chunk_res + c);
+                }
+            }
+        }
+        failed |= uring_wait(ring);
+
+        // Move the manifests into place once all of their chunks are
+        for (size_t i=0; i<n; i++) {
+            struct uring_store *j = jobs + i;
+            if (j->stat_res == 0) {
+                continue;
+            }
+            for (unsigned int c=0; c<j->n_chunks; c++) {
+                if (j->chunk_sizes[c] > 0 && j->chunk_res[c] != 0) {
+                    j->sync = 1;
+                }
+            }
+            if (j->sync) {
+                unlink(j->tmp_path);
+                continue;
+            }
+            uring_prep(ring, IORING_OP_RENAMEAT, AT_FDCWD, j->tmp_path, AT_FDCWD,
+                       (uint64_t)(uintptr_t)j->manifest_path, &j->res);
+        }
+        failed |= uring_wait(ring);
+
+        for (size_t i=0; i<n; i++) {
+            struct uring_store *j = jobs + i;
+            if (j->stat_res != 0 && (j->sync || j->res != 0)
+                && store_file(helper, j->file_path, files[first + i].hash) == -1) {
+                result = -1;
+            }
+        }
+    }
+    scratch_release(helper, mark);
+
+    // A ring the kernel stopped accepting operations on is not used again
+    if (failed) {
+        uring_destroy(helper);
+        svc->uring_unavailable = 1;
+    }
+    return result;
+}
+
+// Set in threads that are running pool tasks, so that nested calls to
+// parallel_for() run serially instead of waiting on the busy pool.
+static __thread int in_pool_task;
+
+/**
+* Runs tasks from a worker's own range, then steals half of the largest
+* remaining range of another worker until no tasks remain. A range is packed
+* into a single 64-bit value, so both the owner claiming a task and a thief
+* splitting the range do so with one compare-and-swap.
+*
+* @param pool The thread pool running the tasks.
+* @param id The index of the worker.
+*/
+void pool_work(struct thread_pool *pool, size_t id) {
+    _Atomic uint64_t *own = &pool->workers[id].range;
+    while (1) {
+        uint64_t range = atomic_load(own);
+        uint64_t begin = range & 0xFFFFFFFF;
+        uint64_t end = range >> 32;
+        if (begin < end) {
+            if (atomic_compare_exchange_weak(own, &range, (begin + 1) | end << 32)) {
+                pool->task(pool->arg, begin);
+            }
+            continue;
+        }
+
+        // Find the worker with the most tasks remaining
+        size_t victim = NULL_ID;
+        uint64_t most = 0;
+        for (size_t i=0; i<pool->n_workers; i++) {
+            uint64_t other = atomic_load(&pool->workers[i].range);
+            uint64_t remaining = (other >> 32) - (other & 0xFFFFFFFF);
+            if ((other >> 32) > (other & 0xFFFFFFFF) && remaining > most) {
+                most = remaining;
+                victim = i;
+            }
+        }
+        if (victim == NULL_ID) {
+            return;
+        }
+
+        // Take the upper half of the victim's range, or its last task
+        _Atomic uint64_t *theirs = &pool->workers[victim].range;
+        range = atomic_load(theirs);
+        begin = range & 0xFFFFFFFF;
+        end = range >> 32;
+        if (begin >= end) {
+            continue;
+        }
+        uint64_t mid = begin + (end - begin) / 2;
+        if (atomic_compare_exchange_strong(theirs, &range, begin | mid << 32)) {
+            atomic_store(own, mid | end << 32);
+        }
+    }
+}
+
+/**
+* The main function of each pool thread, which waits for a new generation of
+* tasks to be published, works on them and reports when it has finished.
+*
+* @param arg The worker object of the thread.
+* @return NULL once the pool is stopped.
+*/
+void *pool_thread(void *arg) {
+    struct worker *worker = (struct worker *)arg;
+    struct thread_pool *pool = worker->pool;
+    in_pool_task = 1;
+    unsigned long seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->stop && pool->generation == seen) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->stop) {
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool_work(pool, worker->id);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->n_running--;
+        if (pool->n_running == 0) {
+            pthread_cond_signal(&pool->finish);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/**
+* Stops and joins all the threads of the helper's thread pool, and unmaps it.
+*
+* @param helper Data structure to pass program data between functions.
+*/
+void pool_destroy(void *helper) {
+    struct helper *svc = (struct helper *)helper;
+    struct thread_pool *pool = svc->pool;
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i=1; i<pool->n_workers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    munmap(pool, sizeof(struct thread_pool)
+                 + pool->n_workers * sizeof(struct worker));
+    svc->pool = NULL;
+}
+
+/**
+* Returns the helper's thread pool, creating it with the number of workers
+* given by n_threads in the helper. A value of 0 uses one worker per online
+* processor. The calling thread acts as the first worker.
+*
+* @param helper Data structure to pass program data between functions.
+* @return The thread pool.
+*/
+struct thread_pool *pool_get(void *helper) {
+    struct helper *svc = (struct helper *)helper;
+    size_t n_workers = svc->n_threads;
+    if (n_workers == 0) {
+        n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (svc->pool != NULL && svc->pool->n_workers == n_workers) {
+        return svc->pool;
+    }
+    pool_destroy(helper);
+
+    size_t size = sizeof(struct thread_pool) + n_workers * sizeof(struct worker);
+    struct thread_pool *pool = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    pool->n_workers = n_workers;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->finish, NULL);
+    for (size_t i=0; i<n_workers; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        if (i > 0) {
+            pthread_create(&pool->workers[i].thread, NULL, pool_thread,
+                           pool->workers + i);
+        }
+    }
+    svc->pool = pool;
+    return pool;
+}
+
+/**
+* Calls a task function once for every index from 0 to n_tasks - 1 using the
+* helper's thread pool. Tasks are divided evenly between the workers, and
+* workers that run out of tasks steal from the others. Returns once every
+* task has finished. Tasks must not allocate memory through allocate().
+*
+* @param helper Data structure to pass program data between functions.
+* @param n_tasks The number of tasks.
+* @param task The function to run for each task index.
+* @param arg The argument passed to every call of the task function.
+*/
+void parallel_for(void *helper, size_t n_tasks, void (*task)(void *, size_t), void *arg) {
+    struct helper *svc = (struct helper *)helper;
+    if (n_tasks == 0) {
+        return;
+    }
+    if (n_tasks == 1 || svc->n_threads == 1 || in_pool_task) {
+        for (size_t i=0; i<n_tasks; i++) {
+            task(arg, i);
+        }
+        return;
+    }
+    struct thread_pool *pool = pool_get(helper);
+
+    // Give each worker an equal share of the tasks
+    for (size_t i=0; i<pool->n_workers; i++) {
+        uint64_t begin = n_tasks * i / pool->n_workers;
+        uint64_t end = n_tasks * (i + 1) / pool->n_workers;
+        atomic_store(&pool->workers[i].range, begin | end << 32);
+    }
+
+    // Wake the pool threads and work alongside them
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->n_running = pool->n_workers - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    in_pool_task = 1;
+    pool_work(pool, 0);
+    in_pool_task = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->n_running != 0) {
+        pthread_cond_wait(&pool->finish, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// The arguments shared by the tasks hashing the segments of one file.
+struct segment_batch {
+    const unsigned char *data;
+    size_t size;
+    uint64_t *hashes;
+};
+
+/**
+* Hashes one segment of a file, used as a parallel_for() task.
+*
+* @param arg The segment batch.
+* @param i The index of the segment.
+*/
+void hash_segment_task(void *arg, size_t i) {
+    struct segment_batch *batch = (struct segment_batch *)arg;
+    size_t offset = i * HASH_SEGMENT;
+    size_t length = batch->size - offset;
+    if (length > HASH_SEGMENT) {
+        length = HASH_SEGMENT;
+    }
+    batch->hashes[i] = hash_bytes(batch->data + offset, length);
+}
+
+/**
+* Computes the hash of the contents of a file version, which is the hash the
+* version is stored under. Contents of at most one segment hash to their
+* hash_bytes() value. Larger contents are split into segments which are
+* hashed in parallel, and the hash is then the hash of the segment hashes,
+* which differs from hash_bytes() over the same bytes. Every file hash is
+* computed by this function, so files hash the same wherever they are read.
+*
+* @param helper Data structure to pass program data between functions.
+* @param data The contents of the file.
+* @param n The length of the contents.
+* @return The hash of the contents, below HASH_INVALID.
+*/
+uint64_t hash_contents(void *helper, const unsigned char *data, size_t n) {
+    uint64_t hash;
+    if (n <= HASH_SEGMENT) {
+        hash = hash_bytes(data, n);
+    } else {
+        size_t n_segments = (n + HASH_SEGMENT - 1) / HASH_SEGMENT;
+        size_t hashes_size = n_segments * sizeof(uint64_t);
+        uint64_t *hashes = mmap(NULL, hashes_size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        struct segment_batch batch = {data, n, hashes};
+        parallel_for(helper, n_segments, hash_segment_task, &batch);
+        hash = hash_bytes((unsigned char *)hashes, hashes_size);
+        munmap(hashes, hashes_size);
+    }
+
+    // The largest values are reserved for errors
+    if (hash >= HASH_INVALID) {
+        hash -= HASH_INVALID;
+    }
+    return hash;
+}
+
+/**
+* Computes the hash of the file at a specified file path. The file is mapped
+* into memory and hashed with hash_contents(), so the hash only depends on
+* the contents of the file.
+*
+* @param helper Data structure to pass program data between functions.
+* @param file_path The file path of the file.
+* @return The hash of the file. -1 if the path is NULL, -2 if the file cannot
+*         be opened or mapped or is not a regular file.
+*/
+uint64_t hash_file(void *helper, char *file_path) {
+    if (file_path == NULL) {
+        return -1;
+    }
+
+    // Get the file size and map the file to a region of sufficient size in
+    // the virtual memory space.
+    int fd = open(file_path, O_RDONLY);
+    struct stat sb;
+    if (fd == -1 || fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -2;
+    }
+    uint64_t hash;
+    if (sb.st_size == 0) {
+        hash = hash_contents(helper, (const unsigned char *)"", 0);
+    } else {
+        unsigned char *c = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (c == MAP_FAILED) {
+            close(fd);
+            return -2;
+        }
+        madvise(c, sb.st_size, MADV_SEQUENTIAL);
+        hash = hash_contents(helper, c, sb.st_size);
+        munmap(c, sb.st_size);
+    }
+    close(fd);
+    return hash;
+}
+
+/**
+* Checks whether a file's stat data matches the stat data recorded in its file
+* object.
+*
+* @param f The file object.
+* @param sb The current stat data of the file.
+* @return 1 if the stat data is known and matches, otherwise 0.
+*/
+int stat_matches(struct file *f, struct stat *sb) {
+    int64_t mtime = sb->st_mtim.tv_sec * 1000000000LL + sb->st_mtim.tv_nsec;
+    int64_t ctime = sb->st_ctim.tv_sec * 1000000000LL + sb->st_ctim.tv_nsec;
+    return f->mtime != 0 && f->mtime == mtime && f->ctime == ctime
+           && f->ino == (uint64_t)sb->st_ino && f->size == (uint64_t)sb->st_size;
+}
+
+/**
+* Rehashes a file and records the stat data read before hashing in its file
+* object. A file modified in the same second as it was hashed is racy, as a
+* later modification within that second may keep the same timestamps, so its
+* stat data is left unknown and it will always be rehashed.
+*
+* @param helper Data structure to pass program data between functions.
+* @param f The file object, whose hash and stat data are updated.
+* @param sb The stat data of the file, read before hashing.
+* @return The hash of the file. -2 if the file cannot be opened.
+*/
+uint64_t stat_rehash(void *helper, struct file *f, struct stat *sb) {
+    uint64_t hash = hash_file(helper, path_name(helper, f->path));
+    if (hash == (uint64_t)-2) {
+        return hash;
+    }
+    f->hash = hash;
+    f->ino = sb->st_ino;
+    f->size = sb->st_size;
+    f->ctime = sb->st_ctim.tv_sec * 1000000000LL + sb->st_ctim.tv_nsec;
+    f->mtime = sb->st_mtim.tv_sec * 1000000000LL + sb->st_mtim.tv_nsec;
+
+    // Leave the stat data unknown if the file is racy
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (sb->st_mtim.tv_sec >= now.tv_sec) {
+        f->mtime = 0;
+    }
+    return hash;
+}
+
+/**
+* Returns the hash of a tracked file, only rehashing the file if its stat data
+* differs from the stat data recorded in the file object.
+*
+* @param helper Data structure to pass program data between functions.
+* @param f The file object, whose hash and stat data are updated.
+* @return The hash of the file. -2 if the file cannot be opened.
+*/
+uint64_t stat_hash(void *helper, struct file *f) {
+    struct stat sb;
+    if (stat(path_name(helper, f->path), &sb) == -1) {
+        return -2;
+    }
+    if (stat_matches(f, &sb)) {
+        return f->hash;
+    }
+    return stat_rehash(helper, f, &sb);
+}
+
+// The arguments shared by the tasks hashing a batch of files.
+struct hash_batch {
+    void *helper;
+    struct file *files;
+    uint64_t *hashes;
+};
+
+/**
+* Checks the stat data of one file in a batch and rehashes it if it changed,
+* used as a parallel_for() task. Changed files larger than a segment are left
+* marked with HASH_DEFERRED, as they are hashed in parallel by segment. Paths
+* which are missing or are not regular files get the hash -2.
+*
+* @param arg The hash batch.
+* @param i The index of the file in the batch.
+*/
+void hash_files_task(void *arg, size_t i) {
+    struct hash_batch *batch = (struct hash_batch *)arg;
+    struct file *f = batch->files + i;
+    struct stat sb;
+    if (stat(path_name(batch->helper, f->path), &sb) == -1 || !S_ISREG(sb.st_mode)) {
+        batch->hashes[i] = -2;
+    } else if (stat_matches(f, &sb)) {
+        batch->hashes[i] = f->hash;
+    } else if ((size_t)sb.st_size > HASH_SEGMENT) {
+        batch->hashes[i] = HASH_DEFERRED;
+    } else {
+        batch->hashes[i] = stat_rehash(batch->helper, f, &sb);
+    }
+}
+
+/**
+* Brings the hashes of an array of file objects up to date, as stat_hash()
+* does for a single file. Small files are hashed in parallel with each other
+* and large files are then hashed one at a time with their segments hashed in
+* parallel, so that both many small files and a few large files use every
+* worker of the thread pool. Results are stored in the order of the files.
+*
+* @param helper Data structure to pass program data between functions.
+* @param files The array of file objects, whose hashes and stat data are updated.
+* @param n_files The length of the file array.
+* @param hashes Array of n_files values to store each file's hash, or -2 if
+*               the file cannot be opened.
+*/
+void hash_files(void *helper, struct file *files, size_t n_files, uint64_t *hashes) {
+    struct hash_batch batch = {helper, files, hashes};
+    parallel_for(helper, n_files, hash_files_task, &batch);
+    for (size_t i=0; i<n_files; i++) {
+        if (hashes[i] == HASH_DEFERRED) {
+            hashes[i] = stat_hash(helper, files + i);
+        }
+    }
+}
+
+/**
+* Compares two file objects alphabetically by path, ignoring case.
+*
+* @param helper Data structure to pass program data between functions.
+* @param a The first file object.
+* @param b The second file object.
+* @return A negative value if the first file comes first, a positive value if
+*         it comes last, or 0 if the files have the same path.
+*/
+int file_cmp(void *helper, struct file *a, struct file *b) {
+    return path_cmp(helper, a->path, b->path);
+}
+
+/**
+* Compares two file objects as file_cmp() does, in the form taken by qsort_r().
+*/
+int file_cmp_r(const void *p1, const void *p2, void *helper) {
+    return file_cmp(helper, (struct file *)p1, (struct file *)p2);
+}
+
+/**
+* Rebuilds the index table, which maps the path of each tracked file to its
+* position in the index, after the index has been reordered or replaced.
+*
+* @param helper Data structure to pass program data between functions.
+*/
+void index_table_rebuild(void *helper) {
+    struct helper *svc = (struct helper *)helper;
+    table_clear(&svc->index_table);
+    for (size_t i=0; i<svc->index_size; i++) {
+        table_put(helper, &svc->index_table, path_name(helper, svc->index[i].path), i);
+    }
+}
+
+/**
+* Restores the index to a single sorted run without removed files. Files added
+* since the last flush are appended after the sorted run and removed files are
+* left in place with a null path, so that adding and removing files does not
+* reorder the index. The new files are sorted and merged with the sorted run
+* in one pass, dropping the removed files.
+*
+* @param helper Data structure to pass program data between functions.
+*/
+void index_flush(void *helper) {
+    struct helper *svc = (struct helper *)helper;
+    if (svc->index_sorted == svc->index_size && svc->index_removed == 0) {
+        return;
+    }
+
+    // Compact the sorted run and the new files separately
+    size_t n_sorted = 0;
+    for (size_t i=0; i<svc->index_sorted; i++) {
+        if (svc->index[i].path != NULL_ID) {
+            svc->index[n_sorted] = svc->index[i];
+            n_sorted++;
+        }
+    }
+    size_t n_new = 0;
+    for (size_t i=svc->index_sorted; i<svc->index_size; i++) {
+        if (svc->index[i].path != NULL_ID) {
+            svc->index[svc->index_sorted + n_new] = svc->index[i];
+            n_new++;
+        }
+    }
+
+    // Sort the new files, then merge them into the sorted run from the back
+    size_t mark = scratch_mark(helper);
+    struct file *new_files = scratch_alloc(helper, n_new * sizeof(struct file));
+    memcpy(new_files, svc->index + svc->index_sorted, n_new * sizeof(struct file));
+    qsort_r(new_files, n_new, sizeof(struct file), file_cmp_r, helper);
+    size_t i = n_sorted;
+    size_t j = n_new;
+    while (j > 0) {
+        if (i > 0 && file_cmp(helper, svc->index + i - 1, new_files + j - 1) > 0) {
+            svc->index[i + j - 1] = svc->index[i - 1];
+            i--;
+        } else {
+            svc->index[i + j - 1] = new_files[j - 1];
+            j--;
+        }
+    }
+    scratch_release(helper, mark);
+
+    size_t old_size = svc->index_size;
+    svc->index_size = n_sorted + n_new;
+    memset(svc->index + svc->index_size, 0, (old_size - svc->index_size) * sizeof(struct file));
+    svc->index_sorted = svc->index_size;
+    svc->index_removed = 0;
+    index_table_rebuild(helper);
+}
+
+/**
+* Checks whether a file is tracked in the index.
+*
+* @param helper Data structure to pass program data between functions.
+* @param file_name The path of the file.
+* @return 1 if the file is tracked, otherwise 0.
+*/
+int is_tracked(void *helper, char *file_name) {
+    struct helper *svc = (struct helper *)helper;
+    return file_name != NULL && table_get(&svc->index_table, file_name) != NULL_ID;
+}
+
+/**
+* Determines whether there are uncommitted changes by rehashing and comparing
+* the tracked files. Files whose stat data is unchanged are not rehashed.
+*
+* @param helper Data structure to pass program data between functions.
+* @param file_path The file path of the file.
+*/
+int uncommitted_changes(void *helper) {
+    struct helper *svc = (struct helper *)helper;
+    index_flush(helper);
+    if (svc->head != NULL_ID) {
+        if (svc->branches[svc->head].ref_commit != NULL_ID) {
+            struct commit *head = svc->commits + svc->branches[svc->head].ref_commit;
+            if (svc->index_size != head->n_files) {
+                return 1;
+            }
+            size_t mark = scratch_mark(helper);
+            struct file *head_files = tree_map(helper, head->tree);
+            int changed = 0;
+            for (size_t i=0; i<svc->index_size && !changed; i++) {
+                uint64_t new_hash = stat_hash(helper, svc->index + i);
+                if (head_files[i].hash != svc->index[i].hash
+                    || head_files[i].hash != new_hash) {
+                    changed = 1;
+                }
+            }
+            scratch_release(helper, mark);
+            return changed;
+        } else {
+            if (svc->index_size != 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+* Computes the difference between two lists of sorted file objects as an array
+* of change objects. The file lists must be sorted alphabetically. The algorithm
+* used to find changes initialises a reference at the beginning of both arrays.
+* Due to the sorted property, at each iteration a file can be determined as
+* added, removed, modified or unmodified. The changes array is allocated from
+* the scratch arena.
+*
+* @param helper Data structure to pass program data between functions.
+* @param changes_ptr A pointer to where the array of changes will be stored.
+* @param n_changes_ptr A pointer to where the number of changes will be stored.
+* @param old_files The list of old files to find changes relative to.
+* @param old_len The length of the old files array.
+* @param new_files The list of new files.
+* @param new_len The length of the new files array.
+*/
+void get_changes(void *helper, struct change **changes_ptr, size_t *n_changes_ptr,
+                 struct file *old_files, size_t old_len,
+                 struct file *new_files, size_t new_len) {
+
+    // Create the changes array, large enough for every file to change
+    struct change *changes = scratch_alloc(helper, (old_len + new_len) * sizeof(struct change));
     size_t n_changes = 0;
-    size_t changes_cap = 0;
 
-    // Iterate through both lists simultaneously to find the changes.
-    // As the lists are sorted, one pass through all the elements is sufficient.
-    size_t i_old = 0;
-    size_t i_new = 0;
+    // Iterate through both lists simultaneously to find the changes.
+    // As the lists are sorted, one pass through all the elements is sufficient.
+    size_t i_old = 0;
+    size_t i_new = 0;
+    while (1) {
+        // Exit loop if both arrays have been fully traversed.
+        if (i_old == old_len && i_new == new_len) {
+            break;
+        }
+        // If the old files array has been traversed while the new files still
+        // has files remaining, all the remaining files in the new files array
+        // must be additions as a result of the arrays in sorted order.
+        if (i_old == old_len) {
+            // Add the remaining files as additions and exit the loop
+            while (i_new != new_len) {
+                struct change c = {NULL, new_files + i_new};
+                changes[n_changes++] = c;
+                i_new++;
+            }
+            break;
+        }
+        // If the new files array has been traversed while the old files still
+        // have files remaining, all the remaining files in the old files array
+        // must be deletions.
+        else if (i_new == new_len) {
+            // Add the remaining files as deletions and exit the loop
+            while (i_old != old_len) {
+                struct change c = {old_files + i_old, NULL};
+                changes[n_changes++] = c;
+                i_old++;
+            }
+            break;
+        }
+
+        // Compare the files at the current indices for i_old and i_new
+        struct file *old = old_files + i_old;
+        struct file *new = new_files + i_new;
+        int cmp = file_cmp(helper, old, new);
+
+        // If the file names match, then check for modification by comparing
+        // hash values
+        if (cmp == 0) {
+            if (old->hash != new->hash) {
+                struct change c = {old, new};
+                changes[n_changes++] = c;
+            }
+            i_new++;
+            i_old++;
+        }
+        // If the old file is alphabetically ahead of the new file, then the
+        // new file must be an addition due to the sorted property.
+        else if (cmp > 0) {
+            struct change c = {NULL, new};
+            changes[n_changes++] = c;
+            i_new++;
+        }
+        // If the old file is alphabetically behind the new file, then the old
+        // file must have been removed and is no longer in the new list.
+        else {
+            struct change c = {old, NULL};
+            changes[n_changes++] = c;
+            i_old++;
+        }
+    }
+    // Set the return values
+    *changes_ptr = changes;
+    *n_changes_ptr = n_changes;
+}
+
+/**
+* Returns the files held in a leaf of a file tree, which follow the node.
+*/
+struct file *node_files(struct tree_node *node) {
+    return (struct file *)(node + 1);
+}
+
+/**
+* Returns the children of an inner node of a file tree, which follow the node.
+*/
+struct tree_child *node_children(struct tree_node *node) {
+    return (struct tree_child *)(node + 1);
+}
+
+/**
+* Checks whether a name ends a tree node on a level of a file tree. Each level
+* uses different bits of the name's hash, so that the nodes of a level end
+* after about 1 in TREE_FANOUT of the entries of the level below.
+*/
+int tree_boundary(uint64_t name_hash, uint32_t level) {
+    return ((name_hash >> (TREE_FANOUT_BITS * level)) & (TREE_FANOUT - 1)) == 0;
+}
+
+/**
+* Returns the tree node with the given entries, creating it only if no
+* identical node exists yet. Nodes are found by the hash of their entries in
+* the tree table, so that every snapshot holding the same entries shares one
+* node, and nodes are never modified once created. Files are identified by
+* their path and hash alone, and are stored without stat data, which belongs
+* to the index.
+*
+* @param helper Data structure to pass program data between functions.
+* @param level The level of the node, 0 for a leaf.
+* @param entries The files of a leaf, or the children of an inner node.
+* @param n_entries The number of entries.
+* @return The shared node.
+*/
+struct tree_node *tree_intern(void *helper, uint32_t level, void *entries,
+                              size_t n_entries) {
+    struct helper *svc = (struct helper *)helper;
+
+    // Hash the entries, with each file's name replaced by the hash of the name
+    // and each child replaced by the hash of the child
+    uint64_t words[TREE_MAX_ENTRIES * 2 + 1];
+    size_t n_words = 0;
+    size_t n_files = 0;
+    words[n_words++] = level;
+    for (size_t i=0; i<n_entries; i++) {
+        if (level == 0) {
+            struct file *f = (struct file *)entries + i;
+            words[n_words++] = svc->paths[f->path].name_hash;
+            words[n_words++] = f->hash;
+            n_files++;
+        } else {
+            struct tree_child *c = (struct tree_child *)entries + i;
+            words[n_words++] = c->node->hash;
+            n_files += c->node->n_files;
+        }
+    }
+    uint64_t hash = hash_bytes((unsigned char *)words, n_words * sizeof(uint64_t));
+
+    // Look for an identical node, comparing the entries in case two nodes'
+    // hashes collide. Children are shared, so they are compared by address.
+    if ((svc->n_tree_nodes + 1) * 2 > svc->tree_table_cap) {
+        struct tree_node **old = svc->tree_table;
+        size_t old_cap = svc->tree_table_cap;
+        svc->tree_table_cap = old_cap == 0 ? CAP_INIT_TABLE : old_cap * CAP_GROWTH;
+        svc->tree_table = allocate(helper, svc->tree_table_cap * sizeof(struct tree_node *));
+        memset(svc->tree_table, 0, svc->tree_table_cap * sizeof(struct tree_node *));
+        for (size_t i=0; i<old_cap; i++) {
+            if (old[i] != NULL) {
+                size_t j = old[i]->hash & (svc->tree_table_cap - 1);
+                while (svc->tree_table[j] != NULL) {
+                    j = (j + 1) & (svc->tree_table_cap - 1);
+                }
+                svc->tree_table[j] = old[i];
+            }
+        }
+        deallocate(helper, old, old_cap * sizeof(struct tree_node *));
+    }
+    size_t mask = svc->tree_table_cap - 1;
+    size_t slot = hash & mask;
+    for (; svc->tree_table[slot] != NULL; slot=(slot + 1) & mask) {
+        struct tree_node *node = svc->tree_table[slot];
+        if (node->hash != hash || node->level != level || node->n_entries != n_entries) {
+            continue;
+        }
+        size_t i = 0;
+        if (level == 0) {
+            struct file *a = node_files(node);
+            struct file *b = (struct file *)entries;
+            while (i < n_entries && a[i].hash == b[i].hash && a[i].path == b[i].path) {
+                i++;
+            }
+        } else {
+            struct tree_child *a = node_children(node);
+            struct tree_child *b = (struct tree_child *)entries;
+            while (i < n_entries && a[i].node == b[i].node) {
+                i++;
+            }
+        }
+        if (i == n_entries) {
+            return node;
+        }
+    }
+
+    // Create the node
+    size_t entry_size = level == 0 ? sizeof(struct file) : sizeof(struct tree_child);
+    struct tree_node *node = allocate(helper, sizeof(struct tree_node) + n_entries * entry_size);
+    struct tree_node header = {hash, level, n_entries, n_files};
+    *node = header;
+    if (level == 0) {
+        struct file *files = node_files(node);
+        for (size_t i=0; i<n_entries; i++) {
+            struct file f = {.hash = ((struct file *)entries)[i].hash,
+                             .path = ((struct file *)entries)[i].path};
+            files[i] = f;
+        }
+    } else {
+        memcpy(node + 1, entries, n_entries * entry_size);
+    }
+    svc->tree_table[slot] = node;
+    svc->n_tree_nodes++;
+    return node;
+}
+
+/**
+* Builds the file tree holding a sorted list of files. The tree is built
+* bottom up, with the entries of each level split into nodes after names whose
+* hash matches a pattern. As node boundaries depend only on the names near
+* them, a snapshot that differs from another in a few files is split the same
+* way apart from the nodes holding those files, and every other node is shared
+* with the other snapshot's tree. A new snapshot therefore only allocates the
+* nodes on the paths from its changed files to the root.
+*
+* @param helper Data structure to pass program data between functions.
+* @param files The sorted array of files.
+* @param n_files The length of the file array.
+* @return The root node of the tree, or NULL if there are no files.
+*/
+struct tree_node *tree_build(void *helper, struct file *files, size_t n_files) {
+    struct helper *svc = (struct helper *)helper;
+    if (n_files == 0) {
+        return NULL;
+    }
+    size_t scratch_size = n_files * 2 * sizeof(struct tree_child);
+    struct tree_child *children = mmap(NULL, scratch_size, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct tree_child *parents = children + n_files;
+
+    // Split the files into leaves
+    size_t n_children = 0;
+    size_t start = 0;
+    for (size_t i=0; i<n_files; i++) {
+        if (i + 1 == n_files || i + 1 - start == TREE_MAX_ENTRIES
+            || tree_boundary(svc->paths[files[i].path].name_hash, 0)) {
+            struct tree_child c = {tree_intern(helper, 0, files + start, i + 1 - start),
+                                   files[start].path};
+            children[n_children++] = c;
+            start = i + 1;
+        }
+    }
+
+    // Split each level into the nodes of the next, until one node remains
+    uint32_t level = 1;
+    while (n_children > 1) {
+        size_t n_parents = 0;
+        start = 0;
+        for (size_t i=0; i<n_children; i++) {
+            if (i + 1 == n_children || i + 1 - start == TREE_MAX_ENTRIES
+                || tree_boundary(svc->paths[children[i].first_path].name_hash, level)) {
+                struct tree_child c = {tree_intern(helper, level, children + start,
+                                                   i + 1 - start),
+                                       children[start].first_path};
+                parents[n_parents++] = c;
+                start = i + 1;
+            }
+        }
+        struct tree_child *tmp = children;
+        children = parents;
+        parents = tmp;
+        n_children = n_parents;
+        level++;
+    }
+    struct tree_node *root = children[0].node;
+    munmap(children < parents ? children : parents, scratch_size);
+    return root;
+}
+
+/**
+* Copies the files of a file tree into an array in sorted order.
+*
+* @param node The root node of the tree, or NULL for an empty tree.
+* @param files Array to store the files, with space for every file.
+* @return The number of files stored.
+*/
+size_t tree_flatten(struct tree_node *node, struct file *files) {
+    if (node == NULL) {
+        return 0;
+    }
+    if (node->level == 0) {
+        memcpy(files, node_files(node), node->n_entries * sizeof(struct file));
+        return node->n_entries;
+    }
+    size_t n_files = 0;
+    for (size_t i=0; i<node->n_entries; i++) {
+        n_files += tree_flatten(node_children(node)[i].node, files + n_files);
+    }
+    return n_files;
+}
+
+/**
+* Returns a temporary array in the scratch arena holding the files of a file
+* tree in sorted order.
+*
+* @param helper Data structure to pass program data between functions.
+* @param node The root node of the tree, or NULL for an empty tree.
+* @return The array of files.
+*/
+struct file *tree_map(void *helper, struct tree_node *node) {
+    size_t n_files = node == NULL ? 0 : node->n_files;
+    struct file *files = scratch_alloc(helper, n_files * sizeof(struct file));
+    tree_flatten(node, files);
+    return files;
+}
+
+/**
+* Finds a file in a file tree, descending into the last child whose first
+* file does not come after the path on each level.
+*
+* @param helper Data structure to pass program data between functions.
+* @param node The root node of the tree, or NULL for an empty tree.
+* @param path The ID of the path of the file.
+* @return A pointer to the file in its leaf, or NULL if it is not in the tree.
+*/
+struct file *tree_find(void *helper, struct tree_node *node, uint32_t path) {
+    if (path == NULL_ID) {
+        return NULL;
+    }
+    while (node != NULL && node->level > 0) {
+        struct tree_child *children = node_children(node);
+        size_t lo = 0;
+        size_t hi = node->n_entries;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (path_cmp(helper, children[mid].first_path, path) <= 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == 0) {
+            return NULL;
+        }
+        node = children[lo - 1].node;
+    }
+    if (node == NULL) {
+        return NULL;
+    }
+    return find_file(helper, node_files(node), node->n_entries, path);
+}
+
+/**
+* Replaces the index with the files of a commit.
+*
+* @param helper Data structure to pass program data between functions.
+* @param commit_index The index of the commit, or NULL_ID for no files.
+*/
+void index_load(void *helper, size_t commit_index) {
+    struct helper *svc = (struct helper *)helper;
+    deallocate(helper, svc->index, svc->index_cap * sizeof(struct file));
+    if (commit_index != NULL_ID && svc->commits[commit_index].n_files > 0) {
+        struct commit *c = svc->commits + commit_index;
+        svc->index = allocate(helper, c->n_files * sizeof(struct file));
+        tree_flatten(c->tree, svc->index);
+        svc->index_size = c->n_files;
+        svc->index_cap = c->n_files;
+    } else {
+        svc->index = NULL;
+        svc->index_size = 0;
+        svc->index_cap = 0;
+    }
+    svc->index_sorted = svc->index_size;
+    svc->index_removed = 0;
+    index_table_rebuild(helper);
+}
+
+/**
+* Copies the stat data of files in a sorted list to the files of the index
+* with the same path and hash, whose stat data is not kept in the commit the
+* index was loaded from.
+*
+* @param helper Data structure to pass program data between functions.
+* @param files The sorted array of files holding stat data.
+* @param n_files The length of the file array.
+*/
+void index_copy_stat(void *helper, struct file *files, size_t n_files) {
+    struct helper *svc = (struct helper *)helper;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < svc->index_size && j < n_files) {
+        int cmp = file_cmp(helper, svc->index + i, files + j);
+        if (cmp == 0) {
+            if (svc->index[i].hash == files[j].hash) {
+                svc->index[i] = files[j];
+            }
+            i++;
+            j++;
+        } else if (cmp < 0) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+}
+
+/**
+* Replaces the index and the tracked files in the working directory with the
+* files of a commit. The index is compared with the commit, after rehashing
+* the files that changed since they were last hashed, and only the files
+* which differ are restored. Files tracked in the index but not in the commit
+* are deleted if the previous head commit tracked them, so that files which
+* were only staged are left in the working directory. Nothing is changed if a
+* version to restore is no longer stored, as after a garbage collection.
+*
+* @param helper Data structure to pass program data between functions.
+* @param old_commit The index of the previous head commit, or NULL_ID.
+* @param commit_index The index of the commit, or NULL_ID for no files.
+* @return 0 if successful, or -1 if a version to restore is not stored or a
+*         file could not be restored. The index is left unchanged then, but
+*         the working directory may have been partly updated.
+*/
+int index_checkout(void *helper, size_t old_commit, size_t commit_index) {
+    struct helper *svc = (struct helper *)helper;
+    size_t mark = scratch_mark(helper);
+    index_flush(helper);
+
+    // Copy the index with the current hashes of the files. Missing files get
+    // an invalid hash, so that they are restored.
+    size_t n_old = svc->index_size;
+    struct file *old_files = scratch_alloc(helper, n_old * sizeof(struct file));
+    memcpy(old_files, svc->index, n_old * sizeof(struct file));
+    uint64_t *hashes = scratch_alloc(helper, n_old * sizeof(uint64_t));
+    hash_files(helper, old_files, n_old, hashes);
+    for (size_t i=0; i<n_old; i++) {
+        old_files[i].hash = hashes[i];
+    }
+
+    struct file *new_files = tree_map(helper, commit_index == NULL_ID ? NULL
+                                              : svc->commits[commit_index].tree);
+    size_t n_new = commit_index == NULL_ID ? 0 : svc->commits[commit_index].n_files;
+    struct change *changes;
+    size_t n_changes;
+    get_changes(helper, &changes, &n_changes, old_files, n_old, new_files, n_new);
+
+    // Check that every version to restore is stored before changing anything
+    int missing = 0;
+    for (size_t i=0; i<n_changes; i++) {
+        struct file *f = changes[i].added_file;
+        if (f != NULL && !object_exists(helper, f->hash, OBJECT_MANIFEST)) {
+            printf("Version %016lx of %s is not stored\n", f->hash, path_name(helper, f->path));
+            missing = 1;
+        }
+    }
+    if (missing) {
+        scratch_release(helper, mark);
+        return -1;
+    }
+
+    // Restore the added and modified files, and delete the removed files
+    // that were committed in the previous head commit
+    struct tree_node *old_tree = old_commit == NULL_ID ? NULL : svc->commits[old_commit].tree;
+    struct file *restore = scratch_alloc(helper, n_changes * sizeof(struct file));
+    size_t n_restore = 0;
+    for (size_t i=0; i<n_changes; i++) {
+        if (changes[i].added_file != NULL) {
+            restore[n_restore] = *changes[i].added_file;
+            n_restore++;
+        } else if (tree_find(helper, old_tree, changes[i].removed_file->path) != NULL) {
+            unlink(path_name(helper, changes[i].removed_file->path));
+        }
+    }
+    if (update_working_directory(helper, restore, n_restore, 1) == -1) {
+        printf("Files could not be restored\n");
+        scratch_release(helper, mark);
+        return -1;
+    }
+    index_load(helper, commit_index);
+    index_copy_stat(helper, old_files, n_old);
+    scratch_release(helper, mark);
+    return 0;
+}
+
+/**
+* Commits a sorted list of files on the current branch. The files are rehashed
+* if they have changed since they were last hashed, and files which no longer
+* exist are removed from the list, which is compacted in place.
+*
+* @param helper Data structure to pass program data between functions.
+* @param message Message to be associated with the commit.
+* @param files The sorted array of files to commit.
+* @param n_files_ptr A pointer to the length of the file array, which is
+*                    updated if files are removed.
+* @param parent2 The index of the second parent for a merge, otherwise NULL_ID.
+* @return The ID of the commit as a hexadecimal string, or NULL if there are
+*         no changes since the head commit or a file could not be stored.
+*/
+char *commit_files(void *helper, char *message, struct file *files,
+                   size_t *n_files_ptr, size_t parent2) {
+    struct helper *svc = helper;
+    size_t n_files = *n_files_ptr;
+
+    // Rehash the files that have changed since they were last hashed
+    uint64_t *hashes = scratch_alloc(helper, n_files * sizeof(uint64_t));
+    hash_files(helper, files, n_files, hashes);
+
+    // Compact the files in one pass, removing the files which do not exist
+    // anymore
+    size_t n_kept = 0;
+    for (size_t i=0; i<n_files; i++) {
+        if (hashes[i] != (uint64_t)-2) {
+            files[n_kept] = files[i];
+            files[n_kept].hash = hashes[i];
+            n_kept++;
+        }
+    }
+    memset(files + n_kept, 0, (n_files - n_kept) * sizeof(struct file));
+    n_files = n_kept;
+    *n_files_ptr = n_files;
+
+    // Find changes between the head commit and the files
+    struct change *changes;
+    size_t n_changes;
+    size_t parent = svc->branches[svc->head].ref_commit;
+    struct file *parent_files = tree_map(helper, parent == NULL_ID ? NULL
+                                                 : svc->commits[parent].tree);
+    get_changes(helper, &changes, &n_changes, parent_files,
+                parent == NULL_ID ? 0 : svc->commits[parent].n_files, files, n_files);
+    if (n_changes == 0) {
+        return NULL;
+    }
+
+    // Update the files in the version control database, making no commit if
+    // a file could not be stored
+    if (update_database(helper, files, n_files) == -1) {
+        printf("Files could not be stored\n");
+        return NULL;
+    }
+
+    // Generate the commit ID
+    int message_len = 0;
+    int id = 0;
+    for (int i=0; message[i]!='\0'; i++) {
+        message_len++;
+        id = (id + (int)message[i]) % 1000;
+    }
+    for (size_t i=0; i<n_changes; i++) {
+        struct change c = changes[i];
+        struct file *f;
+        if (c.added_file != NULL && c.removed_file == NULL) {
+            f = c.added_file;
+            id += 376591;
+        } else if (c.added_file == NULL && c.removed_file != NULL)  {
+            f = c.removed_file;
+            id += 85973;
+        } else {
+            f = c.added_file;
+            id += 9573681;
+        }
+        for (char *ptr = path_name(helper, f->path); *ptr != '\0'; ptr++) {
+            id = ((id * (((int)(unsigned char)(*ptr)) % 37)) % 15485863) + 1;
+        }
+    }
+
+    // Convert the commit id to a hexadecimal string
+    char *commit_id = (char *)allocate(helper, 7*sizeof(char));
+    sprintf(commit_id, "%06x", id);
+
+    // Create the new commit and add it to the list of commits
+    char *message_copy = str_dup(helper, message);
+    struct commit new_commit = {commit_id, message_copy, parent, parent2,
+                                tree_build(helper, files, n_files), n_files,
+                                svc->branches[svc->head].branch_name};
+    svc->commits = array_add(helper, svc->commits, &svc->n_commits,
+                             &svc->commits_cap, &new_commit,
+                             sizeof(struct commit));
+    commit_index_add(helper, svc->n_commits - 1);
+    commit_graph_add(helper, svc->n_commits - 1, changes, n_changes);
+
+    // Change current branch pointer to the new commit
+    svc->branches[svc->head].ref_commit = svc->n_commits-1;
+
+    return commit_id;
+}
+
+/**
+* Performs a commit operation in the version control system, storing a snapshot
+* of the current workspace in the database directory.
+*
+* @param helper Data structure to pass program data between functions.
+* @param message Message to be associated with the commit.
+* @return The ID of the commit as a hexadecimal string.
+*/
+char *svc_commit(void *helper, char *message) {
+    if (message == NULL) {
+        return NULL;
+    }
+    struct helper *svc = helper;
+
+    size_t mark = scratch_mark(helper);
+
+    // Merge the files added and removed since the last commit into the index
+    index_flush(helper);
+
+    size_t index_size = svc->index_size;
+    char *commit_id = commit_files(helper, message, svc->index, &svc->index_size, NULL_ID);
+    if (svc->index_size != index_size) {
+        svc->index_sorted = svc->index_size;
+        index_table_rebuild(helper);
+    }
+    scratch_release(helper, mark);
+    return commit_id;
+}
+
+/**
+* Converts a hexadecimal digit to its value.
+*
+* @param c The digit.
+* @return The value of the digit, or -1 if it is not a hexadecimal digit.
+*/
+int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/**
+* Adds a new commit to the commit lookup structures: the table from commit ID
+* to index in the commits array, and the trie of commit IDs used to resolve
+* abbreviated IDs. Each trie node has one child per hexadecimal digit and
+* counts the distinct IDs below it. If several commits share an ID, the ID
+* refers to the most recent of them.
+*
+* @param helper Data structure to pass program data between functions.
+* @param commit_index The index of the commit in the commits array.
+*/
+void commit_index_add(void *helper, size_t commit_index) {
+    struct helper *svc = (struct helper *)helper;
+    char *commit_id = svc->commits[commit_index].commit_id;
+    int is_new = table_get(&svc->commit_table, commit_id) == NULL_ID;
+    table_put(helper, &svc->commit_table, commit_id, commit_index);
+    if (!is_new) {
+        return;
+    }
+
+    // Walk the trie along the digits of the ID, creating missing nodes and
+    // counting the new ID in every node on the path.
+    if (svc->n_id_nodes == 0) {
+        struct id_node root = {{0}, 0};
+        svc->id_nodes = array_add(helper, svc->id_nodes, &svc->n_id_nodes,
+                                  &svc->id_nodes_cap, &root, sizeof(struct id_node));
+    }
+    size_t node = 0;
+    for (int i=0; i<ID_LENGTH; i++) {
+        svc->id_nodes[node].count++;
+        int digit = hex_value(commit_id[i]);
+        if (i == ID_LENGTH - 1) {
+            svc->id_nodes[node].child[digit] = 1;
+            break;
+        }
+        if (svc->id_nodes[node].child[digit] == 0) {
+            struct id_node new_node = {{0}, 0};
+            svc->id_nodes = array_add(helper, svc->id_nodes, &svc->n_id_nodes,
+                                      &svc->id_nodes_cap, &new_node, sizeof(struct id_node));
+            svc->id_nodes[node].child[digit] = svc->n_id_nodes - 1;
+        }
+        node = svc->id_nodes[node].child[digit];
+    }
+}
+
+/**
+* Computes the positions of the bits set for a path in a Bloom filter, using
+* double hashing of the path's hash.
+*
+* @param hash The hash of the path.
+* @param n_bits The number of bits in the filter.
+* @param bits Array to store the BLOOM_HASHES bit positions.
+*/
+void bloom_bits(uint64_t hash, size_t n_bits, size_t *bits) {
+    uint64_t h1 = hash & 0xFFFFFFFF;
+    uint64_t h2 = (hash >> 32) | 1;
+    for (int i=0; i<BLOOM_HASHES; i++) {
+        bits[i] = (h1 + i * h2) % n_bits;
+    }
+}
+
+/**
+* Adds a new commit to the commit graph, a compact table of each commit's
+* parents and generation number with a Bloom filter of the paths changed
+* relative to its first parent. History queries read only the graph, without
+* the commits' file lists. The generation number is one more than the largest
+* generation of the parents, so ancestors always have smaller generations.
+*
+* @param helper Data structure to pass program data between functions.
+* @param commit_index The index of the commit in the commits array.
+* @param changes The changes between the commit and its first parent.
+* @param n_changes The length of the changes array.
+*/
+void commit_graph_add(void *helper, size_t commit_index, struct change *changes,
+                      size_t n_changes) {
+    struct helper *svc = (struct helper *)helper;
+    struct commit *c = svc->commits + commit_index;
+    struct graph_node node = {c->parent, c->parent2, 1, 0, svc->n_bloom_words};
+    if (c->parent != NULL_ID && svc->graph[c->parent].generation >= node.generation) {
+        node.generation = svc->graph[c->parent].generation + 1;
+    }
+    if (c->parent2 != NULL_ID && svc->graph[c->parent2].generation >= node.generation) {
+        node.generation = svc->graph[c->parent2].generation + 1;
+    }
+
+    // Commits changing too many paths get no filter, so every path is
+    // checked against their file lists
+    if (n_changes <= BLOOM_MAX_PATHS) {
+        node.n_bloom_words = (n_changes * BLOOM_BITS_PER_PATH + 63) / 64;
+        if (svc->n_bloom_words + node.n_bloom_words > svc->bloom_cap) {
+            size_t new_cap = svc->bloom_cap == 0 ? CAP_INIT : svc->bloom_cap * CAP_GROWTH;
+            while (new_cap < svc->n_bloom_words + node.n_bloom_words) {
+                new_cap *= CAP_GROWTH;
+            }
+            svc->bloom = reallocate(helper, svc->bloom, svc->bloom_cap * sizeof(uint64_t),
+                                    new_cap * sizeof(uint64_t));
+            svc->bloom_cap = new_cap;
+        }
+        uint64_t *filter = svc->bloom + node.bloom_offset;
+        memset(filter, 0, node.n_bloom_words * sizeof(uint64_t));
+        size_t bits[BLOOM_HASHES];
+        for (size_t i=0; i<n_changes; i++) {
+            struct file *f = changes[i].added_file != NULL ? changes[i].added_file
+                                                           : changes[i].removed_file;
+            bloom_bits(svc->paths[f->path].name_hash, node.n_bloom_words * 64, bits);
+            for (int j=0; j<BLOOM_HASHES; j++) {
+                filter[bits[j] / 64] |= (uint64_t)1 << (bits[j] % 64);
+            }
+        }
+        svc->n_bloom_words += node.n_bloom_words;
+    }
+    svc->graph = array_add(helper, svc->graph, &svc->n_graph_nodes,
+                           &svc->graph_cap, &node, sizeof(struct graph_node));
+}
+
+/**
+* Checks a commit's Bloom filter for a path.
+*
+* @param helper Data structure to pass program data between functions.
+* @param commit_index The index of the commit in the commits array.
+* @param path The ID of the path.
+* @return 0 if the commit did not change the path, 1 if it may have.
+*/
+int bloom_maybe_changed(void *helper, size_t commit_index, uint32_t path) {
+    struct helper *svc = (struct helper *)helper;
+    struct graph_node *node = svc->graph + commit_index;
+    if (node->n_bloom_words == 0) {
+        return 1;
+    }
+    uint64_t *filter = svc->bloom + node->bloom_offset;
+    size_t bits[BLOOM_HASHES];
+    bloom_bits(svc->paths[path].name_hash, node->n_bloom_words * 64, bits);
+    for (int i=0; i<BLOOM_HASHES; i++) {
+        if ((filter[bits[i] / 64] & ((uint64_t)1 << (bits[i] % 64))) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+* Finds a file in a sorted list of files by binary search.
+*
+* @param helper Data structure to pass program data between functions.
+* @param files The sorted array of files.
+* @param n_files The length of the file array.
+* @param path The ID of the path of the file.
+* @return A pointer to the file, or NULL if it is not in the list.
+*/
+struct file *find_file(void *helper, struct file *files, size_t n_files, uint32_t path) {
+    size_t lo = 0;
+    size_t hi = n_files;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = path_cmp(helper, files[mid].path, path);
+        if (cmp == 0) {
+            return files + mid;
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+/**
+* Checks whether a commit changed a path relative to its first parent. The
+* commit's Bloom filter rules out most paths it did not change, and the
+* remaining paths are looked up in the commit's and the parent's file lists.
+*
+* @param helper Data structure to pass program data between functions.
+* @param commit_index The index of the commit in the commits array.
+* @param path The ID of the path.
+* @return 1 if the commit added, modified or removed the path, otherwise 0.
+*/
+int commit_touches(void *helper, size_t commit_index, uint32_t path) {
+    struct helper *svc = (struct helper *)helper;
+    if (!bloom_maybe_changed(helper, commit_index, path)) {
+        return 0;
+    }
+    struct commit *c = svc->commits + commit_index;
+    struct file *new_file = tree_find(helper, c->tree, path);
+    struct file *old_file = NULL;
+    if (c->parent != NULL_ID) {
+        old_file = tree_find(helper, svc->commits[c->parent].tree, path);
+    }
+    if (new_file == NULL || old_file == NULL) {
+        return new_file != old_file;
+    }
+    return new_file->hash != old_file->hash;
+}
+
+/**
+* Adds a commit to a set of commit indices held in an open-addressed table,
+* whose empty slots are NULL_ID.
+*
+* @param set The table of commit indices.
+* @param cap The number of slots in the table, which is a power of two.
+* @param c The index of the commit.
+* @return 1 if the commit was added, 0 if it was already in the set.
+*/
+int commit_set_add(uint32_t *set, size_t cap, uint32_t c) {
+    size_t i = (size_t)(((uint64_t)c * 0x9E3779B97F4A7C15ULL) >> 32) & (cap - 1);
+    while (set[i] != NULL_ID) {
+        if (set[i] == c) {
+            return 0;
+        }
+        i = (i + 1) & (cap - 1);
+    }
+    set[i] = c;
+    return 1;
+}
+
+/**
+* Checks whether a commit is an ancestor of another commit, walking back from
+* the descendant through the commit graph. Commits whose generation number is
+* not larger than the ancestor's cannot lead to it, so they are not followed.
+* The stack and the set of visited commits are scratch arrays which grow with
+* the number of commits visited.
+*
+* @param helper Data structure to pass program data between functions.
+* @param ancestor The index of the possible ancestor.
+* @param commit_index The index of the possible descendant.
+* @return 1 if the first commit is an ancestor of, or the same as, the
+*         second commit, otherwise 0.
+*/
+int is_ancestor(void *helper, size_t ancestor, size_t commit_index) {
+    struct helper *svc = (struct helper *)helper;
+    if (ancestor == commit_index) {
+        return 1;
+    }
+    uint32_t min_generation = svc->graph[ancestor].generation;
+    if (svc->graph[commit_index].generation <= min_generation) {
+        return 0;
+    }
+
+    // Walk back depth first, visiting each commit once
+    size_t mark = scratch_mark(helper);
+    size_t stack_cap = 64;
+    size_t *stack = scratch_alloc(helper, stack_cap * sizeof(size_t));
+    size_t set_cap = 128;
+    uint32_t *visited = scratch_alloc(helper, set_cap * sizeof(uint32_t));
+    memset(visited, 0xFF, set_cap * sizeof(uint32_t));
+    size_t n_visited = 0;
+    size_t n_stack = 0;
+    stack[n_stack++] = commit_index;
+    int found = 0;
+    while (n_stack > 0 && !found) {
+        struct graph_node *node = svc->graph + stack[--n_stack];
+        uint32_t parents[2] = {node->parent, node->parent2};
+        for (int i=0; i<2; i++) {
+            uint32_t p = parents[i];
+            if (p == ancestor) {
+                found = 1;
+            } else if (p != NULL_ID && svc->graph[p].generation > min_generation
+                       && commit_set_add(visited, set_cap, p)) {
+                n_visited++;
+                if (n_visited * 2 > set_cap) {
+                    uint32_t *old_set = visited;
+                    visited = scratch_alloc(helper, set_cap * 2 * sizeof(uint32_t));
+                    memset(visited, 0xFF, set_cap * 2 * sizeof(uint32_t));
+                    for (size_t j=0; j<set_cap; j++) {
+                        if (old_set[j] != NULL_ID) {
+                            commit_set_add(visited, set_cap * 2, old_set[j]);
+                        }
+                    }
+                    set_cap *= 2;
+                }
+                if (n_stack == stack_cap) {
+                    size_t *old_stack = stack;
+                    stack = scratch_alloc(helper, stack_cap * 2 * sizeof(size_t));
+                    memcpy(stack, old_stack, stack_cap * sizeof(size_t));
+                    stack_cap *= 2;
+                }
+                stack[n_stack++] = p;
+            }
+        }
+    }
+    scratch_release(helper, mark);
+    return found;
+}
+
+/**
+* Checks whether a commit is an ancestor of another commit.
+*
+* @param helper Data structure to pass program data between functions.
+* @param ancestor_id The ID of the possible ancestor, which may be abbreviated.
+* @param commit_id The ID of the possible descendant, which may be abbreviated.
+* @return 1 if the first commit is an ancestor of, or the same as, the second
+*         commit, 0 if it is not, or -1 if either commit is not found.
+*/
+int svc_is_ancestor(void *helper, char *ancestor_id, char *commit_id) {
+    if (ancestor_id == NULL || commit_id == NULL) {
+        return -1;
+    }
+    size_t ancestor = find_commit(helper, ancestor_id);
+    size_t commit_index = find_commit(helper, commit_id);
+    if (ancestor == NULL_ID || commit_index == NULL_ID) {
+        return -1;
+    }
+    return is_ancestor(helper, ancestor, commit_index);
+}
+
+/**
+* Checks whether a commit added, modified or removed a file relative to its
+* first parent.
+*
+* @param helper Data structure to pass program data between functions.
+* @param commit_id The ID of the commit, which may be abbreviated.
+* @param file_name The path of the file.
+* @return 1 if the commit changed the file, 0 if it did not, or -1 if the
+*         commit is not found.
+*/
+int svc_touches_path(void *helper, char *commit_id, char *file_name) {
+    if (commit_id == NULL || file_name == NULL) {
+        return -1;
+    }
+    size_t commit_index = find_commit(helper, commit_id);
+    if (commit_index == NULL_ID) {
+        return -1;
+    }
+
+    // Paths that were never added to the repository cannot be in any commit
+    uint32_t path = path_find(helper, file_name);
+    if (path == NULL_ID) {
+        return 0;
+    }
+    return commit_touches(helper, commit_index, path);
+}
+
+/**
+* Finds a commit given its ID or a unique prefix of its ID. Full IDs are
+* looked up in the commit table. Prefixes are resolved by walking the trie of
+* commit IDs, then following the only branch below the prefix to the full ID.
+*
+* @param helper Data structure to pass program data between functions.
+* @param commit_id The commit ID or abbreviated commit ID.
+* @return The index of the commit in the commits array, or NULL_ID if no
+*         commit matches or the prefix matches more than one commit.
+*/
+size_t find_commit(void *helper, char *commit_id) {
+    struct helper *svc = (struct helper *)helper;
+    size_t length = strlen(commit_id);
+    if (length == ID_LENGTH || length == 0 || length > ID_LENGTH) {
+        return length == ID_LENGTH ? table_get(&svc->commit_table, commit_id) : NULL_ID;
+    }
+    if (svc->n_id_nodes == 0) {
+        return NULL_ID;
+    }
+
+    // Follow the prefix down the trie
+    char full_id[ID_LENGTH + 1];
+    size_t node = 0;
+    for (size_t i=0; i<length; i++) {
+        int digit = hex_value(commit_id[i]);
+        if (digit == -1 || svc->id_nodes[node].child[digit] == 0) {
+            return NULL_ID;
+        }
+        full_id[i] = "0123456789abcdef"[digit];
+        node = svc->id_nodes[node].child[digit];
+    }
+    if (svc->id_nodes[node].count != 1) {
+        return NULL_ID;
+    }
+
+    // Complete the ID along the single remaining branch
+    for (size_t i=length; i<ID_LENGTH; i++) {
+        int digit = 0;
+        while (svc->id_nodes[node].child[digit] == 0) {
+            digit++;
+        }
+        full_id[i] = "0123456789abcdef"[digit];
+        node = svc->id_nodes[node].child[digit];
+    }
+    full_id[ID_LENGTH] = '\0';
+    return table_get(&svc->commit_table, full_id);
+}
+
+/**
+* Returns the memory address of a commit object given the ID of the commit,
+* or a prefix of the ID that matches only one commit.
+*
+* @param helper Data structure to pass program data between functions.
+* @param commit_id The ID of the desired commit.
+* @return A pointer to the commit object. NULL if commit is not found.
+*/
+void *get_commit(void *helper, char *commit_id) {
+    if (commit_id == NULL) {
+        return NULL;
+    }
+    struct helper *svc = helper;
+
+    // Look up the ID in the commit table
+    size_t commit_index = find_commit(helper, commit_id);
+    if (commit_index == NULL_ID) {
+        return NULL;
+    }
+    return (void *)(svc->commits + commit_index);
+}
+
+/**
+* Given a commit object, returns a list of its direct parents' commit IDs in
+* a dynamically allocated array.
+*
+* @param helper Data structure to pass program data between functions.
+* @param commit A pointer to a commit object.
+* @param A pointer to where the number of parents will be stored.
+* @return A dynamically allocated array containing the parents' commit IDs.
+*/
+char **get_prev_commits(void *helper, void *commit, int *n_prev) {
+    if (n_prev == NULL) {
+        return NULL;
+    }
+    *n_prev = 0;
+    struct commit *c = (struct commit *)commit;
+    struct helper *svc = (struct helper *)helper;
+    // Return NULL if either the commit or its first parent is NULL.
+    if (c == NULL || c->parent == NULL_ID) {
+        return NULL;
+    }
+    char **prev_commits;
+    if (c->parent2 != NULL_ID) {
+        *n_prev = 2;
+        prev_commits = (char **)malloc(2 * sizeof(char *));
+        prev_commits[0] = svc->commits[c->parent].commit_id;
+        prev_commits[1] = svc->commits[c->parent2].commit_id;
+    } else {
+        *n_prev = 1;
+        prev_commits = (char **)malloc(sizeof(char *));
+        prev_commits[0] = svc->commits[c->parent].commit_id;
+    }
+    return prev_commits;
+}
+
+/**
+* Moves a commit up a max-heap of commits ordered by generation number.
+*
+* @param helper Data structure to pass program data between functions.
+* @param heap The heap of commit indices.
+* @param n The number of commits in the heap, including the new one at the end.
+*/
+void generation_heap_push(void *helper, size_t *heap, size_t n) {
+    struct helper *svc = (struct helper *)helper;
+    size_t i = n - 1;
+    while (i > 0 && svc->graph[heap[(i - 1) / 2]].generation < svc->graph[heap[i]].generation) {
+        size_t tmp = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+}
+
+/**
+* Removes the commit with the highest generation number from a max-heap of
+* commits.
+*
+* @param helper Data structure to pass program data between functions.
+* @param heap The heap of commit indices.
+* @param n The number of commits in the heap before the removal.
+* @return The index of the removed commit.
+*/
+size_t generation_heap_pop(void *helper, size_t *heap, size_t n) {
+    struct helper *svc = (struct helper *)helper;
+    size_t top = heap[0];
+    n--;
+    heap[0] = heap[n];
+    size_t i = 0;
     while (1) {
-        // Exit loop if both arrays have been fully traversed.
-        if (i_old == old_len && i_new == new_len) {
+        size_t largest = i;
+        for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < n; child++) {
+            if (svc->graph[heap[child]].generation > svc->graph[heap[largest]].generation) {
+                largest = child;
+            }
+        }
+        if (largest == i) {
+            return top;
+        }
+        size_t tmp = heap[i];
+        heap[i] = heap[largest];
+        heap[largest] = tmp;
+        i = largest;
+    }
+}
+
+/**
+* Finds the merge base of two commits, which is their lowest common ancestor.
+* Ancestors of both commits are visited in decreasing generation number, each
+* marked with the side it was reached from. A commit's generation number is
+* larger than its parents', so the first commit reached from both sides has no
+* common ancestor below it and the walk stops there.
+*
+* @param helper Data structure to pass program data between functions.
+* @param a The index of the first commit.
+* @param b The index of the second commit.
+* @return The index of the merge base, or NULL_ID if there is none.
+*/
+size_t merge_base(void *helper, size_t a, size_t b) {
+    struct helper *svc = (struct helper *)helper;
+    if (a == NULL_ID || b == NULL_ID) {
+        return NULL_ID;
+    }
+    if (a == b) {
+        return a;
+    }
+
+    // Each commit is pushed at most once for each side it is reached from
+    size_t heap_size = svc->n_commits * (2 * sizeof(size_t) + 1) + 1;
+    size_t *heap = mmap(NULL, heap_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    unsigned char *flags = (unsigned char *)(heap + 2 * svc->n_commits);
+    size_t n_heap = 0;
+    flags[a] = 1;
+    heap[n_heap++] = a;
+    generation_heap_push(helper, heap, n_heap);
+    flags[b] = 2;
+    heap[n_heap++] = b;
+    generation_heap_push(helper, heap, n_heap);
+
+    size_t base = NULL_ID;
+    while (n_heap > 0) {
+        size_t c = generation_heap_pop(helper, heap, n_heap);
+        n_heap--;
+        if (flags[c] == 3) {
+            base = c;
             break;
         }
-        // If the old files array has been traversed while the new files still
-        // has files remaining, all the remaining files in the new files array
-        // must be additions as a result of the arrays in sorted order.
-        if (i_old == old_len) {
-            // Add the remaining files as additions and exit the loop
-            while (i_new != new_len) {
-                struct change c = {NULL, new_files + i_new};
-                changes = (struct change *)array_add(helper, changes, &n_changes, &changes_cap, &c , sizeof(struct change));
-                i_new++;
+        uint32_t parents[2] = {svc->graph[c].parent, svc->graph[c].parent2};
+        for (int i=0; i<2; i++) {
+            uint32_t p = parents[i];
+            if (p != NULL_ID && (flags[p] | flags[c]) != flags[p]) {
+                flags[p] |= flags[c];
+                heap[n_heap++] = p;
+                generation_heap_push(helper, heap, n_heap);
             }
+        }
+    }
+    munmap(heap, heap_size);
+    return base;
+}
+
+/**
+* Returns the merge base of two commits, which is their lowest common ancestor.
+*
+* @param helper Data structure to pass program data between functions.
+* @param commit1 A pointer to a commit object.
+* @param commit2 A pointer to a commit object.
+* @return A pointer to the merge base commit object. NULL if the commits have
+*         no common ancestor.
+*/
+void *get_merge_base(void *helper, void *commit1, void *commit2) {
+    struct helper *svc = (struct helper *)helper;
+    if (commit1 == NULL || commit2 == NULL) {
+        return NULL;
+    }
+    size_t base = merge_base(helper, (struct commit *)commit1 - svc->commits,
+                             (struct commit *)commit2 - svc->commits);
+    if (base == NULL_ID) {
+        return NULL;
+    }
+    return (void *)(svc->commits + base);
+}
+
+/**
+* Opens the contents of a file version as one block of memory. A version
+* stored as a single raw chunk, or stored before chunking was introduced, is
+* the mapping of its object, without any copy. Other versions are assembled
+* in the scratch arena, with compressed chunks decompressed straight into
+* place.
+*
+* @param helper Data structure to pass program data between functions.
+* @param hash The hash of the file version.
+* @param view The object to open, whose data and size are the contents of the
+*             version. It is closed with object_close().
+* @return 0 if successful, otherwise -1.
+*/
+int version_open(void *helper, uint64_t hash, struct object *view) {
+    struct object manifest;
+    if (object_open(helper, hash, OBJECT_MANIFEST, &manifest) == -1) {
+        return -1;
+    }
+    const struct manifest *m = (const struct manifest *)object_data(&manifest);
+    if (manifest.size > 0 && m == NULL) {
+        object_close(&manifest);
+        return -1;
+    }
+    if (manifest.size < sizeof(struct manifest) || m->magic != MANIFEST_MAGIC) {
+        *view = manifest;
+        return 0;
+    }
+    const struct chunk_ref *refs = (const struct chunk_ref *)(m + 1);
+    if (m->n_chunks == 1 && object_open(helper, refs[0].id, OBJECT_CHUNK, view) == 0) {
+        if (view->size == refs[0].length && object_data(view) != NULL) {
+            object_close(&manifest);
+            return 0;
+        }
+        object_close(view);
+    }
+
+    // Copy each chunk into its position in the contents
+    unsigned char *contents = scratch_alloc(helper, m->file_size);
+    size_t offset = 0;
+    int failed = 0;
+    for (unsigned int i=0; i<m->n_chunks && !failed; i++) {
+        struct object chunk;
+        if (offset + refs[i].length > m->file_size
+            || object_open(helper, refs[i].id, OBJECT_CHUNK, &chunk) == -1) {
+            failed = 1;
             break;
         }
-        // If the new files array has been traversed while the old files still
-        // have files remaining, all the remaining files in the old files array
-        // must be deletions.
-        else if (i_new == new_len) {
-            // Add the remaining files as deletions and exit the loop
-            while (i_old != old_len) {
-                struct change c = {old_files + i_old, NULL};
-                changes = (struct change *)array_add(helper, changes, &n_changes, &changes_cap, &c , sizeof(struct change));
-                i_old++;
+        const unsigned char *data = object_data(&chunk);
+        if (chunk.size == refs[i].length) {
+            failed = data == NULL && chunk.size > 0;
+            if (!failed) {
+                memcpy(contents + offset, data, chunk.size);
             }
-            break;
+        } else {
+            failed = chunk.fd == -1 || data == NULL
+                     || lz_decompress(data, chunk.size, contents + offset, refs[i].length) == -1;
         }
+        object_close(&chunk);
+        offset += refs[i].length;
+    }
+    failed |= offset != m->file_size;
+    view->fd = -1;
+    view->offset = 0;
+    view->size = m->file_size;
+    view->data = contents;
+    view->loose = 0;
+    object_close(&manifest);
+    return failed ? -1 : 0;
+}
 
-        // Compare the files at the current indices for i_old and i_new
-        struct file *old = old_files + i_old;
-        struct file *new = new_files + i_new;
-        int cmp = file_cmp(old, new);
+/**
+* Splits one side of a diff into lines, each ending after a newline or at the
+* end of the contents.
+*
+* @param helper Data structure to pass program data between functions.
+* @param side The side to set up.
+* @param data The contents.
+* @param size The size of the contents.
+*/
+void diff_split(void *helper, struct diff_side *side, const unsigned char *data, size_t size) {
+    const unsigned char *end = data + size;
+    size_t n_lines = 0;
+    for (const unsigned char *p = data; p < end; n_lines++) {
+        const unsigned char *newline = memchr(p, '\n', end - p);
+        p = newline == NULL ? end : newline + 1;
+    }
+    side->data = data;
+    side->size = size;
+    side->n_lines = n_lines;
+    side->starts = scratch_alloc(helper, (n_lines + 1) * sizeof(size_t));
+    side->ids = scratch_alloc(helper, n_lines * sizeof(uint32_t));
+    const unsigned char *p = data;
+    for (size_t i=0; i<n_lines; i++) {
+        side->starts[i] = p - data;
+        const unsigned char *newline = memchr(p, '\n', end - p);
+        p = newline == NULL ? end : newline + 1;
+    }
+    side->starts[n_lines] = size;
+}
 
-        // If the file names match, then check for modification by comparing
-        // hash values
-        if (cmp == 0) {
-            if (old->hash != new->hash) {
-                struct change c = {old, new};
-                changes = (struct change *)array_add(helper, changes, &n_changes, &changes_cap, &c , sizeof(struct change));
+/**
+* Checks whether a line of one side of a diff has the same bytes as a line of
+* the other side.
+*
+* @param a The first side.
+* @param i The index of the line in the first side.
+* @param b The second side.
+* @param j The index of the line in the second side.
+* @return 1 if the lines are the same, otherwise 0.
+*/
+int diff_line_equal(struct diff_side *a, size_t i, struct diff_side *b, size_t j) {
+    size_t n = a->starts[i + 1] - a->starts[i];
+    return n == b->starts[j + 1] - b->starts[j]
+           && memcmp(a->data + a->starts[i], b->data + b->starts[j], n) == 0;
+}
+
+/**
+* Hashes the lines in a range of each side of a diff, and gives lines with
+* the same contents the same ID. IDs count up from 0 in order of first use.
+* The sides are interned in step, so that a line usually finds its match
+* from the other side still in the cache.
+*
+* @param d The diff.
+* @param a_lo The first line of the old side's range.
+* @param a_hi The end of the old side's range.
+* @param b_lo The first line of the new side's range.
+* @param b_hi The end of the new side's range.
+*/
+void diff_intern(struct diff *d, size_t a_lo, size_t a_hi, size_t b_lo, size_t b_hi) {
+    size_t n_lines = (a_hi - a_lo) + (b_hi - b_lo);
+    size_t cap = CAP_INIT_TABLE;
+    while (cap < n_lines + n_lines/2) {
+        cap *= CAP_GROWTH;
+    }
+    size_t mask = cap - 1;
+    struct diff_slot *slots = scratch_alloc(d->helper, cap * sizeof(struct diff_slot));
+    memset(slots, 0, cap * sizeof(struct diff_slot));
+
+    // The first line with each ID, numbered after the old side's lines if it
+    // is in the new side
+    size_t *first = scratch_alloc(d->helper, n_lines * sizeof(size_t));
+    struct diff_side *sides[2] = {&d->a, &d->b};
+    size_t lo[2] = {a_lo, b_lo};
+    size_t hi[2] = {a_hi, b_hi};
+    uint32_t n_ids = 0;
+    size_t n_steps = a_hi - a_lo > b_hi - b_lo ? a_hi - a_lo : b_hi - b_lo;
+    for (size_t step=0; step<2*n_steps; step++) {
+        int s = step & 1;
+        struct diff_side *side = sides[s];
+        size_t i = lo[s] + step/2;
+        if (i < hi[s]) {
+            uint64_t hash = hash_bytes(side->data + side->starts[i],
+                                       side->starts[i + 1] - side->starts[i]);
+            size_t j = hash & mask;
+            while (slots[j].id != 0) {
+                size_t line = first[slots[j].id - 1];
+                if (slots[j].hash == hash >> 32
+                    && (line < d->a.n_lines ? diff_line_equal(&d->a, line, side, i)
+                        : diff_line_equal(&d->b, line - d->a.n_lines, side, i))) {
+                    break;
+                }
+                j = (j + 1) & mask;
             }
-            i_new++;
-            i_old++;
-        }
-        // If the old file is alphabetically ahead of the new file, then the
-        // new file must be an addition due to the sorted property.
-        else if (cmp > 0) {
-            struct change c = {NULL, new};
-            changes = (struct change *)array_add(helper, changes, &n_changes, &changes_cap, &c , sizeof(struct change));
-            i_new++;
+            if (slots[j].id == 0) {
+                first[n_ids] = s == 0 ? i : d->a.n_lines + i;
+                slots[j].hash = hash >> 32;
+                slots[j].id = ++n_ids;
+            }
+            side->ids[i] = slots[j].id - 1;
         }
-        // If the old file is alphabetically behind the new file, then the old
-        // file must have been removed and is no longer in the new list.
-        else {
-            struct change c = {old, NULL};
-            changes = (struct change *)array_add(helper, changes, &n_changes, &changes_cap, &c , sizeof(struct change));
-            i_old++;
+    }
+    d->n_ids = n_ids;
+}
+
+/**
+* Appends a run of matching lines to a diff, joining it to the previous run
+* if they are adjacent.
+*
+* @param d The diff.
+* @param a The first line of the run in the old side.
+* @param b The first line of the run in the new side.
+* @param n The number of lines.
+*/
+void diff_emit(struct diff *d, size_t a, size_t b, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    if (d->n_matches > 0) {
+        struct diff_match *last = d->matches + d->n_matches - 1;
+        if (last->a + last->n == a && last->b + last->n == b) {
+            last->n += n;
+            return;
         }
     }
-    // Set the return values
-    *changes_ptr = changes;
-    *n_changes_ptr = n_changes;
+    struct diff_match match = {a, b, n};
+    d->matches[d->n_matches++] = match;
 }
 
 /**
-* Performs a commit operation in the version control system, storing a snapshot
-* of the current workspace in the database directory.
+* Diffs a range of lines with Myers' algorithm, which finds the fewest lines
+* to remove and add. The furthest point reached on each diagonal is kept for
+* every number of edits, then the path is followed back from the end. In a
+* range too different to reach the end within DIFF_MYERS_LINES edits or
+* DIFF_MAX_COST steps, the path to the furthest point reached is taken, and
+* the range is moved past it.
 *
-* @param helper Data structure to pass program data between functions.
-* @param message Message to be associated with the commit.
-* @return The ID of the commit as a hexadecimal string.
+* @param d The diff.
+* @param a_lo The first line of the old side's range, which is advanced past
+*             the lines diffed.
+* @param a_hi The end of the old side's range.
+* @param b_lo The first line of the new side's range, which is advanced past
+*             the lines diffed.
+* @param b_hi The end of the new side's range.
+* @return 0 if the whole range was diffed, otherwise -1.
 */
-char *svc_commit(void *helper, char *message) {
-    if (message == NULL) {
-        return NULL;
+int diff_myers(struct diff *d, size_t *a_lo, size_t a_hi, size_t *b_lo, size_t b_hi) {
+    size_t mark = scratch_mark(d->helper);
+    const uint32_t *a = d->a.ids + *a_lo;
+    const uint32_t *b = d->b.ids + *b_lo;
+    long n = a_hi - *a_lo;
+    long m = b_hi - *b_lo;
+    long max_edits = n + m < DIFF_MYERS_LINES ? n + m : DIFF_MYERS_LINES;
+    long *v = (long *)scratch_alloc(d->helper, (2*max_edits + 3) * sizeof(long)) + max_edits + 1;
+    long **trace = scratch_alloc(d->helper, (max_edits + 1) * sizeof(long *));
+    size_t cost = 0;
+    long n_edits = -1;
+    long e = 0;
+    v[1] = 0;
+    for (; e<=max_edits && n_edits == -1 && (e <= 1 || cost <= DIFF_MAX_COST); e++) {
+        for (long k=-e; k<=e; k+=2) {
+            // Take the further of a removal and an addition, then follow the
+            // diagonal while the lines match
+            long x = k == -e || (k != e && v[k - 1] < v[k + 1]) ? v[k + 1] : v[k - 1] + 1;
+            long start = x;
+            while (x < n && x - k < m && a[x] == b[x - k]) {
+                x++;
+            }
+            cost += 1 + x - start;
+            v[k] = x;
+            if (x >= n && x - k >= m) {
+                n_edits = e;
+                break;
+            }
+        }
+        trace[e] = scratch_alloc(d->helper, (2*e + 1) * sizeof(long));
+        memcpy(trace[e], v - e, (2*e + 1) * sizeof(long));
     }
-    struct helper *svc = helper;
 
-    // Sort new files in the index
-    qsort(svc->index, svc->index_size, sizeof(struct file), file_cmp);
+    // Without reaching the end, stop at the point inside the range which is
+    // furthest from the start
+    long x = n;
+    long y = m;
+    int finished = n_edits != -1;
+    if (!finished) {
+        n_edits = e - 1;
+        long *last = trace[n_edits] + n_edits;
+        long furthest = -1;
+        for (long k=-n_edits; k<=n_edits; k+=2) {
+            if (last[k] <= n && last[k] - k >= 0 && last[k] - k <= m
+                && 2*last[k] - k > furthest) {
+                furthest = 2*last[k] - k;
+                x = last[k];
+                y = last[k] - k;
+            }
+        }
+    }
+    size_t a_end = *a_lo + x;
+    size_t b_end = *b_lo + y;
 
-    // Rehash the new files
-    size_t i = 0;
-    while (i < svc->index_size) {
-        int new_hash = hash_file(helper, svc->index[i].file_name);
-        // If the file is tracked but does not exist anymore, remove the file
-        if (new_hash == -2) {
-            for (size_t j=i; j<svc->index_size; j++) {
-                svc->index[j] = svc->index[j + 1];
-            }
-            svc->index_size--;
-            memset(svc->index + svc->index_size, 0, sizeof(struct file));
-            continue;
+    // Follow the path back, collecting each diagonal run in reverse order
+    struct diff_match *runs = scratch_alloc(d->helper, (n_edits + 1) * sizeof(struct diff_match));
+    size_t n_runs = 0;
+    for (e=n_edits; e>0; e--) {
+        long *prev = trace[e - 1] + e - 1;
+        long k = x - y;
+        long prev_k = k == -e || (k != e && prev[k - 1] < prev[k + 1]) ? k + 1 : k - 1;
+        long start = prev_k == k + 1 ? prev[prev_k] : prev[prev_k] + 1;
+        struct diff_match run = {*a_lo + start, *b_lo + start - k, x - start};
+        runs[n_runs++] = run;
+        x = prev[prev_k];
+        y = x - prev_k;
+    }
+    struct diff_match run = {*a_lo, *b_lo, x};
+    runs[n_runs++] = run;
+    while (n_runs > 0) {
+        n_runs--;
+        diff_emit(d, runs[n_runs].a, runs[n_runs].b, runs[n_runs].n);
+    }
+    *a_lo = a_end;
+    *b_lo = b_end;
+    scratch_release(d->helper, mark);
+    return finished ? 0 : -1;
+}
+
+/**
+* Finds the anchors of patience diff in a range: the lines occurring exactly
+* once in each side, which are matched to each other, and of those the
+* longest run in the same order on both sides.
+*
+* @param d The diff.
+* @param a_lo The first line of the old side's range.
+* @param a_hi The end of the old side's range.
+* @param b_lo The first line of the new side's range.
+* @param b_hi The end of the new side's range.
+* @param anchors_ptr Set to the anchors in order, as runs of one line,
+*                    allocated in the scratch arena.
+* @return The number of anchors.
+*/
+size_t diff_anchors(struct diff *d, size_t a_lo, size_t a_hi, size_t b_lo, size_t b_hi,
+                    struct diff_match **anchors_ptr) {
+    const uint32_t *a = d->a.ids;
+    const uint32_t *b = d->b.ids;
+    for (size_t i=a_lo; i<a_hi; i++) {
+        d->count_a[a[i]]++;
+    }
+    for (size_t j=b_lo; j<b_hi; j++) {
+        d->count_b[b[j]]++;
+        d->pos_b[b[j]] = j;
+    }
+    size_t *unique = scratch_alloc(d->helper, (a_hi - a_lo) * sizeof(size_t));
+    size_t n_unique = 0;
+    for (size_t i=a_lo; i<a_hi; i++) {
+        if (d->count_a[a[i]] == 1 && d->count_b[a[i]] == 1) {
+            unique[n_unique++] = i;
         }
-        svc->index[i].hash = new_hash;
-        i++;
+    }
+    for (size_t i=a_lo; i<a_hi; i++) {
+        d->count_a[a[i]] = 0;
+    }
+    for (size_t j=b_lo; j<b_hi; j++) {
+        d->count_b[b[j]] = 0;
     }
 
-    // Find changes between the head commit and the index
-    struct change *changes;
-    size_t n_changes;
-    if (svc->branches[svc->head].ref_commit == NULL_ID) {
-        get_changes(helper, &changes, &n_changes,
-                    NULL, 0, svc->index, svc->index_size);
-    } else {
-        get_changes(helper, &changes, &n_changes,
-                    svc->commits[svc->branches[svc->head].ref_commit].files,
-                    svc->commits[svc->branches[svc->head].ref_commit].n_files,
-                    svc->index, svc->index_size);
+    // Patience sorting: tails[l] is the unique line ending the best run of
+    // length l + 1 found so far, and prev links each line to the one before
+    uint32_t *pos = scratch_alloc(d->helper, n_unique * sizeof(uint32_t));
+    for (size_t u=0; u<n_unique; u++) {
+        pos[u] = d->pos_b[a[unique[u]]];
     }
-    if (n_changes == 0) {
-        return NULL;
+    size_t *tails = scratch_alloc(d->helper, n_unique * sizeof(size_t));
+    size_t *prev = scratch_alloc(d->helper, n_unique * sizeof(size_t));
+    size_t n_tails = 0;
+    for (size_t u=0; u<n_unique; u++) {
+        // Lines usually stay in order, extending the longest run
+        size_t lo = n_tails;
+        if (n_tails > 0 && pos[tails[n_tails - 1]] > pos[u]) {
+            lo = 0;
+            size_t hi = n_tails - 1;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (pos[tails[mid]] < pos[u]) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+        }
+        prev[u] = lo == 0 ? NULL_ID : tails[lo - 1];
+        tails[lo] = u;
+        n_tails += lo == n_tails;
+    }
+    struct diff_match *anchors = scratch_alloc(d->helper, n_tails * sizeof(struct diff_match));
+    size_t u = n_tails == 0 ? NULL_ID : tails[n_tails - 1];
+    for (size_t l=n_tails; l>0; l--) {
+        struct diff_match anchor = {unique[u], pos[u], 1};
+        anchors[l - 1] = anchor;
+        u = prev[u];
     }
+    *anchors_ptr = anchors;
+    return n_tails;
+}
 
-    // Update the files in the version control database
-    update_database(svc->index, svc->index_size);
+/**
+* Diffs a range of lines. Lines matching at the start and end are taken
+* first. Small ranges are then diffed with Myers' algorithm, and large ranges
+* are split at the anchors of patience diff, which keeps large files with
+* scattered changes fast. Large ranges without anchors fall back to Myers'
+* algorithm with limited effort, continuing from wherever it stopped.
+*
+* @param d The diff.
+* @param a_lo The first line of the old side's range.
+* @param a_hi The end of the old side's range.
+* @param b_lo The first line of the new side's range.
+* @param b_hi The end of the new side's range.
+* @param depth The number of patience splits around the range.
+*/
+void diff_range(struct diff *d, size_t a_lo, size_t a_hi, size_t b_lo, size_t b_hi,
+                int depth) {
+    const uint32_t *a = d->a.ids;
+    const uint32_t *b = d->b.ids;
+    size_t start = 0;
+    while (a_lo + start < a_hi && b_lo + start < b_hi && a[a_lo + start] == b[b_lo + start]) {
+        start++;
+    }
+    diff_emit(d, a_lo, b_lo, start);
+    a_lo += start;
+    b_lo += start;
+    size_t end = 0;
+    while (a_hi - end > a_lo && b_hi - end > b_lo && a[a_hi - end - 1] == b[b_hi - end - 1]) {
+        end++;
+    }
+    a_hi -= end;
+    b_hi -= end;
 
-    // Generate the commit ID
-    int message_len = 0;
-    int id = 0;
-    for (int i=0; message[i]!='\0'; i++) {
-        message_len++;
-        id = (id + (int)message[i]) % 1000;
+    if (a_lo < a_hi && b_lo < b_hi) {
+        size_t mark = scratch_mark(d->helper);
+        struct diff_match *anchors;
+        size_t n_anchors = 0;
+        if ((a_hi - a_lo) + (b_hi - b_lo) > DIFF_MYERS_LINES && depth < DIFF_MAX_DEPTH) {
+            n_anchors = diff_anchors(d, a_lo, a_hi, b_lo, b_hi, &anchors);
+        }
+        if (n_anchors == 0 && diff_myers(d, &a_lo, a_hi, &b_lo, b_hi) == -1) {
+            diff_range(d, a_lo, a_hi, b_lo, b_hi, depth + 1);
+        }
+        for (size_t i=0; i<n_anchors; i++) {
+            diff_range(d, a_lo, anchors[i].a, b_lo, anchors[i].b, depth + 1);
+            diff_emit(d, anchors[i].a, anchors[i].b, 1);
+            a_lo = anchors[i].a + 1;
+            b_lo = anchors[i].b + 1;
+        }
+        if (n_anchors > 0) {
+            diff_range(d, a_lo, a_hi, b_lo, b_hi, depth + 1);
+        }
+        scratch_release(d->helper, mark);
     }
-    for (size_t i=0; i<n_changes; i++) {
-        struct change c = changes[i];
-        struct file *f;
-        if (c.added_file != NULL && c.removed_file == NULL) {
-            f = c.added_file;
-            id += 376591;
-        } else if (c.added_file == NULL && c.removed_file != NULL)  {
-            f = c.removed_file;
-            id += 85973;
+    diff_emit(d, a_hi, b_hi, end);
+}
+
+/**
+* Interns and diffs a range of lines, unless one side of it is empty and all
+* its lines were removed or added.
+*
+* @param d The diff.
+* @param a_lo The first line of the old side's range.
+* @param a_hi The end of the old side's range.
+* @param b_lo The first line of the new side's range.
+* @param b_hi The end of the new side's range.
+*/
+void diff_block(struct diff *d, size_t a_lo, size_t a_hi, size_t b_lo, size_t b_hi) {
+    if (a_lo == a_hi || b_lo == b_hi) {
+        return;
+    }
+    size_t mark = scratch_mark(d->helper);
+    diff_intern(d, a_lo, a_hi, b_lo, b_hi);
+    d->count_a = scratch_alloc(d->helper, 3 * (size_t)d->n_ids * sizeof(uint32_t));
+    memset(d->count_a, 0, 2 * (size_t)d->n_ids * sizeof(uint32_t));
+    d->count_b = d->count_a + d->n_ids;
+    d->pos_b = d->count_b + d->n_ids;
+    diff_range(d, a_lo, a_hi, b_lo, b_hi, 0);
+    scratch_release(d->helper, mark);
+}
+
+/**
+* Finds the first line of one side of a diff starting at or after an offset.
+*
+* @param side The side.
+* @param offset The byte offset.
+* @return The index of the line, or the number of lines if none starts there.
+*/
+size_t diff_line_at(struct diff_side *side, size_t offset) {
+    size_t lo = 0;
+    size_t hi = side->n_lines;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (side->starts[mid] < offset) {
+            lo = mid + 1;
         } else {
-            f = c.added_file;
-            id += 9573681;
-        }
-        for (char *ptr = f->file_name; *ptr != '\0'; ptr++) {
-            id = ((id * (((int)(unsigned char)(*ptr)) % 37)) % 15485863) + 1;
+            hi = mid;
         }
     }
+    return lo;
+}
 
-    // Convert the commit id to a hexadecimal string
-    char *commit_id = (char *)allocate(helper, 7*sizeof(char));
-    sprintf(commit_id, "%06x", id);
+/**
+* Finds the lines inside a run of bytes which is the same in both sides of a
+* diff. These are the lines of the old side which start and end inside the
+* run, and start where a line of the new side starts.
+*
+* @param d The diff.
+* @param a_offset The offset of the run in the old side.
+* @param b_offset The offset of the run in the new side.
+* @param n The number of bytes in the run.
+* @param match Set to the matching lines.
+* @return 1 if any lines match, otherwise 0.
+*/
+int diff_byte_run(struct diff *d, size_t a_offset, size_t b_offset, size_t n,
+                  struct diff_match *match) {
+    size_t i = diff_line_at(&d->a, a_offset);
+    if (i < d->a.n_lines && d->a.starts[i] == a_offset && b_offset > 0
+        && d->b.data[b_offset - 1] != '\n') {
+        i++;
+    }
+    size_t end = diff_line_at(&d->a, a_offset + n + 1) - 1;
+    if (i >= end) {
+        return 0;
+    }
+    size_t j = diff_line_at(&d->b, b_offset + d->a.starts[i] - a_offset);
+    if (j + end - i > d->b.n_lines || d->b.starts[j] != b_offset + d->a.starts[i] - a_offset) {
+        return 0;
+    }
+    match->a = i;
+    match->b = j;
+    match->n = end - i;
+    return 1;
+}
 
-    // Create the new commit and add it to the list of commits
-    char *message_copy = str_dup(helper, message);
-    struct file *files_copy = files_dup(helper, svc->index, svc->index_size);
-    struct commit new_commit = {commit_id, message_copy,
-                                svc->branches[svc->head].ref_commit, NULL_ID,
-                                files_copy, svc->index_size,
-                                svc->branches[svc->head].branch_name};
-    svc->commits = array_add(helper, svc->commits, &svc->n_commits,
-                             &svc->commits_cap, &new_commit,
-                             sizeof(struct commit));
+/**
+* Splits a range of lines of one side of a diff into content-defined chunks,
+* making a side whose entries are the chunks instead of lines.
+*
+* @param helper Data structure to pass program data between functions.
+* @param side The side of chunks to set up.
+* @param lines The side of lines.
+* @param lo The first line of the range.
+* @param hi The end of the range.
+*/
+void diff_split_chunks(void *helper, struct diff_side *side, struct diff_side *lines,
+                       size_t lo, size_t hi) {
+    size_t offset = lines->starts[lo];
+    size_t end = lines->starts[hi];
+    size_t cap = (end - offset) / CHUNK_MIN + 2;
+    side->data = lines->data;
+    side->size = end;
+    side->starts = scratch_alloc(helper, cap * sizeof(size_t));
+    side->ids = scratch_alloc(helper, cap * sizeof(uint32_t));
+    side->n_lines = 0;
+    while (offset < end) {
+        side->starts[side->n_lines++] = offset;
+        offset += chunk_boundary(lines->data + offset, end - offset);
+    }
+    side->starts[side->n_lines] = end;
+}
 
-    // Change current branch pointer to the new commit
-    svc->branches[svc->head].ref_commit = svc->n_commits-1;
+/**
+* Diffs a large range of lines, first diffing the content-defined chunks of
+* both sides as if each chunk was a line. The chunks change only around each
+* edit, so the runs of matching chunks match most lines without interning
+* them, and only the lines between the runs are interned and diffed.
+*
+* @param d The diff.
+* @param a_lo The first line of the old side's range.
+* @param a_hi The end of the old side's range.
+* @param b_lo The first line of the new side's range.
+* @param b_hi The end of the new side's range.
+*/
+void diff_chunks(struct diff *d, size_t a_lo, size_t a_hi, size_t b_lo, size_t b_hi) {
+    size_t mark = scratch_mark(d->helper);
+    struct diff chunks;
+    memset(&chunks, 0, sizeof(struct diff));
+    chunks.helper = d->helper;
+    diff_split_chunks(d->helper, &chunks.a, &d->a, a_lo, a_hi);
+    diff_split_chunks(d->helper, &chunks.b, &d->b, b_lo, b_hi);
+    size_t n_chunks = chunks.a.n_lines < chunks.b.n_lines ? chunks.a.n_lines : chunks.b.n_lines;
+    chunks.matches = scratch_alloc(d->helper, (n_chunks + 1) * sizeof(struct diff_match));
+    diff_block(&chunks, 0, chunks.a.n_lines, 0, chunks.b.n_lines);
 
-    return commit_id;
+    for (size_t i=0; i<chunks.n_matches; i++) {
+        struct diff_match *run = chunks.matches + i;
+        size_t a_offset = chunks.a.starts[run->a];
+        struct diff_match lines;
+        if (diff_byte_run(d, a_offset, chunks.b.starts[run->b],
+                          chunks.a.starts[run->a + run->n] - a_offset, &lines)) {
+            diff_block(d, a_lo, lines.a, b_lo, lines.b);
+            diff_emit(d, lines.a, lines.b, lines.n);
+            a_lo = lines.a + lines.n;
+            b_lo = lines.b + lines.n;
+        }
+    }
+    diff_block(d, a_lo, a_hi, b_lo, b_hi);
+    scratch_release(d->helper, mark);
 }
 
 /**
-* Returns the memory address of a commit object given the ID of the commit.
+* Finds the lines two versions of a file have in common. The lines matching
+* at the start and end are compared byte by byte, and only the lines between
+* them are hashed, interned and diffed by diff_range(), after diff_chunks()
+* if they are large. The diff refers to the contents and the scratch arena,
+* which must outlive it.
 *
 * @param helper Data structure to pass program data between functions.
-* @param commit_id The ID of the desired commit.
-* @return A pointer to the commit object. NULL if commit is not found.
+* @param d The diff to compute.
+* @param old The contents of the old version.
+* @param old_size The size of the old version.
+* @param new The contents of the new version.
+* @param new_size The size of the new version.
 */
-void *get_commit(void *helper, char *commit_id) {
-    if (commit_id == NULL) {
-        return NULL;
+void diff_lines(void *helper, struct diff *d, const unsigned char *old, size_t old_size,
+                const unsigned char *new, size_t new_size) {
+    memset(d, 0, sizeof(struct diff));
+    d->helper = helper;
+    diff_split(helper, &d->a, old, old_size);
+    diff_split(helper, &d->b, new, new_size);
+    size_t n_a = d->a.n_lines;
+    size_t n_b = d->b.n_lines;
+
+    // Every run holds at least one line of each side
+    d->matches = scratch_alloc(helper, ((n_a < n_b ? n_a : n_b) + 1) * sizeof(struct diff_match));
+    size_t start = 0;
+    while (start < n_a && start < n_b && diff_line_equal(&d->a, start, &d->b, start)) {
+        start++;
     }
-    struct helper *svc = helper;
+    size_t end = 0;
+    while (start + end < n_a && start + end < n_b
+           && diff_line_equal(&d->a, n_a - end - 1, &d->b, n_b - end - 1)) {
+        end++;
+    }
+    diff_emit(d, 0, 0, start);
+    if (d->a.starts[n_a - end] - d->a.starts[start] > DIFF_CHUNKED_SIZE
+        || d->b.starts[n_b - end] - d->b.starts[start] > DIFF_CHUNKED_SIZE) {
+        diff_chunks(d, start, n_a - end, start, n_b - end);
+    } else {
+        diff_block(d, start, n_a - end, start, n_b - end);
+    }
+    diff_emit(d, n_a - end, n_b - end, end);
+
+    size_t n_same = 0;
+    for (size_t i=0; i<d->n_matches; i++) {
+        n_same += d->matches[i].n;
+    }
+    d->n_removed = n_a - n_same;
+    d->n_added = n_b - n_same;
+}
 
-    // Loop through all the commits to find a matching ID
-    struct commit *c = NULL;
-    for (size_t i=0; i<svc->n_commits; i++) {
-        if (strcmp(svc->commits[i].commit_id, commit_id) == 0) {
-            c = svc->commits + i;
+/**
+* Prints a line of a diff after its prefix, marking a last line without a
+* newline as patch tools expect.
+*
+* @param side The side holding the line.
+* @param i The index of the line.
+* @param prefix ' ' for context, '-' for removed and '+' for added lines.
+*/
+void print_diff_line(struct diff_side *side, size_t i, char prefix) {
+    const unsigned char *line = side->data + side->starts[i];
+    size_t n = side->starts[i + 1] - side->starts[i];
+    putchar(prefix);
+    fwrite(line, 1, n, stdout);
+    if (line[n - 1] != '\n') {
+        printf("\n\\ No newline at end of file\n");
+    }
+}
+
+/**
+* Prints a diff in the unified format, with DIFF_CONTEXT unchanged lines
+* around each change. Changes closer than twice the context share a hunk.
+*
+* @param d The diff.
+*/
+void print_diff(struct diff *d) {
+    // Each change is the lines between two runs, or before the first run or
+    // after the last
+    size_t mark = scratch_mark(d->helper);
+    struct diff_change *changes = scratch_alloc(d->helper, (d->n_matches + 1)
+                                                           * sizeof(struct diff_change));
+    size_t n_changes = 0;
+    size_t a = 0;
+    size_t b = 0;
+    for (size_t i=0; i<=d->n_matches; i++) {
+        size_t next_a = i < d->n_matches ? d->matches[i].a : d->a.n_lines;
+        size_t next_b = i < d->n_matches ? d->matches[i].b : d->b.n_lines;
+        if (next_a > a || next_b > b) {
+            struct diff_change change = {a, b, next_a - a, next_b - b};
+            changes[n_changes++] = change;
+        }
+        if (i < d->n_matches) {
+            a = next_a + d->matches[i].n;
+            b = next_b + d->matches[i].n;
         }
     }
-    if (c == NULL) {
-        return NULL;
+
+    for (size_t first=0, last=0; first<n_changes; first=++last) {
+        while (last + 1 < n_changes
+               && changes[last + 1].a - (changes[last].a + changes[last].n_removed)
+                  <= 2*DIFF_CONTEXT) {
+            last++;
+        }
+        size_t before = changes[first].a < DIFF_CONTEXT ? changes[first].a : DIFF_CONTEXT;
+        size_t a_end = changes[last].a + changes[last].n_removed;
+        size_t after = d->a.n_lines - a_end < DIFF_CONTEXT ? d->a.n_lines - a_end
+                                                            : DIFF_CONTEXT;
+        size_t a_lo = changes[first].a - before;
+        size_t b_lo = changes[first].b - before;
+        size_t a_n = a_end + after - a_lo;
+        size_t b_n = changes[last].b + changes[last].n_added + after - b_lo;
+        printf("@@ -%zu,%zu +%zu,%zu @@\n", a_n > 0 ? a_lo + 1 : a_lo, a_n,
+               b_n > 0 ? b_lo + 1 : b_lo, b_n);
+        for (size_t i=a_lo; i<changes[first].a; i++) {
+            print_diff_line(&d->a, i, ' ');
+        }
+        for (size_t c=first; c<=last; c++) {
+            size_t context_end = c < last ? changes[c + 1].a : a_end + after;
+            for (size_t i=0; i<changes[c].n_removed; i++) {
+                print_diff_line(&d->a, changes[c].a + i, '-');
+            }
+            for (size_t i=0; i<changes[c].n_added; i++) {
+                print_diff_line(&d->b, changes[c].b + i, '+');
+            }
+            for (size_t i=changes[c].a + changes[c].n_removed; i<context_end; i++) {
+                print_diff_line(&d->a, i, ' ');
+            }
+        }
     }
-    return (void *)c;
+    scratch_release(d->helper, mark);
 }
 
 /**
-* Given a commit object, returns a list of its direct parents' commit IDs in
-* a dynamically allocated array.
+* Prints the line diff between two versions of a file, read from the
+* database through version_open().
 *
 * @param helper Data structure to pass program data between functions.
-* @param commit A pointer to a commit object.
-* @param A pointer to where the number of parents will be stored.
-* @return A dynamically allocated array containing the parents' commit IDs.
+* @param old_file The old version, or NULL if the file was added.
+* @param new_file The new version, or NULL if the file was removed.
 */
-char **get_prev_commits(void *helper, void *commit, int *n_prev) {
-    if (n_prev == NULL) {
-        return NULL;
+void print_file_diff(void *helper, struct file *old_file, struct file *new_file) {
+    size_t mark = scratch_mark(helper);
+    struct file *files[2] = {old_file, new_file};
+    struct object views[2];
+    const unsigned char *data[2] = {NULL, NULL};
+    size_t sizes[2] = {0, 0};
+    int opened[2] = {0, 0};
+    int binary = 0;
+    for (int s=0; s<2; s++) {
+        if (files[s] == NULL) {
+            continue;
+        }
+        if (version_open(helper, files[s]->hash, views + s) == -1) {
+            printf("Version %016lx is not stored\n", files[s]->hash);
+            break;
+        }
+        opened[s] = 1;
+        data[s] = object_data(views + s);
+        sizes[s] = views[s].size;
+        size_t probe = sizes[s] < DIFF_BINARY_PROBE ? sizes[s] : DIFF_BINARY_PROBE;
+        binary |= probe > 0 && memchr(data[s], '\0', probe) != NULL;
     }
-    *n_prev = 0;
-    struct commit *c = (struct commit *)commit;
-    struct helper *svc = (struct helper *)helper;
-    // Return NULL if either the commit or its first parent is NULL.
-    if (c == NULL || c->parent == NULL_ID) {
-        return NULL;
+    if ((files[0] == NULL || opened[0]) && (files[1] == NULL || opened[1])) {
+        if (binary) {
+            printf("Binary files differ\n");
+        } else {
+            struct diff d;
+            diff_lines(helper, &d, data[0], sizes[0], data[1], sizes[1]);
+            print_diff(&d);
+        }
     }
-    char **prev_commits;
-    if (c->parent2 != NULL_ID) {
-        *n_prev = 2;
-        prev_commits = (char **)malloc(2 * sizeof(char *));
-        prev_commits[0] = svc->commits[c->parent].commit_id;
-        prev_commits[1] = svc->commits[c->parent2].commit_id;
-    } else {
-        *n_prev = 1;
-        prev_commits = (char **)malloc(sizeof(char *));
-        prev_commits[0] = svc->commits[c->parent].commit_id;
+    for (int s=0; s<2; s++) {
+        if (opened[s]) {
+            object_close(views + s);
+        }
     }
-    return prev_commits;
+    scratch_release(helper, mark);
 }
 
 /**
-* Prints the details of a commit.
+* Prints the details of a commit, with the line diff of each file it changed
+* from its parent.
 *
 * @param helper Data structure to pass program data between functions.
 * @param commit_id The ID of the commit to be printed out.
@@ -680,38 +6407,81 @@ void print_commit(void *helper, char *commit_id) {
     struct helper *svc = (struct helper *)helper;
 
     // Get the changes between the commit's files and its parent's files.
+    size_t mark = scratch_mark(helper);
     struct change *changes;
     size_t n_changes;
-    if (c->parent == NULL_ID) {
-        get_changes(helper, &changes, &n_changes, NULL, 0, c->files, c->n_files);
-    } else if (svc->commits[c->parent].files == NULL) {
-        get_changes(helper, &changes, &n_changes, NULL, 0, c->files, c->n_files);
-    } else {
-        get_changes(helper, &changes, &n_changes, svc->commits[c->parent].files, svc->commits[c->parent].n_files,
-                                                            c->files, c->n_files);
-    }
+    struct file *files = tree_map(helper, c->tree);
+    struct file *parent_files = tree_map(helper, c->parent == NULL_ID ? NULL
+                                                 : svc->commits[c->parent].tree);
+    get_changes(helper, &changes, &n_changes, parent_files,
+                c->parent == NULL_ID ? 0 : svc->commits[c->parent].n_files, files, c->n_files);
 
     // Print the commit details
     printf("%s [%s]: %s\n", c->commit_id, c->branch_name, c->message);
     for (size_t i=0; i<n_changes; i++) {
         if (changes[i].added_file != NULL && changes[i].removed_file == NULL) {
-            printf("    + %s\n", changes[i].added_file->file_name);
+            printf("    + %s\n", path_name(helper, changes[i].added_file->path));
         } else if (changes[i].added_file == NULL && changes[i].removed_file != NULL) {
-            printf("    - %s\n", changes[i].removed_file->file_name);
+            printf("    - %s\n", path_name(helper, changes[i].removed_file->path));
         } else {
-            printf("    / %s [%10d -> %10d]\n", changes[i].removed_file->file_name,
+            printf("    / %s [%016lx -> %016lx]\n",
+                   path_name(helper, changes[i].removed_file->path),
                                            changes[i].removed_file->hash,
                                            changes[i].added_file->hash);
         }
+        print_file_diff(helper, changes[i].removed_file, changes[i].added_file);
+    }
+    printf("\n    Tracked files (%ld):\n", c->n_files);
+    for (size_t i=0; i<c->n_files; i++) {
+        printf("    [%016lx] %s\n", files[i].hash, path_name(helper, files[i].path));
+    }
+    scratch_release(helper, mark);
+}
+
+/**
+* Prints the line diffs of the files which differ between two commits, each
+* after the names of its old and new versions.
+*
+* @param helper Data structure to pass program data between functions.
+* @param commit_id1 The ID of the old commit.
+* @param commit_id2 The ID of the new commit.
+* @return 0 if successful, -1 if an ID is NULL, or -2 if a commit does not
+*         exist.
+*/
+int svc_diff(void *helper, char *commit_id1, char *commit_id2) {
+    if (commit_id1 == NULL || commit_id2 == NULL) {
+        return -1;
     }
-    printf("\n    Tracked files (%ld):\n", c->n_files);
-    for (size_t i=0; i<c->n_files; i++) {
-        printf("    [%10d] %s\n", c->files[i].hash, c->files[i].file_name);
+    struct helper *svc = (struct helper *)helper;
+    size_t old_index = find_commit(helper, commit_id1);
+    size_t new_index = find_commit(helper, commit_id2);
+    if (old_index == NULL_ID || new_index == NULL_ID) {
+        return -2;
+    }
+    size_t mark = scratch_mark(helper);
+    struct commit *old_commit = svc->commits + old_index;
+    struct commit *new_commit = svc->commits + new_index;
+    struct file *old_files = tree_map(helper, old_commit->tree);
+    struct file *new_files = tree_map(helper, new_commit->tree);
+    struct change *changes;
+    size_t n_changes;
+    get_changes(helper, &changes, &n_changes, old_files, old_commit->n_files,
+                new_files, new_commit->n_files);
+    for (size_t i=0; i<n_changes; i++) {
+        struct file *old_file = changes[i].removed_file;
+        struct file *new_file = changes[i].added_file;
+        char *name = path_name(helper, (old_file != NULL ? old_file : new_file)->path);
+        printf("--- %s%s\n", old_file != NULL ? "a/" : "", old_file != NULL ? name : "/dev/null");
+        printf("+++ %s%s\n", new_file != NULL ? "b/" : "", new_file != NULL ? name : "/dev/null");
+        print_file_diff(helper, old_file, new_file);
     }
+    scratch_release(helper, mark);
+    return 0;
 }
 
 /**
-* Creates a new branch in the version control system.
+* Creates a new branch in the version control system. The branch is added to
+* the branch table for lookup by name and to the sorted list of branch names.
 *
 * @param helper Data structure to pass program data between functions.
 * @param branch_name The name of the branch.
@@ -730,10 +6500,8 @@ int svc_branch(void *helper, char *branch_name) {
     struct helper *svc = (struct helper *)helper;
 
     // Check that the branch name does not already exist
-    for (size_t i=0; i<svc->n_branches; i++) {
-        if (strcmp(svc->branches[i].branch_name, branch_name) == 0) {
-            return -2;
-        }
+    if (table_get(&svc->branch_table, branch_name) != NULL_ID) {
+        return -2;
     }
     // Check that there are no uncommitted changed in the index
     if (uncommitted_changes(helper) == 1) {
@@ -748,6 +6516,16 @@ int svc_branch(void *helper, char *branch_name) {
     }
     svc->branches = array_add(helper, svc->branches, &svc->n_branches,
                               &svc->branches_cap, &b, sizeof(struct branch));
+    table_put(helper, &svc->branch_table, branch_name_copy, svc->n_branches - 1);
+
+    // Insert the name into the sorted list of branch names
+    size_t position = branch_lower_bound(helper, branch_name_copy);
+    svc->branch_names = array_add(helper, svc->branch_names, &svc->n_branch_names,
+                                  &svc->branch_names_cap, &branch_name_copy,
+                                  sizeof(char *));
+    memmove(svc->branch_names + position + 1, svc->branch_names + position,
+            (svc->n_branch_names - 1 - position) * sizeof(char *));
+    svc->branch_names[position] = branch_name_copy;
     return 0;
 }
 
@@ -764,99 +6542,403 @@ int svc_checkout(void *helper, char *branch_name) {
     }
     struct helper *svc = (struct helper *)helper;
 
-    // Find the branch by looping through the branches array
-    size_t branch_index = NULL_ID;
-    for (size_t i=0; i<svc->n_branches; i++) {
-        if (strcmp(svc->branches[i].branch_name, branch_name) == 0) {
-            branch_index = i;
-        }
-    }
+    // Find the branch in the branch table
+    size_t branch_index = table_get(&svc->branch_table, branch_name);
     if (branch_index == NULL_ID) {
         return -1;
     }
     if (uncommitted_changes(helper) == 1) {
         return -2;
     }
+    // Update the index and the working directory to the files in the new
+    // branch
+    if (index_checkout(helper, svc->branches[svc->head].ref_commit,
+                       svc->branches[branch_index].ref_commit) == -1) {
+        return -3;
+    }
+
     // Set the head branch
     svc->head = branch_index;
+    return 0;
+}
 
-    // Update the list of tracked files in the index
-    struct commit new_ref = svc->commits[svc->branches[svc->head].ref_commit];
-    if (svc->branches[svc->head].ref_commit != NULL_ID) {
-        svc->index = files_dup(helper, new_ref.files, new_ref.n_files);
-        svc->index_size = new_ref.n_files;
-        svc->index_cap = new_ref.n_files;
-    } else {
-        svc->index = NULL;
-        svc->index_size = 0;
-        svc->index_cap = 0;
+/**
+* Finds the position of the first branch name in the sorted list of branch
+* names that is not less than a given string, using binary search.
+*
+* @param helper Data structure to pass program data between functions.
+* @param name The string to search for.
+* @return The position in the sorted list of branch names.
+*/
+size_t branch_lower_bound(void *helper, char *name) {
+    struct helper *svc = (struct helper *)helper;
+    size_t low = 0;
+    size_t high = svc->n_branch_names;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strcmp(svc->branch_names[mid], name) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
     }
-    // Restore the working directory to the files in the new branch
-    update_working_directory(svc->index, svc->index_size, 1);
-    return 0;
+    return low;
 }
 
 /**
-* Returns a list of all branch names in the version control system.
+* Returns the names of all branches starting with a prefix, in sorted order.
+* The names are returned as a view into the sorted list of branch names, so
+* nothing is allocated. The view is valid until the next branch is created
+* and must not be freed.
 *
 * @param helper Data structure to pass program data between functions.
+* @param prefix The prefix of the branch names, such as "release/".
 * @param n_branches Pointer to where the number of branches will be stored.
-* @return A dynamically allocated array of branch names.
+* @return The array of matching branch names.
 */
-char **list_branches(void *helper, int *n_branches) {
-    if (n_branches == NULL) {
+char **list_branches_prefix(void *helper, char *prefix, int *n_branches) {
+    if (n_branches == NULL || prefix == NULL) {
         return NULL;
     }
     struct helper *svc = (struct helper *)helper;
 
-    // Create an array to store the list of branch names
-    char **branches = (char **)malloc((svc->n_branches)*sizeof(char *));
-
-    // Copy a reference to all branch names and store them in the array
-    for (size_t i=0; i<svc->n_branches; i++) {
-        struct branch *b = &(svc->branches[i]);
-        branches[i] = b->branch_name;
-        printf("%s\n", b->branch_name);
+    // All names with the prefix follow the first name not less than the
+    // prefix in sorted order.
+    size_t prefix_len = strlen(prefix);
+    size_t begin = branch_lower_bound(helper, prefix);
+    size_t low = begin;
+    size_t high = svc->n_branch_names;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strncmp(svc->branch_names[mid], prefix, prefix_len) == 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
     }
-    *n_branches = svc->n_branches;
-    return branches;
+    *n_branches = low - begin;
+    return svc->branch_names + begin;
+}
+
+/**
+* Returns a list of all branch names in the version control system, in sorted
+* order. The list is a view into the sorted list of branch names, so it is
+* valid until the next branch is created and must not be freed.
+*
+* @param helper Data structure to pass program data between functions.
+* @param n_branches Pointer to where the number of branches will be stored.
+* @return The array of branch names.
+*/
+char **list_branches(void *helper, int *n_branches) {
+    return list_branches_prefix(helper, "", n_branches);
 }
 
 /**
 * Adds a file to the index (the currently tracked files).
 *
 * @param file_name The file path of the file to be added.
-* @return If successful returns 0, otherwise returns a negative value.
+* @return If successful returns the hash of the file, otherwise returns a
+*         negative value. -3 if the file does not exist or cannot be hashed.
 */
-int svc_add(void *helper, char *file_name) {
+uint64_t svc_add(void *helper, char *file_name) {
     if (file_name == NULL) {
         return -1;
     }
     struct helper *svc = helper;
 
     // Check if the file is already staged in the index
-    if (svc->index != NULL) {
-        for (size_t i=0; i<svc->index_size; i++) {
-            if (strcmp(svc->index[i].file_name, file_name) == 0) {
-                return -2;
-            }
-        }
+    if (is_tracked(helper, file_name)) {
+        return -2;
     }
     // Check that the file exists
     if (file_exists(file_name) == 0) {
         return -3;
     }
-    // Create file
-    int hash = hash_file(helper, file_name);
-    char *file_name_copy = str_dup(helper, file_name);
-    struct file f = {hash, file_name_copy};
+    // Create file, recording its stat data while it is hashed
+    struct file f = {.hash = 0, .path = path_intern(helper, file_name)};
+    uint64_t hash = stat_hash(helper, &f);
+    if (hash == (uint64_t)-2) {
+        return -3;
+    }
 
     // Add file to index
     svc->index = array_add(helper, svc->index, &svc->index_size,
                            &svc->index_cap, &f, sizeof(struct file));
+    table_put(helper, &svc->index_table, path_name(helper, f.path), svc->index_size - 1);
     return hash;
 }
 
+/**
+* Appends a path made of a directory and a name to a path list, growing the
+* list's buffer with realloc() so that it can be used from pool threads.
+*
+* @param list The path list.
+* @param dir The directory path, or NULL if the name is the whole path.
+* @param name The name of the entry in the directory.
+* @return 0 if successful, or -1 if the buffer cannot grow.
+*/
+int path_list_push(struct path_list *list, char *dir, char *name) {
+    size_t dir_len = dir == NULL ? 0 : strlen(dir);
+    size_t name_len = strlen(name);
+    size_t needed = list->len + dir_len + name_len + 2;
+    if (needed > list->cap) {
+        size_t cap = needed > list->cap * CAP_GROWTH ? needed : list->cap * CAP_GROWTH;
+        char *data = realloc(list->data, cap);
+        if (data == NULL) {
+            return -1;
+        }
+        list->data = data;
+        list->cap = cap;
+    }
+    char *ptr = list->data + list->len;
+    if (dir_len > 0) {
+        memcpy(ptr, dir, dir_len);
+        ptr += dir_len;
+        if (dir[dir_len - 1] != '/') {
+            *ptr++ = '/';
+        }
+    }
+    memcpy(ptr, name, name_len + 1);
+    list->len = (ptr - list->data) + name_len + 1;
+    list->count++;
+    return 0;
+}
+
+/**
+* Lists one directory with getdents64, sorting its entries into regular files
+* and subdirectories. Used as a parallel_for() task on each level of the walk.
+* Symbolic links are not followed, and the database directory is skipped
+* whichever path it is reached through.
+*
+* @param arg The array of directory listings for the current level.
+* @param i The index of the directory to list.
+*/
+void walk_dir_task(void *arg, size_t i) {
+    struct dir_listing *listing = ((struct dir_listing *)arg) + i;
+    int dir_fd = openat(AT_FDCWD, listing->dir_path, O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1) {
+        return;
+    }
+    struct stat dir_sb;
+    if (fstat(dir_fd, &dir_sb) == -1
+        || (dir_sb.st_dev == listing->db_dev && dir_sb.st_ino == listing->db_ino)) {
+        close(dir_fd);
+        return;
+    }
+    // The paths of entries in the working directory are not prefixed with "./"
+    char *dir = strcmp(listing->dir_path, ".") == 0 ? NULL : listing->dir_path;
+
+    char buf[DIRENT_BUFFER];
+    long n_read;
+    while ((n_read = syscall(SYS_getdents64, dir_fd, buf, sizeof(buf))) > 0) {
+        for (long offset = 0; offset < n_read; ) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(buf + offset);
+            offset += entry->d_reclen;
+            char *name = entry->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat sb;
+                if (fstatat(dir_fd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+                    continue;
+                }
+                type = S_ISREG(sb.st_mode) ? DT_REG : S_ISDIR(sb.st_mode) ? DT_DIR : DT_LNK;
+            }
+            if ((type == DT_REG && path_list_push(&listing->files, dir, name) == -1)
+                || (type == DT_DIR && path_list_push(&listing->dirs, dir, name) == -1)) {
+                listing->failed = 1;
+            }
+        }
+    }
+    close(dir_fd);
+}
+
+/**
+* Adds many files to the index in a single batch. Files that are already
+* tracked, do not exist or are not regular files are skipped. The files are hashed in parallel and
+* the index grows at most once for the whole batch.
+*
+* @param helper Data structure to pass program data between functions.
+* @param file_names The array of file paths to add.
+* @param n_files The length of the file path array.
+* @return The number of files added to the index, or -1 if the array is NULL.
+*/
+int svc_add_paths(void *helper, char **file_names, int n_files) {
+    if (file_names == NULL || n_files < 0) {
+        return -1;
+    }
+    struct helper *svc = (struct helper *)helper;
+
+    // Collect the files which are not tracked yet
+    size_t mark = scratch_mark(helper);
+    struct file *files = scratch_alloc(helper, n_files * sizeof(struct file));
+    uint64_t *hashes = scratch_alloc(helper, n_files * sizeof(uint64_t));
+    size_t n_new = 0;
+    for (int i=0; i<n_files; i++) {
+        if (file_names[i] != NULL && !is_tracked(helper, file_names[i])) {
+            struct file f = {.hash = 0, .path = path_intern(helper, file_names[i])};
+            files[n_new] = f;
+            n_new++;
+        }
+    }
+
+    // Hash all the files in parallel, recording their stat data
+    hash_files(helper, files, n_new, hashes);
+
+    // Grow the index once for the whole batch, then insert each file that
+    // exists, skipping paths repeated within the batch.
+    if (svc->index_size + n_new + 1 > svc->index_cap) {
+        size_t new_cap = svc->index_cap * CAP_GROWTH;
+        if (new_cap < svc->index_size + n_new + 1) {
+            new_cap = svc->index_size + n_new + 1;
+        }
+        svc->index = reallocate(helper, svc->index, svc->index_cap * sizeof(struct file),
+                                new_cap * sizeof(struct file));
+        svc->index_cap = new_cap;
+    }
+    int n_added = 0;
+    for (size_t i=0; i<n_new; i++) {
+        char *file_name = path_name(helper, files[i].path);
+        if (hashes[i] == (uint64_t)-2 || is_tracked(helper, file_name)) {
+            continue;
+        }
+        svc->index[svc->index_size] = files[i];
+        table_put(helper, &svc->index_table, file_name, svc->index_size);
+        svc->index_size++;
+        n_added++;
+    }
+    scratch_release(helper, mark);
+    return n_added;
+}
+
+/**
+* Frees the listings of one level of a directory walk, with their path lists.
+*
+* @param level The listings, whose first listing holds their number.
+*/
+void dir_listings_free(struct dir_listing *level) {
+    for (size_t i=0; i<level[0].n_listings; i++) {
+        free(level[i].files.data);
+        free(level[i].dirs.data);
+    }
+    free(level);
+}
+
+/**
+* Adds every regular file below a directory to the index. The directory tree
+* is walked one level at a time, with all the directories of a level listed
+* in parallel, and the files found are then added with svc_add_paths().
+*
+* @param helper Data structure to pass program data between functions.
+* @param root The path of the directory, "." for the working directory.
+* @return The number of files added to the index, or -1 if the root cannot
+*         be opened as a directory or the walk runs out of memory.
+*/
+int svc_add_tree(void *helper, char *root) {
+    if (root == NULL) {
+        return -1;
+    }
+    struct stat sb;
+    struct stat db_sb;
+    if (stat(root, &sb) == -1 || !S_ISDIR(sb.st_mode) || stat("svc_db", &db_sb) == -1) {
+        return -1;
+    }
+
+    // Paths below the working directory are stored without a leading "./"
+    while (root[0] == '.' && root[1] == '/') {
+        root += 2;
+        while (root[0] == '/') {
+            root++;
+        }
+    }
+    if (root[0] == '\0') {
+        root = ".";
+    }
+
+    // Every level's listings are kept until the end, as the paths of the
+    // files and of the next level's directories point into them.
+    struct dir_listing **levels = NULL;
+    size_t n_levels = 0;
+    struct dir_listing *level = calloc(1, sizeof(struct dir_listing));
+    size_t level_size = 1;
+    size_t n_found = 0;
+    int failed = level == NULL;
+    if (!failed) {
+        level[0].dir_path = root;
+    }
+    while (!failed && level_size > 0) {
+        for (size_t i=0; i<level_size; i++) {
+            level[i].db_dev = db_sb.st_dev;
+            level[i].db_ino = db_sb.st_ino;
+        }
+        parallel_for(helper, level_size, walk_dir_task, level);
+        level[0].n_listings = level_size;
+        struct dir_listing **grown = realloc(levels, (n_levels + 1) * sizeof(struct dir_listing *));
+        if (grown == NULL) {
+            dir_listings_free(level);
+            level = NULL;
+            failed = 1;
+            break;
+        }
+        levels = grown;
+        levels[n_levels] = level;
+        n_levels++;
+
+        // Gather the subdirectories found into the next level
+        size_t next_size = 0;
+        for (size_t i=0; i<level_size; i++) {
+            next_size += level[i].dirs.count;
+            n_found += level[i].files.count;
+            failed |= level[i].failed;
+        }
+        struct dir_listing *next = failed ? NULL : calloc(next_size + 1, sizeof(struct dir_listing));
+        if (next == NULL) {
+            level = NULL;
+            failed = 1;
+            break;
+        }
+        size_t j = 0;
+        for (size_t i=0; i<level_size; i++) {
+            char *path = level[i].dirs.data;
+            for (size_t k=0; k<level[i].dirs.count; k++) {
+                next[j].dir_path = path;
+                path += strlen(path) + 1;
+                j++;
+            }
+        }
+        level = next;
+        level_size = next_size;
+    }
+    free(level);
+
+    // Gather the files found on every level and add them as one batch
+    int n_added = -1;
+    char **paths = failed ? NULL : malloc((n_found + 1) * sizeof(char *));
+    if (paths != NULL) {
+        size_t n_paths = 0;
+        for (size_t l=0; l<n_levels; l++) {
+            for (size_t i=0; i<levels[l][0].n_listings; i++) {
+                char *path = levels[l][i].files.data;
+                for (size_t k=0; k<levels[l][i].files.count; k++) {
+                    paths[n_paths] = path;
+                    path += strlen(path) + 1;
+                    n_paths++;
+                }
+            }
+        }
+        n_added = svc_add_paths(helper, paths, n_paths);
+    }
+
+    free(paths);
+    for (size_t l=0; l<n_levels; l++) {
+        dir_listings_free(levels[l]);
+    }
+    free(levels);
+    return n_added;
+}
+
 /**
 * Removes a file from the index (list of tracked files).
 *
@@ -864,7 +6946,7 @@ int svc_add(void *helper, char *file_name) {
 * @param file_name The path of the file to be removed.
 * @return If successful returns 0, otherwise returns a negative value.
 */
-int svc_rm(void *helper, char *file_name) {
+uint64_t svc_rm(void *helper, char *file_name) {
     if (file_name == NULL) {
         return -1;
     }
@@ -872,28 +6954,24 @@ int svc_rm(void *helper, char *file_name) {
     struct helper *svc = helper;
 
     // Check that the file is being tracked
-    if (svc->index != NULL) {
-        for (size_t i=0; i<svc->index_size; i++) {
-            if (strcmp(svc->index[i].file_name, file_name) == 0) {
-                int hash = svc->index[i].hash;
-
-                // Remove the file from the index
-                svc->index[i].file_name = NULL;
-                svc->index_size--;
-                svc->index[i] = svc->index[svc->index_size];
-                memset(svc->index + svc->index_size, 0, sizeof(struct file));
-                return hash;
-            }
-        }
+    size_t i = table_remove(&svc->index_table, file_name);
+    if (i == NULL_ID) {
+        return -2;
     }
-    return -2;
+    uint64_t hash = svc->index[i].hash;
+
+    // Leave the file in place with a null path until the index is flushed,
+    // so that the order of the index is kept
+    svc->index[i].path = NULL_ID;
+    svc->index_removed++;
+    return hash;
 }
 
 /**
 * Resets the current branch to a previous commit.
 *
 * @param helper Data structure to pass program data between functions.
-* @param commit_id The ID of the commit to reset to.
+* @param commit_id The ID of the commit to reset to, which may be abbreviated.
 * @return If successful returns 0, otherwise returns a negative value.
 */
 int svc_reset(void *helper, char *commit_id) {
@@ -902,201 +6980,344 @@ int svc_reset(void *helper, char *commit_id) {
     }
     struct helper *svc = (struct helper *)helper;
 
-    // Find the index of the target commit by looping through the commits array
-    size_t target_index = NULL_ID;
-    for (size_t i=0; i<svc->n_commits; i++) {
-        struct commit *c = svc->commits + i;
-        if (strcmp(c->commit_id, commit_id) == 0) {
-            target_index = i;
-            break;
-        }
-    }
+    // Find the index of the target commit in the commit table
+    size_t target_index = find_commit(helper, commit_id);
     if (target_index == NULL_ID) {
         return -2;
     }
 
-    // Set the head to point to the target commit
+    // Update the index and the working directory to match the files in the
+    // target commit, leaving the head where it is if its files are not stored
     struct branch *head = svc->branches + svc->head;
-    head->ref_commit = target_index;
-
-    // Update the index to match the files in the target commit
-    struct commit target = svc->commits[head->ref_commit];
-    svc->index = files_dup(helper, target.files, target.n_files);
-    svc->index_size = target.n_files;
-    svc->index_cap = target.n_files;
+    if (index_checkout(helper, head->ref_commit, target_index) == -1) {
+        return -3;
+    }
 
-    // Restore the working directory to contain the target commit files
-    update_working_directory(svc->index, svc->index_size, 1);
+    // Set the head to point to the target commit
+    head->ref_commit = target_index;
     return 0;
 }
 
 /**
-* Merges another branch into the currently active branch.
+* Lines up the versions of every path in the merge base and both sides of a
+* merge. All three file lists must be sorted, and are traversed once.
 *
 * @param helper Data structure to pass program data between functions.
-* @param branch_name The name of the branch to be merged into the current one.
-* @param resolutions Array of resolutions to modify files in the merge.
-* @param n_resolutions The size of the resolutions array.
-* @return The commit ID of the merged commit.
+* @param base The files of the merge base.
+* @param n_base The length of the merge base file array.
+* @param ours The files of the current branch.
+* @param n_ours The length of the current branch file array.
+* @param theirs The files of the branch being merged.
+* @param n_theirs The length of the merged branch file array.
+* @param paths Array to store the versions of each path, with enough space
+*              for every file of the three lists.
+* @return The number of paths.
 */
-char *svc_merge(void *helper, char *branch_name,
-                struct resolution *resolutions, int n_resolutions) {
+size_t merge_paths(void *helper, struct file *base, size_t n_base, struct file *ours,
+                   size_t n_ours, struct file *theirs, size_t n_theirs,
+                   struct merge_path *paths) {
+    size_t i_base = 0;
+    size_t i_ours = 0;
+    size_t i_theirs = 0;
+    size_t n_paths = 0;
+    while (i_base < n_base || i_ours < n_ours || i_theirs < n_theirs) {
+        // Find the alphabetically first path among the three lists
+        struct file *first = NULL;
+        if (i_base < n_base) {
+            first = base + i_base;
+        }
+        if (i_ours < n_ours && (first == NULL || file_cmp(helper, ours + i_ours, first) < 0)) {
+            first = ours + i_ours;
+        }
+        if (i_theirs < n_theirs && (first == NULL || file_cmp(helper, theirs + i_theirs, first) < 0)) {
+            first = theirs + i_theirs;
+        }
+
+        struct merge_path p = {NULL, NULL, NULL};
+        if (i_base < n_base && file_cmp(helper, base + i_base, first) == 0) {
+            p.base = base + i_base++;
+        }
+        if (i_ours < n_ours && file_cmp(helper, ours + i_ours, first) == 0) {
+            p.ours = ours + i_ours++;
+        }
+        if (i_theirs < n_theirs && file_cmp(helper, theirs + i_theirs, first) == 0) {
+            p.theirs = theirs + i_theirs++;
+        }
+        paths[n_paths] = p;
+        n_paths++;
+    }
+    return n_paths;
+}
+
+/**
+* Checks whether two versions of a path have the same contents, where NULL
+* means that the path does not exist.
+*/
+int same_version(struct file *a, struct file *b) {
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+    return a->hash == b->hash;
+}
+
+/**
+* Classifies a path in a three-way merge. A path changed on only one side
+* takes that side's version, and a path changed on both sides in the same way
+* takes either. A path changed differently on both sides is a conflict.
+*
+* @param p The versions of the path.
+* @return The merged version, NULL if the path is removed, or MERGE_CONFLICT.
+*/
+struct file *merge_pick(struct merge_path *p) {
+    if (same_version(p->ours, p->theirs) || same_version(p->base, p->theirs)) {
+        return p->ours;
+    }
+    if (same_version(p->base, p->ours)) {
+        return p->theirs;
+    }
+    return MERGE_CONFLICT;
+}
 
+/**
+* Lines up the versions of every path in a merge of another branch into the
+* current branch, checking that the merge can be performed.
+*
+* @param helper Data structure to pass program data between functions.
+* @param branch_name The name of the branch to be merged.
+* @param paths_ptr A pointer to where the array of paths will be stored, in
+*                  the scratch arena.
+* @param n_paths_ptr A pointer to where the number of paths will be stored.
+* @param base_ptr A pointer to where the index of the merge base is stored.
+* @return The index of the branch to be merged, otherwise a negative value
+*         whose message has been printed.
+*/
+long merge_prepare(void *helper, char *branch_name, struct merge_path **paths_ptr,
+                   size_t *n_paths_ptr, size_t *base_ptr) {
     if (branch_name == NULL) {
         printf("Invalid branch name\n");
-        return NULL;
+        return -1;
     }
     struct helper *svc = (struct helper *)helper;
 
-    // Loop through the branches to find the target branch
-    struct branch *merge_branch = NULL;
-    for (size_t i=0; i<svc->n_branches; i++) {
-        if (strcmp(svc->branches[i].branch_name, branch_name) == 0) {
-            merge_branch = svc->branches + i;
-            break;
-        }
-    }
-    if (merge_branch == NULL) {
+    // Find the target branch in the branch table
+    size_t merge_index = table_get(&svc->branch_table, branch_name);
+    if (merge_index == NULL_ID) {
         printf("Branch not found\n");
-        return NULL;
+        return -1;
     }
-    if (strcmp(svc->branches[svc->head].branch_name, branch_name) == 0) {
+    if (merge_index == svc->head) {
         printf("Cannot merge a branch with itself\n");
-        return NULL;
+        return -1;
     }
     if (uncommitted_changes(helper) == 1) {
         printf("Changes must be committed\n");
-        return NULL;
+        return -1;
+    }
+    size_t theirs = svc->branches[merge_index].ref_commit;
+    if (theirs == NULL_ID) {
+        printf("Nothing to merge\n");
+        return -1;
     }
 
-    // The below algorithm is a modified version of the algorithm used in
-    // get_changes() to find the difference between two file object arrays.
-    // The index contains the currently tracked files. All the files in the
-    // target branch are added to the index, with conflicts being resolved.
-    // Once a full file list is constructed, the task is reduced to a commit
-    // and commit can be called to complete the rest of the merge.
-    size_t index_len = svc->index_size;
-    struct file *target_files = svc->commits[merge_branch->ref_commit].files;
-    size_t target_len = svc->commits[merge_branch->ref_commit].n_files;
-
-    // Update the working directory to contain the files in the target branch
-    // in preparation for the merge so all files are accessible.
-    update_working_directory(target_files, target_len, 0);
+    // The index matches the head commit, as there are no uncommitted changes.
+    // The files of the merge base and the merged branch are copied out of
+    // their trees into the scratch arena.
+    size_t base = merge_base(helper, svc->branches[svc->head].ref_commit, theirs);
+    *base_ptr = base;
+    size_t n_base = base == NULL_ID ? 0 : svc->commits[base].n_files;
+    size_t n_theirs = svc->commits[theirs].n_files;
+    struct file *base_files = tree_map(helper, base == NULL_ID ? NULL : svc->commits[base].tree);
+    struct file *theirs_files = tree_map(helper, svc->commits[theirs].tree);
+    *paths_ptr = scratch_alloc(helper, (n_base + svc->index_size + n_theirs)
+                                       * sizeof(struct merge_path));
+    *n_paths_ptr = merge_paths(helper, base_files, n_base, svc->index, svc->index_size,
+                               theirs_files, n_theirs, *paths_ptr);
+    return merge_index;
+}
 
-    size_t i_target = 0;
-    size_t i_index = 0;
-    while (1) {
-        // Exit the loop if all files have been traversed
-        if (i_target == target_len && i_index == index_len) {
-            break;
-        }
-        // If all files in the target branch have been traversed, then there
-        // are no more files to add to the index.
-        if (i_target == target_len) {
-            break;
-        }
-        // If all the files in the index have been traversed but there are still
-        // files remaining in the target branch, then those files must be added
-        // to the index.
-        else if (i_index == index_len) {
-            // Add all remaining files to the index
-            while (i_target != target_len) {
-                char *file_name = str_dup(helper, target_files[i_target].file_name);
-                struct file new_file = {target_files[i_target].hash, file_name};
-                svc->index = array_add(helper, svc->index, &svc->index_size,
-                            &svc->index_cap, &new_file, sizeof(struct file));
-                i_target++;
+/**
+* Lists the files which conflict in a merge of another branch into the
+* current branch, which are those changed differently on both branches since
+* their merge base.
+*
+* @param helper Data structure to pass program data between functions.
+* @param branch_name The name of the branch to be merged.
+* @param n_conflicts A pointer to where the number of conflicts will be stored.
+* @return A dynamically allocated array of the paths of the conflicting files,
+*         or NULL if there are none or the merge cannot be performed.
+*/
+char **svc_merge_conflicts(void *helper, char *branch_name, int *n_conflicts) {
+    if (n_conflicts == NULL) {
+        return NULL;
+    }
+    *n_conflicts = 0;
+    size_t mark = scratch_mark(helper);
+    struct merge_path *paths;
+    size_t n_paths;
+    size_t base;
+    if (merge_prepare(helper, branch_name, &paths, &n_paths, &base) < 0) {
+        scratch_release(helper, mark);
+        return NULL;
+    }
+    char **conflicts = NULL;
+    for (size_t i=0; i<n_paths; i++) {
+        if (merge_pick(paths + i) == MERGE_CONFLICT) {
+            if (conflicts == NULL) {
+                conflicts = (char **)malloc(n_paths * sizeof(char *));
             }
-            break;
+            struct file *f = paths[i].ours != NULL ? paths[i].ours : paths[i].theirs;
+            conflicts[*n_conflicts] = path_name(helper, f->path);
+            (*n_conflicts)++;
         }
+    }
+    scratch_release(helper, mark);
+    return conflicts;
+}
 
-        // Get the files at the current indices for i_target and i_index
-        struct file *tar_file = target_files + i_target;
-        struct file *idx_file = svc->index + i_index;
+/**
+* Merges another branch into the currently active branch with a three-way
+* merge against their merge base. Files changed on only one branch are merged
+* automatically. Conflicting files keep the current branch's version unless
+* they are resolved, in which case they are replaced by the resolved file or
+* removed if the resolved file is NULL. An unresolved conflict is committed
+* with the current branch's version, so a file the current branch removed
+* stays removed. If the current branch has no changes
+* since the merge base, it is fast-forwarded without creating a commit.
+*
+* @param helper Data structure to pass program data between functions.
+* @param branch_name The name of the branch to be merged into the current one.
+* @param resolutions Array of resolutions for the conflicting files.
+* @param n_resolutions The size of the resolutions array.
+* @return The commit ID of the merged commit, or of the commit the current
+*         branch was fast-forwarded to. NULL if the branch cannot be merged
+*         or the merged files cannot be restored.
+*/
+char *svc_merge(void *helper, char *branch_name,
+                struct resolution *resolutions, int n_resolutions) {
+    struct helper *svc = (struct helper *)helper;
+    size_t mark = scratch_mark(helper);
+    struct merge_path *paths;
+    size_t n_paths;
+    size_t base;
+    long merge_index = merge_prepare(helper, branch_name, &paths, &n_paths, &base);
+    if (merge_index < 0) {
+        scratch_release(helper, mark);
+        return NULL;
+    }
+    struct branch *head = svc->branches + svc->head;
+    size_t theirs = svc->branches[merge_index].ref_commit;
 
-        // Compare the two files alphabetically
-        int cmp = file_cmp(tar_file, idx_file);
+    // The merged branch is already contained in the current branch
+    if (base == theirs) {
+        scratch_release(helper, mark);
+        printf("Already up to date\n");
+        return svc->commits[theirs].commit_id;
+    }
 
-        // If the file is in both commmits, check the resolutions array
-        // to resolve the conflict
-        if (cmp == 0) {
-            for (int i=0; i<n_resolutions; i++) {
-                if (strcmp(resolutions[i].file_name, idx_file->file_name) == 0) {
-                    if (resolutions[i].resolved_file == NULL) {
-                        svc->index[i_index].file_name = NULL;
-                        for (size_t j=i_index; j<svc->index_size-1; j++) {
-                            svc->index[j] = svc->index[j+1];
-                        }
-                        svc->index_size--;
-                        i_index--;
-                        index_len--;
-                    } else {
-                        file_copy(resolutions[i].resolved_file, resolutions[i].file_name);
-                    }
-                    break;
-                }
-            }
-            i_index++;
-            i_target++;
+    // The current branch is contained in the merged branch, so it is moved
+    // forward to the merged branch's commit
+    if (base == head->ref_commit) {
+        scratch_release(helper, mark);
+        if (index_checkout(helper, head->ref_commit, theirs) == -1) {
+            return NULL;
         }
+        head->ref_commit = theirs;
+        printf("Merge successful\n");
+        return svc->commits[theirs].commit_id;
+    }
 
-        // If the target file is ahead of the index file alphabetically, then
-        // this means the index file is not in the target's list of files.
-        // In this case, nothing needs to be added, but resolutions must still
-        // be checked.
-        else if (cmp > 0) {
-            for (int i=0; i<n_resolutions; i++) {
-                if (strcmp(resolutions[i].file_name, idx_file->file_name) == 0) {
-                    if (resolutions[i].resolved_file == NULL) {
-                        for (size_t j=i_index; j<svc->index_size-1; j++) {
-                            svc->index[j] = svc->index[j+1];
-                        }
-                        svc->index_size--;
-                        i_index--;
-                        index_len--;
-                    } else {
-                        file_copy(resolutions[i].resolved_file, resolutions[i].file_name);
-                    }
-                    break;
-                }
+    // Index the resolutions by file path in a table local to this merge. If a
+    // path has several resolutions, the first one is used.
+    struct table res_table = {NULL, 0, 0, CAP_INIT_TABLE};
+    while (res_table.cap < (size_t)n_resolutions * 2 + 2) {
+        res_table.cap *= CAP_GROWTH;
+    }
+    res_table.entries = scratch_alloc(helper, res_table.cap * sizeof(struct table_entry));
+    memset(res_table.entries, 0, res_table.cap * sizeof(struct table_entry));
+    for (int i=0; i<n_resolutions; i++) {
+        char *file_name = resolutions[i].file_name;
+        if (file_name != NULL) {
+            uint64_t hash = hash_bytes((unsigned char *)file_name, strlen(file_name));
+            struct table_entry *e = table_probe(&res_table, file_name, hash);
+            if (e->key == NULL) {
+                struct table_entry new_entry = {hash, file_name, i};
+                *e = new_entry;
+                res_table.size++;
             }
-            i_index++;
         }
+    }
 
-        // If the target file is behind the index file alphabetically, then
-        // the target file is not in the index's file list. In this case the
-        // target file must be added to the index's file list after resolutions
-        // are solved.
-        else {
-            int add = 1;
-            for (int i=0; i<n_resolutions; i++) {
-                if (strcmp(resolutions[i].file_name, tar_file->file_name) == 0) {
-                    if (resolutions[i].resolved_file == NULL) {
-                        add = 0;
-                    } else {
-                        file_copy(resolutions[i].resolved_file,
-                                  resolutions[i].file_name);
+    // Build the merged file list in a single pass over the paths. Files
+    // taken from the merged branch are restored into the working directory
+    // afterwards, and tracked files left out of the merge are deleted.
+    struct file *merged = scratch_alloc(helper, n_paths * sizeof(struct file));
+    struct file *restore = scratch_alloc(helper, n_paths * sizeof(struct file));
+    uint32_t *removed = scratch_alloc(helper, n_paths * sizeof(uint32_t));
+    size_t n_merged = 0;
+    size_t n_restore = 0;
+    size_t n_removed = 0;
+    for (size_t i=0; i<n_paths; i++) {
+        struct merge_path *p = paths + i;
+        struct file *f = merge_pick(p);
+        if (f == MERGE_CONFLICT) {
+            f = p->ours;
+            uint32_t path = p->ours != NULL ? p->ours->path : p->theirs->path;
+            char *file_name = path_name(helper, path);
+            size_t res = table_get(&res_table, file_name);
+            if (res != NULL_ID) {
+                if (resolutions[res].resolved_file == NULL) {
+                    if (p->ours != NULL) {
+                        removed[n_removed] = p->ours->path;
+                        n_removed++;
                     }
-                    break;
+                    continue;
                 }
+                file_copy(helper, resolutions[res].resolved_file, file_name);
+                struct file resolved = {.hash = 0, .path = path};
+                merged[n_merged] = resolved;
+                n_merged++;
+                continue;
+            }
+            if (f == NULL) {
+                continue;
             }
-            // The file is added if it was not resolved to NULL
-            if (add == 1) {
-                char *file_name = str_dup(helper, tar_file->file_name);
-                struct file new_file = {tar_file->hash, file_name};
-                svc->index = array_add(helper, svc->index, &svc->index_size,
-                               &svc->index_cap, &new_file, sizeof(struct file));
+        } else if (f == NULL) {
+            if (p->ours != NULL) {
+                removed[n_removed] = p->ours->path;
+                n_removed++;
             }
-            i_target++;
+            continue;
+        }
+        if (f == p->ours) {
+            merged[n_merged] = *f;
+        } else {
+            // The file is taken from the merged branch without its stat
+            // data, which belongs to the other branch
+            struct file new_file = {.hash = f->hash, .path = f->path};
+            merged[n_merged] = new_file;
+            restore[n_restore] = new_file;
+            n_restore++;
         }
+        n_merged++;
+    }
+    if (update_working_directory(helper, restore, n_restore, 1) == -1) {
+        printf("Files could not be restored\n");
+        scratch_release(helper, mark);
+        return NULL;
+    }
+    for (size_t i=0; i<n_removed; i++) {
+        unlink(path_name(helper, removed[i]));
     }
 
-    // Construct the commit message and call the commit function with the
-    // finalised file list in the index.
+    // Commit the merged file list, which then becomes the index
     char commit_msg[150];
     sprintf(commit_msg, "Merged branch %s", branch_name);
-    char *commit_id = svc_commit(helper, commit_msg);
-    svc->commits[svc->n_commits-1].parent2 = merge_branch->ref_commit;
+    char *commit_id = commit_files(helper, commit_msg, merged, &n_merged, theirs);
+    if (commit_id != NULL) {
+        index_load(helper, svc->n_commits - 1);
+        index_copy_stat(helper, merged, n_merged);
+    }
+    scratch_release(helper, mark);
 
     printf("Merge successful\n");
     return commit_id;
@@ -1,28 +1,61 @@
 #ifndef svc_h
 #define svc_h
 
+#define _GNU_SOURCE
+
+#define ALLOC_CLASSES 16  // Number of allocation size classes with free lists.
+#define URING_MAX_CHUNKS 33  // Most chunks in a file stored through io_uring.
+#define OBJECT_MANIFEST 0  // Type of the objects listing a file's chunks.
+#define OBJECT_CHUNK 1  // Type of the objects holding chunk contents.
+#define OBJECT_DELTA 0x100  // Flag on pack entries stored as a delta.
+#define DELTA_CACHE_SLOTS 256  // Decoded delta objects kept for reuse.
+
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <linux/stat.h>
+#include <linux/io_uring.h>
 
 // The resolution objects stores modifications to be made to files during
-// the merging process.
+// the merging process. svc_merge() does not refuse to commit unresolved
+// conflicts: a conflicting file without a resolution keeps the current
+// branch's version, and stays removed if the current branch removed it.
 typedef struct resolution {
     // NOTE: DO NOT MODIFY THIS STRUCT
     char *file_name;
     char *resolved_file;
 } resolution;
 
-// File objects store the hash and the file path
+// File objects store the hash and the ID of the file path in the path pool.
+// Hashes of -3 and above
+// (as unsigned values) never occur, as hash_file() uses them as error codes.
+// The stat data of the file when it was last hashed is also stored, so that
+// files which have not changed are not rehashed. A zero mtime means the stat
+// data is unknown and the file must be rehashed.
 struct file {
-    int hash;
-    char *file_name;
+    uint64_t hash;
+    uint32_t path;  // ID of the path in the path pool, NULL_ID if removed
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;  // Modification time in nanoseconds
+    int64_t ctime;  // Status change time in nanoseconds
 };
 
 // A change object stores a pointer to the removed file and the added file.
@@ -34,17 +67,285 @@ struct change {
     struct file *added_file; // New file if add or mod
 };
 
+// A manifest describes a stored file version as the ordered list of chunks
+// that make up its contents. It is followed by n_chunks chunk references and
+// is stored in the database under the hash of the file.
+struct manifest {
+    unsigned int magic;
+    unsigned int n_chunks;
+    size_t file_size;
+};
+
+// A chunk reference stores the hash identifying a chunk and its length.
+struct chunk_ref {
+    uint64_t id;
+    size_t length;
+};
+
+// The header of a pack index, followed by an entry for each object in the
+// pack sorted by id then type, since a chunk and a manifest can share a hash.
+// fanout[b] is the number of entries whose id has a first byte of at most b,
+// so the entries sharing a first byte are found without searching.
+struct pack_index {
+    unsigned int magic;
+    unsigned int n_entries;
+    uint32_t fanout[256];
+};
+
+// A pack index entry, locating an object in its pack.
+struct pack_entry {
+    uint64_t id;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t type;
+};
+
+// A pack holds many objects appended to one file. The pack and its index are
+// both mapped, and the pack stays open so objects can be copied out of it
+// inside the kernel.
+struct pack {
+    char name[17];
+    struct pack_index *index;
+    struct pack_entry *entries;
+    size_t index_size;
+    unsigned char *data;
+    size_t data_size;
+    int fd;
+};
+
+// An object being consolidated into a pack, the pack it is in, if any, and
+// the object it will be stored as a delta against.
+struct pack_item {
+    struct pack_entry entry;
+    struct pack *pack;
+    uint32_t base;  // Index of the delta base, or NULL_ID
+    uint32_t length;  // Size of a chunk's contents, or 0 if not known
+    int depth;  // Number of deltas decoded to rebuild the object
+};
+
+// The start of an object stored as a delta, followed by the instructions
+// rebuilding it from its base, another entry of the same pack.
+struct delta_header {
+    uint32_t base;
+    uint32_t base_length;
+    uint32_t length;
+};
+
+// An object rebuilt from a delta, kept so that the objects using it as a base
+// do not rebuild it again.
+struct delta_cache_slot {
+    struct pack *pack;
+    uint32_t index;
+    size_t size;
+    size_t cap;
+    unsigned char *data;
+};
+
+// Decoded delta objects, each kept in a slot chosen by its pack and index.
+struct delta_cache {
+    size_t hits;
+    size_t misses;
+    struct delta_cache_slot slots[DELTA_CACHE_SLOTS];
+};
+
+// An object in the database, stored either as a file of its own or in a
+// pack. Packed objects are always mapped, and other objects are mapped by
+// object_data() when their contents are needed.
+struct object {
+    int fd;
+    off_t offset;
+    size_t size;
+    const unsigned char *data;
+    int loose;
+};
+
+// A set of 64-bit keys which threads add to concurrently, used to mark the
+// tree nodes and objects reachable from the branches. Empty slots hold 0, so
+// the key 0 is kept as a flag of its own.
+struct mark_set {
+    _Atomic uint64_t *keys;
+    size_t cap;  // A power of two
+    atomic_int has_zero;
+    atomic_int full;  // Set if a key could not be added
+};
+
+// The tree nodes, manifests and chunks marked by a garbage collection.
+struct gc_marks {
+    struct mark_set nodes;
+    struct mark_set manifests;
+    struct mark_set chunks;
+};
+
+// One side of a line diff. Each line is identified by the ID of its interned
+// contents, so that lines are compared as integers.
+struct diff_side {
+    const unsigned char *data;
+    size_t size;
+    size_t *starts;  // Offset of each line, followed by the size
+    uint32_t *ids;  // Only set between the common first and last lines
+    size_t n_lines;
+};
+
+// A run of lines which are the same in both sides of a diff.
+struct diff_match {
+    size_t a;
+    size_t b;
+    size_t n;
+};
+
+// Lines removed from the old side and added in the new side between two
+// runs of matching lines.
+struct diff_change {
+    size_t a;
+    size_t b;
+    size_t n_removed;
+    size_t n_added;
+};
+
+// A slot of the table interning the lines of a diff, holding the high half
+// of a line's hash and one more than its ID, so that 0 is empty.
+struct diff_slot {
+    uint32_t hash;
+    uint32_t id;
+};
+
+// A line diff of two file versions. The matching runs are in order on both
+// sides, and the lines between them were removed or added.
+struct diff {
+    void *helper;
+    struct diff_side a;
+    struct diff_side b;
+    struct diff_match *matches;
+    size_t n_matches;
+    size_t n_removed;
+    size_t n_added;
+    uint32_t n_ids;
+    uint32_t *count_a;  // Occurrences of each ID in the range being split
+    uint32_t *count_b;
+    uint32_t *pos_b;  // Position in the new side of the IDs occurring once
+};
+
+// An io_uring instance, with the submission and completion rings shared with
+// the kernel. Operations are queued, then submitted together, and each
+// operation's result is stored through the pointer in its user data.
+struct uring {
+    int fd;
+    unsigned int n_entries;
+    unsigned int n_queued;  // Queued since the last submission
+    unsigned int n_inflight;  // Submitted and not completed yet
+    unsigned int sq_tail;  // Tail of the submission ring, published on submit
+    unsigned int *sq_tail_ptr;
+    unsigned int sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head_ptr;
+    unsigned int *cq_tail_ptr;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    void *rings;
+    size_t rings_size;
+    size_t sqes_size;
+};
+
+// A file being restored through io_uring. Files which cannot be restored
+// with a few whole-file operations are restored with restore_file().
+struct uring_restore {
+    char *file_path;
+    char manifest_path[24];
+    char chunk_path[40];
+    unsigned char manifest[sizeof(struct manifest) + sizeof(struct chunk_ref)];
+    struct statx stx;
+    unsigned char *data;
+    unsigned char *out;
+    size_t length;
+    int manifest_fd;
+    int chunk_fd;
+    int dest_fd;
+    int res;
+    int stat_res;
+    int sync;
+};
+
+// A file being stored through io_uring. Files larger than the largest chunk
+// are stored with store_file().
+struct uring_store {
+    char *file_path;
+    char manifest_path[24];
+    char tmp_path[40];
+    struct statx stx;
+    unsigned char *data;
+    unsigned char *packed;
+    size_t size;
+    unsigned char manifest[sizeof(struct manifest)
+                           + URING_MAX_CHUNKS * sizeof(struct chunk_ref)];
+    char chunk_paths[URING_MAX_CHUNKS][40];
+    char chunk_tmp_paths[URING_MAX_CHUNKS][40];
+    int chunk_fds[URING_MAX_CHUNKS];
+    int chunk_res[URING_MAX_CHUNKS];
+    unsigned int chunk_sizes[URING_MAX_CHUNKS];
+    unsigned int n_chunks;
+    int src_fd;
+    int tmp_fd;
+    int res;
+    int stat_res;
+    int sync;
+};
+
 // The commit object stores the associated information for a single commit.
 struct commit {
     char *commit_id;
     char *message;
     size_t parent;
     size_t parent2;
-    struct file *files;
+    struct tree_node *tree;  // Files of the commit, sharing nodes with other commits
     size_t n_files;
     char *branch_name;
 };
 
+// A node of a file tree, which holds a commit's files in sorted order. Leaves
+// hold files and inner nodes hold children, stored directly after the node.
+// Nodes are shared between commits and never modified once created.
+struct tree_node {
+    uint64_t hash;  // Hash of the entries, used to find identical nodes
+    uint32_t level;  // 0 for leaves
+    uint32_t n_entries;
+    size_t n_files;  // Number of files below the node
+};
+
+// A child of an inner tree node, with the name of the first file below it.
+struct tree_child {
+    struct tree_node *node;
+    uint32_t first_path;
+};
+
+// Each node of the commit graph holds a commit's parents, generation number
+// and the location of its Bloom filter of changed paths.
+struct graph_node {
+    uint32_t parent;
+    uint32_t parent2;
+    uint32_t generation;  // One more than the largest generation of the parents
+    uint32_t n_bloom_words;  // 0 if the commit has no filter
+    size_t bloom_offset;  // Offset of the filter in the Bloom filter words
+};
+
+// The versions of a path in the merge base and on both sides of a merge, with
+// NULL for a version in which the path does not exist.
+struct merge_path {
+    struct file *base;
+    struct file *ours;
+    struct file *theirs;
+};
+
+// Each path in the path pool stores the path and its sort key, which is the
+// path folded to lower case, with the first 8 bytes of the sort key packed
+// into an integer in big-endian order.
+struct path_entry {
+    uint64_t prefix;
+    uint64_t name_hash;
+    char *key;
+    char *name;
+};
+
 // Each branch object contains its name and a reference to a commit object.
 struct branch {
     char *branch_name;
@@ -53,36 +354,192 @@ struct branch {
 
 // Memory objects represent a memory region allocated by the mmap() function.
 // They store a pointer to the allocated memory region and the size of
-// that memory region in pages.
+// that memory region in pages. Regions are consecutive pages of the
+// repository file, mapped directly after one another.
 struct memory {
     void *ptr;
     size_t n_pages;
 };
 
+// A free block of the repository heap, linked into the free list of its size
+// class. The size is only set for blocks larger than every size class.
+struct free_block {
+    struct free_block *next;
+    size_t size;
+};
+
+// Allocation counters. Bytes in use are the sizes requested by live
+// allocations, and bytes are wasted when live allocations are rounded up to
+// their size class or when free blocks are waiting to be reused.
+struct alloc_stats {
+    size_t used;
+    size_t padding;
+    size_t free;
+};
+
+// A table entry maps a key string to a value, storing the hash of the key.
+struct table_entry {
+    uint64_t hash;
+    char *key;  // NULL if the entry is empty
+    size_t value;
+};
+
+// A table is a hash table from strings to array indices using open addressing.
+// The capacity is always zero or a power of two.
+struct table {
+    struct table_entry *entries;
+    size_t size;
+    size_t n_tombstones;
+    size_t cap;
+};
+
+// A node in the trie of commit IDs, with one child per hexadecimal digit and
+// the number of distinct commit IDs below the node. A child of 0 is empty,
+// and the children of nodes at the last digit are 1 when the ID exists.
+struct id_node {
+    uint32_t child[16];
+    uint32_t count;
+};
+
+// A directory entry as returned by the getdents64 system call.
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// A path list stores paths one after another in a single buffer, separated by
+// null characters.
+struct path_list {
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t count;
+};
+
+// A directory listing holds the regular files and subdirectories found in a
+// directory during a walk of the directory tree.
+struct dir_listing {
+    char *dir_path;
+    struct path_list files;
+    struct path_list dirs;
+    size_t n_listings;  // Set in the first listing of each level of the walk
+    dev_t db_dev;  // Device and inode of the database directory, which is skipped
+    ino_t db_ino;
+    int failed;  // Set if the listing ran out of memory
+};
+
+// Each worker of a thread pool owns a range of task indices, packed as the
+// first index in the low 32 bits and one past the last in the high 32 bits.
+// Workers are padded to a cache line so that claiming tasks does not contend.
+struct worker {
+    _Atomic uint64_t range;
+    struct thread_pool *pool;
+    size_t id;
+    pthread_t thread;
+    char padding[32];
+};
+
+// A thread pool runs tasks on a fixed set of threads. The calling thread acts
+// as worker 0, so a pool of n workers starts n - 1 threads.
+struct thread_pool {
+    size_t n_workers;
+    pthread_mutex_t lock;
+    pthread_cond_t start;  // Signalled when a new generation of tasks starts
+    pthread_cond_t finish;  // Signalled when the last thread finishes
+    unsigned long generation;
+    size_t n_running;  // Number of threads still working on the generation
+    int stop;
+    void (*task)(void *, size_t);
+    void *arg;
+    struct worker workers[];
+};
+
 // The helper object is initialised at the beginning of the program, and holds
-// all the information that is passed between functions.
+// all the information that is passed between functions. The helper occupies
+// the first page of the repository file, so every field up to and including
+// the memory fields persists between runs. The remaining fields are
+// reinitialised each time the repository is opened.
 struct helper {
+    unsigned int magic;  // REPO_MAGIC if the repository file is valid
+    unsigned int version;  // Layout version of the repository file
+    void *base;  // Address the repository file must be mapped at
+    size_t heap_pages;  // Size of the repository file in pages
+    size_t heap_used;  // Number of bytes in use from the start of the file
+
     size_t head;  // Index of the head in the branch array
 
     struct branch *branches;  // Array of all branches
     size_t n_branches;
     size_t branches_cap;
 
+    struct table branch_table;  // Branch name to index in the branches array
+    char **branch_names;  // Branch names in sorted order
+    size_t n_branch_names;
+    size_t branch_names_cap;
+
     struct commit *commits;  // Array of all commits
     size_t n_commits;
     size_t commits_cap;
 
+    struct path_entry *paths;  // Every path in the repository, by ID
+    size_t n_paths;
+    size_t paths_cap;
+    struct table path_table;  // Path to ID in the path pool
+
     struct file *index;  // Array of all tracked files
     size_t index_size;
     size_t index_cap;
+    struct table index_table;  // File path to position in the index
+    size_t index_sorted;  // Length of the sorted run at the start of the index
+    size_t index_removed;  // Removed files waiting for the index to be flushed
+
+    struct table commit_table;  // Commit ID to index in the commits array
+    struct id_node *id_nodes;  // Trie of commit IDs for abbreviated lookup
+    size_t n_id_nodes;
+    size_t id_nodes_cap;
+
+    struct tree_node **tree_table;  // Every tree node, by the hash of its entries
+    size_t n_tree_nodes;
+    size_t tree_table_cap;
+
+    struct graph_node *graph;  // Commit graph, one node per commit
+    size_t n_graph_nodes;
+    size_t graph_cap;
+    uint64_t *bloom;  // Bloom filter words of every commit in the graph
+    size_t n_bloom_words;
+    size_t bloom_cap;
+
+    struct free_block *free_lists[ALLOC_CLASSES];  // Free blocks by size class
+    struct free_block *large_free;  // Free blocks larger than every size class
+    struct alloc_stats alloc_stats;
 
     struct memory *mem_list;  // Array of all memory objects
     size_t n_mem;
-    size_t offset;  // The offset from the current active memory region
+    size_t mem_cap;
     size_t page_size;
 
+    char *scratch;  // Arena for temporary data, reset after each operation
+    size_t scratch_used;
+
     char *stdout_buffer;  // Pointer to store the location of the manually
                           // allocated buffer for stdout.
+    int heap_fd;  // File descriptor of the open repository file
+    size_t n_threads;  // Number of hashing workers, 0 for one per processor
+    struct thread_pool *pool;  // Started on first use
+    int link_objects;  // Check out single-chunk files as hard links to the chunk
+    int use_uring;  // 1 to batch file I/O with io_uring when it is available
+    int uring_unavailable;  // Set if io_uring could not be set up
+    int clone_unsupported;  // Set if reflinks are not supported
+    int copy_range_unsupported;  // Set if copy_file_range() is not supported
+    struct uring *ring;  // Set up on first use
+    struct pack *packs;  // Mapped on first use
+    size_t n_packs;
+    size_t packs_cap;
+    int packs_loaded;  // Set once the pack directory has been read
+    struct delta_cache *delta_cache;  // Set up on first use
 };
 
 
@@ -90,50 +547,335 @@ struct helper *memory_init(void);
 
 void *memory_add(void *helper, size_t n_pages);
 
+size_t alloc_block_size(void *helper, size_t n);
+
+size_t alloc_class(size_t size);
+
+void free_block_push(void *helper, void *ptr, size_t size);
+
+void *free_block_pop(void *helper, size_t size);
+
+void *alloc_top(void *helper, size_t size);
+
 void *allocate(void *helper, size_t n);
 
+void deallocate(void *helper, void *ptr, size_t n);
+
 void *reallocate(void *helper, void *ptr, size_t old_n, size_t n);
 
+void *scratch_alloc(void *helper, size_t n);
+
+size_t scratch_mark(void *helper);
+
+void scratch_release(void *helper, size_t mark);
+
 void *svc_init(void);
 
 void cleanup(void *helper);
 
 char *str_dup(void *helper, char *string);
 
-struct file *files_dup(void *helper, struct file *files, size_t n_files);
 
 void *array_add(void *helper, void *array, size_t *array_size, size_t *array_cap, void *element, size_t n);
 
 int file_exists(char *file_path);
 
-void file_copy(char *file_path, char *new_file_path);
+void file_unshare(char *file_path);
+
+void file_copy(void *helper, char *file_path, char *new_file_path);
+
+int file_clone(void *helper, int src_fd, int dest_fd);
+
+int copy_bytes(void *helper, int src_fd, off_t src_offset, int dest_fd, off_t dest_offset,
+               size_t n);
+
+size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dest, size_t limit);
+
+int lz_decompress(const unsigned char *src, size_t n, unsigned char *dest, size_t length);
+
+size_t chunk_compress(const unsigned char *src, size_t n, unsigned char *dest);
+
+void pack_load(void *helper);
+
+int pack_name_valid(char *name, char *suffix);
+
+int pack_open(struct pack *pack);
+
+void pack_unload(void *helper);
+
+struct pack_entry *pack_find(void *helper, uint64_t id, unsigned int type,
+                             struct pack **pack_out);
+
+size_t delta_encode(void *helper, const unsigned char *base, size_t base_n,
+                    const unsigned char *target, size_t n, unsigned char *dest, size_t limit);
+
+int delta_apply(const unsigned char *base, size_t base_n, const unsigned char *delta,
+                size_t delta_n, unsigned char *dest, size_t n);
+
+void delta_cache_clear(void *helper);
+
+struct delta_cache_slot *delta_cache_slot(void *helper, struct pack *pack, uint32_t index);
+
+const unsigned char *pack_decode(void *helper, struct pack *pack, uint32_t index,
+                                 size_t length, size_t *size, unsigned int depth);
+
+void object_path(char *path, uint64_t id, unsigned int type);
+
+int object_open(void *helper, uint64_t id, unsigned int type, struct object *object);
 
-void update_database(struct file *files, size_t n_files);
+const unsigned char *object_data(struct object *object);
 
-void update_working_directory(struct file *files, size_t n_files, int overwrite);
+void object_close(struct object *object);
 
-int hash_file(void *helper, char *file_path);
+int object_exists(void *helper, uint64_t id, unsigned int type);
+
+int store_chunk(void *helper, uint64_t id, int src_fd, const unsigned char *data,
+                size_t offset, size_t n, int whole);
+
+int store_file(void *helper, char *file_path, uint64_t hash);
+
+int restore_file(void *helper, uint64_t hash, char *file_path, int link);
+
+int update_database(void *helper, struct file *files, size_t n_files);
+
+int update_working_directory(void *helper, struct file *files, size_t n_files,
+                             int overwrite);
+
+struct uring *uring_create(unsigned int n_entries);
+
+void uring_destroy(void *helper);
+
+struct uring *uring_get(void *helper);
+
+struct io_uring_sqe *uring_prep(struct uring *ring, int op, int fd, void *addr,
+                                unsigned int len, uint64_t off, int *result);
+
+int uring_wait(struct uring *ring);
+
+int uring_restore_files(void *helper, struct file *files, size_t n_files);
+
+int uring_store_files(void *helper, struct file *files, size_t n_files);
+
+void hash_init(void);
+
+int hash_set_kernel(char *kernel);
+
+uint64_t hash_bytes(const unsigned char *data, size_t n);
+
+uint64_t hash_contents(void *helper, const unsigned char *data, size_t n);
+
+uint64_t hash_file(void *helper, char *file_path);
+
+void parallel_for(void *helper, size_t n_tasks, void (*task)(void *, size_t), void *arg);
+
+void pool_destroy(void *helper);
+
+uint64_t stat_hash(void *helper, struct file *f);
+
+void hash_files(void *helper, struct file *files, size_t n_files, uint64_t *hashes);
+
+uint32_t path_intern(void *helper, char *name);
+
+uint32_t path_find(void *helper, char *name);
+
+char *path_name(void *helper, uint32_t id);
+
+int path_cmp(void *helper, uint32_t a, uint32_t b);
+
+int file_cmp(void *helper, struct file *a, struct file *b);
+
+int file_cmp_r(const void *p1, const void *p2, void *helper);
+
+size_t table_get(struct table *t, char *key);
+
+void table_put(void *helper, struct table *t, char *key, size_t value);
+
+size_t table_remove(struct table *t, char *key);
+
+void table_clear(struct table *t);
+
+void index_table_rebuild(void *helper);
+
+void index_flush(void *helper);
+
+int is_tracked(void *helper, char *file_name);
+
+struct file *node_files(struct tree_node *node);
+
+struct tree_child *node_children(struct tree_node *node);
+
+int tree_boundary(uint64_t name_hash, uint32_t level);
+
+struct tree_node *tree_intern(void *helper, uint32_t level, void *entries,
+                              size_t n_entries);
+
+struct tree_node *tree_build(void *helper, struct file *files, size_t n_files);
+
+size_t tree_flatten(struct tree_node *node, struct file *files);
+
+struct file *tree_map(void *helper, struct tree_node *node);
+
+void get_changes(void *helper, struct change **changes_ptr, size_t *n_changes_ptr,
+                 struct file *old_files, size_t old_len,
+                 struct file *new_files, size_t new_len);
+
+struct file *tree_find(void *helper, struct tree_node *node, uint32_t path);
+
+void index_load(void *helper, size_t commit_index);
+
+void index_copy_stat(void *helper, struct file *files, size_t n_files);
+
+int index_checkout(void *helper, size_t old_commit, size_t commit_index);
+
+char *commit_files(void *helper, char *message, struct file *files,
+                   size_t *n_files_ptr, size_t parent2);
 
 char *svc_commit(void *helper, char *message);
 
+void commit_index_add(void *helper, size_t commit_index);
+
+size_t find_commit(void *helper, char *commit_id);
+
 void *get_commit(void *helper, char *commit_id);
 
 char **get_prev_commits(void *helper, void *commit, int *n_prev);
 
+int version_open(void *helper, uint64_t hash, struct object *view);
+
+void diff_split(void *helper, struct diff_side *side, const unsigned char *data, size_t size);
+
+int diff_line_equal(struct diff_side *a, size_t i, struct diff_side *b, size_t j);
+
+void diff_intern(struct diff *d, size_t a_lo, size_t a_hi, size_t b_lo, size_t b_hi);
+
+void diff_emit(struct diff *d, size_t a, size_t b, size_t n);
+
+int diff_myers(struct diff *d, size_t *a_lo, size_t a_hi, size_t *b_lo, size_t b_hi);
+
+size_t diff_anchors(struct diff *d, size_t a_lo, size_t a_hi, size_t b_lo, size_t b_hi,
+                    struct diff_match **anchors_ptr);
+
+void diff_range(struct diff *d, size_t a_lo, size_t a_hi, size_t b_lo, size_t b_hi,
+                int depth);
+
+void diff_block(struct diff *d, size_t a_lo, size_t a_hi, size_t b_lo, size_t b_hi);
+
+size_t diff_line_at(struct diff_side *side, size_t offset);
+
+int diff_byte_run(struct diff *d, size_t a_offset, size_t b_offset, size_t n,
+                  struct diff_match *match);
+
+void diff_split_chunks(void *helper, struct diff_side *side, struct diff_side *lines,
+                       size_t lo, size_t hi);
+
+void diff_chunks(struct diff *d, size_t a_lo, size_t a_hi, size_t b_lo, size_t b_hi);
+
+void diff_lines(void *helper, struct diff *d, const unsigned char *old, size_t old_size,
+                const unsigned char *new, size_t new_size);
+
+void print_diff_line(struct diff_side *side, size_t i, char prefix);
+
+void print_diff(struct diff *d);
+
+void print_file_diff(void *helper, struct file *old_file, struct file *new_file);
+
 void print_commit(void *helper, char *commit_id);
 
+int svc_diff(void *helper, char *commit_id1, char *commit_id2);
+
 int svc_branch(void *helper, char *branch_name);
 
 int svc_checkout(void *helper, char *branch_name);
 
+size_t branch_lower_bound(void *helper, char *name);
+
+char **list_branches_prefix(void *helper, char *prefix, int *n_branches);
+
 char **list_branches(void *helper, int *n_branches);
 
-int svc_add(void *helper, char *file_name);
+uint64_t svc_add(void *helper, char *file_name);
 
-int svc_rm(void *helper, char *file_name);
+int svc_add_paths(void *helper, char **file_names, int n_files);
+
+int svc_add_tree(void *helper, char *root);
+
+uint64_t svc_rm(void *helper, char *file_name);
 
 int svc_reset(void *helper, char *commit_id);
 
+size_t repack_list_loose(char *dir_path, unsigned int type, struct pack_item *items);
+
+int pack_item_cmp(const void *a, const void *b);
+
+uint32_t pack_item_find(struct pack_item *items, size_t n_items, uint64_t id,
+                        unsigned int type);
+
+void repack_pair(void *helper, struct pack_item *items, size_t n_items,
+                 uint64_t old_hash, uint64_t new_hash);
+
+void repack_depths(void *helper, struct pack_item *items, size_t n_items);
+
+unsigned char *repack_load(void *helper, struct pack_item *item, size_t *size);
+
+int repack_write(void *helper, struct pack_item *items, size_t i, struct pack_entry *entry,
+                 int pack_fd);
+
+int svc_repack(void *helper);
+
+int repack_objects(void *helper, struct gc_marks *marks);
+
+void mark_set_init(void *helper, struct mark_set *set, size_t n_keys);
+
+int mark_set_add(struct mark_set *set, uint64_t key);
+
+int mark_set_has(struct mark_set *set, uint64_t key);
+
+int gc_marked(struct gc_marks *marks, uint64_t id, unsigned int type);
+
+void gc_mark_tree(struct gc_marks *marks, struct tree_node *node);
+
+void gc_mark_manifest(struct gc_marks *marks, const unsigned char *data, size_t size);
+
+int gc_mark_object(void *helper, struct gc_marks *marks, uint64_t id);
+
+void gc_mark_commit_task(void *arg, size_t i);
+
+void gc_mark_chunks_task(void *arg, size_t i);
+
+size_t gc_sweep_loose(char *dir_path, unsigned int type, struct gc_marks *marks,
+                      int dry_run);
+
+ssize_t svc_gc(void *helper, int dry_run);
+
+void commit_graph_add(void *helper, size_t commit_index, struct change *changes,
+                      size_t n_changes);
+
+int bloom_maybe_changed(void *helper, size_t commit_index, uint32_t path);
+
+struct file *find_file(void *helper, struct file *files, size_t n_files, uint32_t path);
+
+int commit_touches(void *helper, size_t commit_index, uint32_t path);
+
+int commit_set_add(uint32_t *set, size_t cap, uint32_t c);
+
+int is_ancestor(void *helper, size_t ancestor, size_t commit_index);
+
+int svc_is_ancestor(void *helper, char *ancestor_id, char *commit_id);
+
+int svc_touches_path(void *helper, char *commit_id, char *file_name);
+
+size_t merge_base(void *helper, size_t a, size_t b);
+
+void *get_merge_base(void *helper, void *commit1, void *commit2);
+
+size_t merge_paths(void *helper, struct file *base, size_t n_base, struct file *ours,
+                   size_t n_ours, struct file *theirs, size_t n_theirs,
+                   struct merge_path *paths);
+
+struct file *merge_pick(struct merge_path *p);
+
+char **svc_merge_conflicts(void *helper, char *branch_name, int *n_conflicts);
+
 char *svc_merge(void *helper, char *branch_name, resolution *resolutions, int n_resolutions);
 
 #endif
@@ -1,8 +1,9 @@
 #include <assert.h>
+#include <time.h>
 #include "svc.h"
 
 /* Compile:
-clang -o test svc.c tester.c -O0 -std=gnu11 -lm -Wextra -Wall -g -fsanitize=address
+clang -o test svc.c tester.c -O0 -std=gnu11 -lm -lpthread -Wextra -Wall -g -fsanitize=address
 Note: Removed Werror flag.
 */
 
@@ -46,12 +47,15 @@ void small() {
 
 int test_example1() {
     void *helper = svc_init();
-    assert(hash_file(helper, "hello.py") == 2027);
-    assert(hash_file(helper, "fake.c") == -2);
+    uint64_t hello_hash = hash_file(helper, "hello.py");
+    assert(hello_hash == hash_file(helper, "hello.py"));
+    assert(hash_file(helper, "fake.c") == (uint64_t)-2);
+    assert(hash_file(helper, "Tests") == (uint64_t)-2);
+    assert(svc_add(helper, "Tests") == (uint64_t)-3);
     assert(svc_commit(helper, "No changes") == NULL);
-    assert(svc_add(helper, "hello.py") == 2027);
-    assert(svc_add(helper, "Tests/test1.in") == 564);
-    assert(svc_add(helper, "Tests/test1.in") == -2);
+    assert(svc_add(helper, "hello.py") == hello_hash);
+    assert(svc_add(helper, "Tests/test1.in") == hash_file(helper, "Tests/test1.in"));
+    assert(svc_add(helper, "Tests/test1.in") == (uint64_t)-2);
     char *str = svc_commit(helper, "Initial commit");
     // printf("%s\n", str);
     cleanup(helper);
@@ -89,19 +93,20 @@ int test_example2() {
 int test_example21() {
     void *helper = svc_init();
 
-    file_copy("COMP2017/c.c", "COMP2017/svc.c");
-    file_copy("COMP2017/h.h", "COMP2017/svc.h");
+    file_copy(helper, "COMP2017/c.c", "COMP2017/svc.c");
+    file_copy(helper, "COMP2017/h.h", "COMP2017/svc.h");
 
-    assert(svc_add(helper, "COMP2017/svc.h") == 5007);
-    assert(svc_add(helper, "COMP2017/svc.c") == 5217);
+    uint64_t h_hash = hash_file(helper, "COMP2017/svc.h");
+    assert(svc_add(helper, "COMP2017/svc.h") == h_hash);
+    assert(svc_add(helper, "COMP2017/svc.c") == hash_file(helper, "COMP2017/svc.c"));
     assert(strcmp(svc_commit(helper, "Initial commit"), "7b3e30") == 0);
     assert(svc_branch(helper, "random_branch") == 0);
     assert(svc_checkout(helper, "random_branch") == 0);
 
-    file_copy("COMP2017/c0.c", "COMP2017/svc.c");
-    assert(hash_file(helper, "COMP2017/svc.c") == 4798);
+    file_copy(helper, "COMP2017/c0.c", "COMP2017/svc.c");
+    assert(hash_file(helper, "COMP2017/svc.c") != hash_file(helper, "COMP2017/c.c"));
     // printf("%d\n", svc_rm(helper, "COMP2017/svc.h") == 5007);
-    assert(svc_rm(helper, "COMP2017/svc.h") == 5007);
+    assert(svc_rm(helper, "COMP2017/svc.h") == h_hash);
 
     char *id = svc_commit(helper, "Implemented svc_init");
     // print_commit(helper, id);
@@ -112,7 +117,7 @@ int test_example21() {
     // }
     assert(strcmp(id, "73eacd") == 0);
     assert(svc_reset(helper, "7b3e30") == 0);
-    file_copy("COMP2017/c0.c", "COMP2017/svc.c");
+    file_copy(helper, "COMP2017/c0.c", "COMP2017/svc.c");
     id = svc_commit(helper, "Implemented svc_init");
     // if (id == NULL) {
     //     printf("%s", id);
@@ -136,14 +141,16 @@ int test_example21() {
     resolutions[0].file_name = "COMP2017/svc.c";
     resolutions[0].resolved_file = "resolutions/svc.c";
 
-    svc_merge(helper, "random_branch", resolutions, 1);
+    // master has not changed since random_branch was created from it, so
+    // the merge fast-forwards master to random_branch without a new commit
+    assert(strcmp(svc_merge(helper, "random_branch", resolutions, 1), "24829b") == 0);
 
     free(resolutions);
 
-    commit = get_commit(helper, "48eac3");
+    commit = get_commit(helper, "24829b");
     prev_commits = get_prev_commits(helper, commit, &n_prev);
     // printf("n_prev: %d\n", n_prev);
-    assert(n_prev == 2);
+    assert(n_prev == 1);
     free(prev_commits);
 
 
@@ -178,6 +185,1331 @@ int test_1() {
     return 0;
 }
 
+int test_persistence() {
+    // The content differs on every run so the commit is made even when an
+    // earlier run already tracks the file
+    FILE *f = fopen("test_persist.txt", "w");
+    fprintf(f, "persistent %ld %d", (long)time(NULL), (int)getpid());
+    fclose(f);
+
+    void *helper = svc_init();
+    svc_add(helper, "test_persist.txt");
+    char *id = svc_commit(helper, "Persistent commit");
+    assert(id != NULL);
+    char id_copy[7];
+    strcpy(id_copy, id);
+    size_t n_commits = ((struct helper *)helper)->n_commits;
+    cleanup(helper);
+
+    // Reopening the repository maps the same commits, branches and index
+    helper = svc_init();
+    assert(((struct helper *)helper)->n_commits == n_commits);
+    assert(get_commit(helper, id_copy) != NULL);
+    assert(svc_add(helper, "test_persist.txt") == (uint64_t)-2);
+    cleanup(helper);
+    return 0;
+}
+
+void free_list_append(struct free_block **list, struct free_block *rest) {
+    while (*list != NULL) {
+        list = &(*list)->next;
+    }
+    *list = rest;
+}
+
+int test_allocator() {
+    void *helper = svc_init();
+    struct helper *svc = (struct helper *)helper;
+    struct alloc_stats stats = svc->alloc_stats;
+
+    // Blocks freed by earlier runs are set aside so the test starts from
+    // empty free lists, and are given back at the end
+    struct free_block *free_lists[ALLOC_CLASSES];
+    memcpy(free_lists, svc->free_lists, sizeof(free_lists));
+    memset(svc->free_lists, 0, sizeof(svc->free_lists));
+    struct free_block *large_free = svc->large_free;
+    svc->large_free = NULL;
+
+    // Allocations are aligned and counted with their padding
+    char *a = allocate(helper, 5);
+    char *b = allocate(helper, 200);
+    assert((size_t)a % 16 == 0 && (size_t)b % 16 == 0);
+    assert(svc->alloc_stats.used - stats.used == 205);
+    assert(svc->alloc_stats.padding - stats.padding == 11 + 56);
+
+    // A freed block is reused by the next allocation of its size class
+    deallocate(helper, a, 5);
+    assert(allocate(helper, 12) == a);
+    deallocate(helper, a, 12);
+
+    // The block at the top of the heap grows in place
+    char *top = allocate(helper, 100);
+    strcpy(top, "top");
+    assert(reallocate(helper, top, 100, 100000) == top);
+    assert(reallocate(helper, top, 100000, 50000) == top && strcmp(top, "top") == 0);
+
+    // Other blocks are moved, leaving the old block to be reused
+    char *moved = reallocate(helper, b, 200, 300);
+    assert(moved != b);
+    assert(allocate(helper, 250) == b);
+    size_t heap_used = svc->heap_used;
+
+    // A large free block is split for a smaller large allocation, and the
+    // rest of it is reused
+    char *large = allocate(helper, 1 << 20);
+    char *small = allocate(helper, 1 << 16);
+    deallocate(helper, large, 1 << 20);
+    assert(allocate(helper, 100000) == large);
+    char *rest = allocate(helper, 1 << 19);
+    assert(rest != NULL);
+    assert(svc->heap_used - heap_used < (2 << 20));
+
+    // Many allocations larger than a page fit in the memory list
+    char *pages[2000];
+    for (int i=0; i<2000; i++) {
+        pages[i] = allocate(helper, svc->page_size + 1);
+        memset(pages[i], 1, svc->page_size + 1);
+    }
+    assert(svc->heap_used <= svc->heap_pages * svc->page_size);
+
+    // Everything is freed so the repository does not grow on every run
+    for (int i=0; i<2000; i++) {
+        deallocate(helper, pages[i], svc->page_size + 1);
+    }
+    deallocate(helper, rest, 1 << 19);
+    deallocate(helper, large, 100000);
+    deallocate(helper, small, 1 << 16);
+    deallocate(helper, b, 250);
+    deallocate(helper, moved, 300);
+    deallocate(helper, top, 50000);
+    for (int i=0; i<ALLOC_CLASSES; i++) {
+        free_list_append(&svc->free_lists[i], free_lists[i]);
+    }
+    free_list_append(&svc->large_free, large_free);
+    cleanup(helper);
+    return 0;
+}
+
+int test_chunked_store() {
+    // Write a file large enough to be split into many chunks
+    FILE *f = fopen("test_chunks.txt", "w");
+    for (int i=0; i<100000; i++) {
+        fprintf(f, "line %d\n", i);
+    }
+    fclose(f);
+
+    void *helper = svc_init();
+    svc_add(helper, "test_chunks.txt");
+    char id[7];
+    strcpy(id, svc_commit(helper, "Chunked commit"));
+
+    // Restoring the commit rebuilds the file from its chunks
+    remove("test_chunks.txt");
+    assert(svc_reset(helper, id) == 0);
+    f = fopen("test_chunks.txt", "r");
+    int line;
+    for (int i=0; i<100000; i++) {
+        assert(fscanf(f, "line %d\n", &line) == 1 && line == i);
+    }
+    fclose(f);
+
+    // A file with a missing chunk is not restored, and the head is kept
+    struct object manifest;
+    uint64_t hash = hash_file(helper, "test_chunks.txt");
+    assert(object_open(helper, hash, OBJECT_MANIFEST, &manifest) == 0);
+    const struct manifest *m = (const struct manifest *)object_data(&manifest);
+    char chunk_path[40];
+    object_path(chunk_path, ((const struct chunk_ref *)(m + 1))[1].id, OBJECT_CHUNK);
+    object_close(&manifest);
+    if (rename(chunk_path, "test_chunk.bak") == 0) {
+        remove("test_chunks.txt");
+        assert(svc_reset(helper, id) == -3);
+        rename("test_chunk.bak", chunk_path);
+        assert(svc_reset(helper, id) == 0);
+        assert(hash_file(helper, "test_chunks.txt") == hash);
+    }
+
+    cleanup(helper);
+    return 0;
+}
+
+int test_copy_engine() {
+    void *helper = svc_init();
+    struct helper *svc = (struct helper *)helper;
+
+    // Whole files and ranges are copied exactly
+    file_copy(helper, "test_chunks.txt", "test_copy.txt");
+    assert(hash_file(helper, "test_copy.txt") == hash_file(helper, "test_chunks.txt"));
+    int src_fd = open("test_chunks.txt", O_RDONLY);
+    int dest_fd = open("test_copy.txt", O_RDWR);
+    assert(copy_bytes(helper, src_fd, 100, dest_fd, 1, 10) == 0);
+    char src[10];
+    char dest[10];
+    pread(src_fd, src, 10, 100);
+    pread(dest_fd, dest, 10, 1);
+    assert(memcmp(src, dest, 10) == 0);
+    close(src_fd);
+    close(dest_fd);
+
+    // Single chunk files may be checked out as links to their chunk, which
+    // are replaced rather than written through when restored again
+    FILE *f = fopen("test_link.txt", "w");
+    fputs("linked", f);
+    fclose(f);
+    svc_add(helper, "test_link.txt");
+    char id[7];
+    strcpy(id, svc_commit(helper, "Link commit"));
+    f = fopen("test_link.txt", "w");
+    fputs("edited", f);
+    fclose(f);
+    svc_commit(helper, "Edited");
+    svc->link_objects = 1;
+    assert(svc_reset(helper, id) == 0);
+    struct stat sb;
+    assert(stat("test_link.txt", &sb) == 0 && sb.st_nlink > 1);
+    svc->link_objects = 0;
+    file_copy(helper, "test_copy.txt", "test_link.txt");
+    assert(svc_reset(helper, id) == 0);
+    assert(stat("test_link.txt", &sb) == 0 && sb.st_nlink == 1);
+    f = fopen("test_link.txt", "r");
+    char contents[16] = {0};
+    fgets(contents, sizeof(contents), f);
+    fclose(f);
+    assert(strcmp(contents, "linked") == 0);
+    cleanup(helper);
+    return 0;
+}
+
+int test_uring_io() {
+    void *helper = svc_init();
+    struct helper *svc = (struct helper *)helper;
+    char path[64];
+    uint64_t hashes[2][6];
+    char ids[2][7];
+    mkdir("test_uring", S_IRWXU);
+
+    // Small, empty and multi-chunk files are stored and restored the same
+    // way through io_uring and through the synchronous path
+    for (int pass=0; pass<2; pass++) {
+        svc->use_uring = pass == 0;
+        for (int i=0; i<6; i++) {
+            sprintf(path, "test_uring/%d.txt", i);
+            FILE *f = fopen(path, "w");
+            size_t n = i == 0 ? 0 : i == 5 ? 300000 : 100 * i;
+            for (size_t k=0; k<n; k++) {
+                fputc((int)((k * 2654435761u + pass * 7 + i) >> 13) & 0xff, f);
+            }
+            fclose(f);
+            svc_add(helper, path);
+            hashes[pass][i] = hash_file(helper, path);
+        }
+        strcpy(ids[pass], svc_commit(helper, pass == 0 ? "Uring files" : "Sync files"));
+    }
+    assert(svc->ring != NULL || svc->uring_unavailable);
+
+    for (int pass=0; pass<2; pass++) {
+        svc->use_uring = pass == 0;
+        for (int from=0; from<2; from++) {
+            for (int i=0; i<6; i++) {
+                sprintf(path, "test_uring/%d.txt", i);
+                unlink(path);
+            }
+            assert(svc_reset(helper, ids[from]) == 0);
+            for (int i=0; i<6; i++) {
+                sprintf(path, "test_uring/%d.txt", i);
+                assert(hash_file(helper, path) == hashes[from][i]);
+            }
+        }
+    }
+    svc->use_uring = 1;
+    cleanup(helper);
+    return 0;
+}
+
+int test_compression() {
+    // Repetitive, text and random data round trip through the codec, and
+    // data that does not compress is rejected
+    static unsigned char src[65536];
+    static unsigned char packed[sizeof(src)];
+    static unsigned char out[sizeof(src)];
+    uint64_t state = 1;
+    for (int kind=0; kind<3; kind++) {
+        size_t n = 0;
+        while (n < sizeof(src)) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            if (kind == 0) {
+                src[n] = n % 7 == 0 ? 'x' : 'a';
+                n++;
+            } else if (kind == 1) {
+                n += snprintf((char *)src + n, sizeof(src) - n, "line %lu\n", state >> 54);
+            } else {
+                src[n++] = state >> 56;
+            }
+        }
+        n = n < sizeof(src) ? n : sizeof(src);
+        size_t packed_size = chunk_compress(src, n, packed);
+        if (kind == 2) {
+            assert(packed_size == 0);
+            continue;
+        }
+        assert(packed_size > 0 && packed_size < n / 2);
+        assert(lz_decompress(packed, packed_size, out, n) == 0);
+        assert(memcmp(src, out, n) == 0);
+
+        // Damaged chunks are detected
+        assert(lz_decompress(packed, packed_size / 2, out, n) == -1);
+        assert(lz_decompress(packed, packed_size, out, n - 1) == -1);
+    }
+    assert(chunk_compress(src, 0, packed) == 0);
+
+    // Compressible files take less space in the database, and are restored
+    // through both the synchronous path and io_uring
+    void *helper = svc_init();
+    struct helper *svc = (struct helper *)helper;
+    FILE *f = fopen("test_compress.txt", "w");
+    for (int i=0; i<20000; i++) {
+        fprintf(f, "entry %d: status ok\n", i);
+    }
+    fclose(f);
+    uint64_t hash = hash_file(helper, "test_compress.txt");
+    svc_add(helper, "test_compress.txt");
+    char id[7];
+    strcpy(id, svc_commit(helper, "Compressible file"));
+    char manifest_path[24];
+    sprintf(manifest_path, "svc_db/%016lx", hash);
+    int fd = open(manifest_path, O_RDONLY);
+    struct manifest m;
+    struct chunk_ref refs[64];
+    assert(read(fd, &m, sizeof(m)) == sizeof(m));
+    assert(read(fd, refs, m.n_chunks * sizeof(struct chunk_ref)) > 0);
+    close(fd);
+    size_t stored = 0;
+    for (unsigned int i=0; i<m.n_chunks; i++) {
+        char chunk_path[40];
+        struct stat sb;
+        sprintf(chunk_path, "svc_db/chunks/%016lx", refs[i].id);
+        assert(stat(chunk_path, &sb) == 0);
+        stored += sb.st_size;
+    }
+    assert(stored < m.file_size / 2);
+    for (int pass=0; pass<2; pass++) {
+        svc->use_uring = pass == 0;
+        remove("test_compress.txt");
+        assert(svc_reset(helper, id) == 0);
+        assert(hash_file(helper, "test_compress.txt") == hash);
+    }
+    svc->use_uring = 1;
+    cleanup(helper);
+    return 0;
+}
+
+int test_packfiles() {
+    void *helper = svc_init();
+    struct helper *svc = (struct helper *)helper;
+    char path[64];
+    uint64_t hashes[4];
+    mkdir("test_pack", S_IRWXU);
+    for (int i=0; i<4; i++) {
+        sprintf(path, "test_pack/%d.txt", i);
+        FILE *f = fopen(path, "w");
+        for (int k=0; k<(i == 3 ? 30000 : 10); k++) {
+            fprintf(f, "pack %d line %d\n", i, k);
+        }
+        fclose(f);
+        svc_add(helper, path);
+        hashes[i] = hash_file(helper, path);
+    }
+    char id[7];
+    strcpy(id, svc_commit(helper, "Packed files"));
+
+    // Repacking moves the loose objects into a single pack
+    assert(svc_repack(helper) > 4);
+    char manifest_path[40];
+    for (int i=0; i<4; i++) {
+        object_path(manifest_path, hashes[i], OBJECT_MANIFEST);
+        assert(file_exists(manifest_path) == 0);
+        assert(object_exists(helper, hashes[i], OBJECT_MANIFEST));
+    }
+    pack_load(helper);
+    assert(svc->n_packs == 1);
+    struct pack *pack = svc->packs;
+    for (size_t i=1; i<pack->index->n_entries; i++) {
+        assert(pack->entries[i - 1].id <= pack->entries[i].id);
+    }
+    for (size_t i=0; i<pack->index->n_entries; i++) {
+        assert(pack->entries[i].offset % 8 == 0);
+    }
+    assert(pack->index->fanout[255] == pack->index->n_entries);
+
+    // Packed objects are not stored again, and new objects are stored loose
+    file_copy(helper, "test_pack/1.txt", "test_pack/4.txt");
+    svc_add(helper, "test_pack/4.txt");
+    FILE *f;
+    f = fopen("test_pack/0.txt", "a");
+    fputs("appended\n", f);
+    fclose(f);
+    uint64_t appended = hash_file(helper, "test_pack/0.txt");
+    assert(svc_commit(helper, "Loose files") != NULL);
+    object_path(manifest_path, hashes[1], OBJECT_MANIFEST);
+    assert(file_exists(manifest_path) == 0);
+    object_path(manifest_path, appended, OBJECT_MANIFEST);
+    assert(file_exists(manifest_path) == 1);
+
+    // Files are restored from the pack, through both I/O paths and after the
+    // repository is reopened
+    for (int pass=0; pass<2; pass++) {
+        svc->use_uring = pass == 0;
+        for (int i=0; i<4; i++) {
+            sprintf(path, "test_pack/%d.txt", i);
+            unlink(path);
+        }
+        assert(svc_reset(helper, id) == 0);
+        for (int i=0; i<4; i++) {
+            sprintf(path, "test_pack/%d.txt", i);
+            assert(hash_file(helper, path) == hashes[i]);
+        }
+    }
+    svc->use_uring = 1;
+
+    // A second repack folds the new loose objects and the old pack together
+    assert(svc_repack(helper) > 0);
+    object_path(manifest_path, appended, OBJECT_MANIFEST);
+    assert(file_exists(manifest_path) == 0);
+    cleanup(helper);
+    helper = svc_init();
+    svc = (struct helper *)helper;
+    pack_load(helper);
+    assert(svc->n_packs == 1);
+    unlink("test_pack/3.txt");
+    assert(svc_reset(helper, id) == 0);
+    assert(hash_file(helper, "test_pack/3.txt") == hashes[3]);
+    cleanup(helper);
+    return 0;
+}
+
+int test_delta_packs() {
+    // A delta rebuilds the edited object from its base, and damaged deltas
+    // are detected
+    void *helper = svc_init();
+    struct helper *svc = (struct helper *)helper;
+    static unsigned char base[20000];
+    static unsigned char target[20000];
+    static unsigned char delta[20000];
+    static unsigned char out[20000];
+    for (size_t i=0; i<sizeof(base); i++) {
+        base[i] = (i * 2654435761u) >> 11;
+    }
+    memcpy(target, base, sizeof(base));
+    memcpy(target + 5000, "an edit", 7);
+    memset(target + 15000, 'x', 100);
+    size_t n = delta_encode(helper, base, sizeof(base), target, sizeof(target), delta,
+                            sizeof(delta));
+    assert(n > 0 && n < 400);
+    assert(delta_apply(base, sizeof(base), delta, n, out, sizeof(out)) == 0);
+    assert(memcmp(out, target, sizeof(target)) == 0);
+    assert(delta_apply(base, sizeof(base), delta, n - 1, out, sizeof(out)) == -1);
+    assert(delta_apply(base, 100, delta, n, out, sizeof(out)) == -1);
+
+    // Successive versions of a file are packed as deltas, in bounded chains
+    char ids[25][7];
+    uint64_t hashes[25];
+    for (int v=0; v<25; v++) {
+        FILE *f = fopen("test_delta.txt", "w");
+        for (int k=0; k<3000; k++) {
+            fprintf(f, "row %d value %d\n", k, k == v * 100 ? -v : (k * 7919) % 1000);
+        }
+        fclose(f);
+        if (v == 0) {
+            svc_add(helper, "test_delta.txt");
+        }
+        char message[32];
+        sprintf(message, "Delta version %c", 'a' + v);
+        strcpy(ids[v], svc_commit(helper, message));
+        hashes[v] = hash_file(helper, "test_delta.txt");
+    }
+    assert(svc_repack(helper) > 0);
+    pack_load(helper);
+    struct pack *pack = svc->packs;
+    size_t n_deltas = 0;
+    for (size_t i=0; i<pack->index->n_entries; i++) {
+        size_t depth = 0;
+        for (size_t k=i; pack->entries[k].type & OBJECT_DELTA; depth++) {
+            struct delta_header header;
+            memcpy(&header, pack->data + pack->entries[k].offset, sizeof(header));
+            k = header.base;
+        }
+        assert(depth <= 10);
+        n_deltas += depth > 0;
+    }
+    assert(n_deltas >= 24);
+
+    // Walking the history rebuilds each version, reusing decoded bases
+    for (int pass=0; pass<2; pass++) {
+        for (int v=0; v<25; v++) {
+            assert(svc_reset(helper, ids[v]) == 0);
+            assert(hash_file(helper, "test_delta.txt") == hashes[v]);
+        }
+        assert(svc->delta_cache->hits > 0);
+
+        // Deltas are decoded and encoded again by a later repack
+        FILE *f = fopen("test_delta_extra.txt", "w");
+        fputs("extra", f);
+        fclose(f);
+        svc_add(helper, "test_delta_extra.txt");
+        svc_commit(helper, pass == 0 ? "Extra file" : "Extra file again");
+        assert(svc_repack(helper) > 0);
+    }
+    cleanup(helper);
+    return 0;
+}
+
+int test_gc() {
+    void *helper = svc_init();
+    char ids[4][7];
+    uint64_t hashes[4];
+    for (int v=0; v<4; v++) {
+        FILE *f = fopen("test_gc.txt", "w");
+        for (int k=0; k<5000; k++) {
+            fprintf(f, "gc version %d line %d\n", v, k);
+        }
+        fclose(f);
+        if (v == 0) {
+            svc_add(helper, "test_gc.txt");
+        }
+        char message[32];
+        sprintf(message, "GC version %c", 'a' + v);
+        strcpy(ids[v], svc_commit(helper, message));
+        hashes[v] = hash_file(helper, "test_gc.txt");
+
+        // The third version stays on a branch, and the fourth stays loose
+        if (v == 2) {
+            assert(svc_repack(helper) > 0);
+            assert(svc_branch(helper, "gc_side") == 0);
+        }
+    }
+
+    // Resetting back leaves the last version unreachable, which a dry run
+    // counts without removing
+    assert(svc_reset(helper, ids[1]) == 0);
+    ssize_t n_bytes = svc_gc(helper, 1);
+    assert(n_bytes > 0);
+    assert(object_exists(helper, hashes[3], OBJECT_MANIFEST));
+    assert(svc_gc(helper, 0) == n_bytes);
+    assert(!object_exists(helper, hashes[3], OBJECT_MANIFEST));
+    assert(svc_gc(helper, 1) == 0);
+
+    // Resetting to the collected commit fails and leaves the head and the
+    // working directory alone
+    struct helper *svc = (struct helper *)helper;
+    size_t head_commit = svc->branches[svc->head].ref_commit;
+    assert(svc_reset(helper, ids[3]) == -3);
+    assert(svc->branches[svc->head].ref_commit == head_commit);
+    assert(hash_file(helper, "test_gc.txt") == hashes[1]);
+
+    // The reachable versions are all still restored
+    for (int v=0; v<3; v++) {
+        assert(object_exists(helper, hashes[v], OBJECT_MANIFEST));
+        assert(svc_reset(helper, ids[v]) == 0);
+        assert(hash_file(helper, "test_gc.txt") == hashes[v]);
+    }
+    assert(svc_reset(helper, ids[1]) == 0);
+
+    // Unreachable objects are also removed from packs
+    assert(svc_repack(helper) > 0);
+    assert(svc_checkout(helper, "gc_side") == 0);
+    assert(svc_reset(helper, ids[1]) == 0);
+    n_bytes = svc_gc(helper, 1);
+    assert(n_bytes > 0);
+    assert(svc_gc(helper, 0) == n_bytes);
+    assert(!object_exists(helper, hashes[2], OBJECT_MANIFEST));
+    assert(svc_reset(helper, ids[0]) == 0);
+    assert(hash_file(helper, "test_gc.txt") == hashes[0]);
+    assert(svc_checkout(helper, "master") == 0);
+
+    // A reachable manifest which cannot be read fails the collection before
+    // anything is removed
+    FILE *f = fopen("test_gc.txt", "a");
+    fputs("unreadable\n", f);
+    fclose(f);
+    char id[7];
+    strcpy(id, svc_commit(helper, "GC unreadable"));
+    uint64_t unreadable = hash_file(helper, "test_gc.txt");
+    char manifest_path[40];
+    char moved_path[48];
+    object_path(manifest_path, unreadable, OBJECT_MANIFEST);
+    sprintf(moved_path, "%s.moved", manifest_path);
+    rename(manifest_path, moved_path);
+    mkdir(manifest_path, S_IRWXU);
+    assert(svc_gc(helper, 0) == -1);
+    rmdir(manifest_path);
+    rename(moved_path, manifest_path);
+    assert(svc_gc(helper, 0) >= 0);
+    unlink("test_gc.txt");
+    assert(svc_reset(helper, id) == 0);
+    assert(hash_file(helper, "test_gc.txt") == unreadable);
+    cleanup(helper);
+    return 0;
+}
+
+void check_diff(struct diff *d, size_t n_removed, size_t n_added) {
+    size_t a = 0;
+    size_t b = 0;
+    size_t n_matched = 0;
+    for (size_t i=0; i<d->n_matches; i++) {
+        struct diff_match *match = d->matches + i;
+        assert(match->n > 0 && match->a >= a && match->b >= b);
+        for (size_t k=0; k<match->n; k++) {
+            assert(diff_line_equal(&d->a, match->a + k, &d->b, match->b + k));
+        }
+        a = match->a + match->n;
+        b = match->b + match->n;
+        n_matched += match->n;
+    }
+    assert(a <= d->a.n_lines && b <= d->b.n_lines);
+    assert(d->n_removed == d->a.n_lines - n_matched);
+    assert(d->n_added == d->b.n_lines - n_matched);
+    assert(d->n_removed == n_removed && d->n_added == n_added);
+}
+
+size_t write_lines(char *data, size_t n_lines, size_t step, char *changed) {
+    size_t size = 0;
+    for (size_t k=0; k<n_lines; k++) {
+        if (step > 0 && k % step == step / 2) {
+            size += sprintf(data + size, "%s %zu\n", changed, k);
+        }
+        size += sprintf(data + size, "line %zu of the file\n", k);
+    }
+    return size;
+}
+
+int test_line_diff() {
+    void *helper = svc_init();
+    size_t mark = scratch_mark(helper);
+    struct diff d;
+
+    // The changed line and the new last line without a newline
+    char *old = "a\nb\nc\nd\n";
+    char *new = "a\nx\nc\nd\ne";
+    diff_lines(helper, &d, (unsigned char *)old, strlen(old), (unsigned char *)new, strlen(new));
+    assert(d.n_matches == 2 && d.matches[1].a == 2 && d.matches[1].n == 2);
+    check_diff(&d, 1, 2);
+    diff_lines(helper, &d, (unsigned char *)old, strlen(old), (unsigned char *)old, strlen(old));
+    check_diff(&d, 0, 0);
+    diff_lines(helper, &d, (unsigned char *)old, strlen(old), NULL, 0);
+    check_diff(&d, 4, 0);
+
+    // Lines inserted into ranges too large for Myers, below and above the
+    // size matched chunk by chunk
+    size_t sizes[] = {20000, 200000};
+    for (int s=0; s<2; s++) {
+        char *a = malloc(sizes[s] * 32);
+        char *b = malloc(sizes[s] * 32);
+        size_t a_size = write_lines(a, sizes[s], 0, NULL);
+        size_t b_size = write_lines(b, sizes[s], 1000, "inserted");
+        diff_lines(helper, &d, (unsigned char *)a, a_size, (unsigned char *)b, b_size);
+        check_diff(&d, 0, sizes[s] / 1000);
+        diff_lines(helper, &d, (unsigned char *)b, b_size, (unsigned char *)a, a_size);
+        check_diff(&d, sizes[s] / 1000, 0);
+        free(a);
+        free(b);
+    }
+
+    // Repeated lines leave no unique anchors
+    char *a = malloc(60000);
+    char *b = malloc(60000);
+    size_t a_size = 0;
+    size_t b_size = 0;
+    for (int k=0; k<10000; k++) {
+        a_size += sprintf(a + a_size, "%c\n", 'x' + k % 2);
+        b_size += sprintf(b + b_size, "%s%c\n", k % 2500 == 7 ? "z\n" : "", 'x' + k % 2);
+    }
+    diff_lines(helper, &d, (unsigned char *)a, a_size, (unsigned char *)b, b_size);
+    check_diff(&d, 0, 4);
+    free(a);
+    free(b);
+    scratch_release(helper, mark);
+
+    // Versions are assembled from their chunks
+    FILE *f = fopen("test_line_diff.txt", "w");
+    for (int k=0; k<20000; k++) {
+        fprintf(f, "diff line %d\n", k);
+    }
+    fclose(f);
+    svc_add(helper, "test_line_diff.txt");
+    char id[7];
+    strcpy(id, svc_commit(helper, "Line diff"));
+    struct object view;
+    mark = scratch_mark(helper);
+    assert(version_open(helper, hash_file(helper, "test_line_diff.txt"), &view) == 0);
+    f = fopen("test_line_diff.txt", "r");
+    char *contents = malloc(view.size);
+    assert(fread(contents, 1, view.size, f) == view.size && fgetc(f) == EOF);
+    assert(memcmp(contents, object_data(&view), view.size) == 0);
+    object_close(&view);
+    free(contents);
+    fclose(f);
+    scratch_release(helper, mark);
+
+    f = fopen("test_line_diff.txt", "a");
+    fprintf(f, "diff line appended\n");
+    fclose(f);
+    char *new_id = svc_commit(helper, "Line diff appended");
+    assert(svc_diff(helper, id, new_id) == 0);
+    assert(svc_diff(helper, id, "zzzzzz") == -2);
+    assert(svc_diff(helper, NULL, id) == -1);
+    cleanup(helper);
+    return 0;
+}
+
+int test_stat_cache() {
+    void *helper = svc_init();
+    FILE *f = fopen("test_stat.txt", "w");
+    fputs("a", f);
+    fclose(f);
+    svc_add(helper, "test_stat.txt");
+    assert(svc_commit(helper, "Stat commit") != NULL);
+
+    // An edit in the same second keeping the same size is still detected
+    f = fopen("test_stat.txt", "w");
+    fputs("b", f);
+    fclose(f);
+    assert(svc_commit(helper, "Same second edit") != NULL);
+
+    // A file whose stat data matches is not rehashed
+    struct timespec times[2] = {{1000000000, 0}, {1000000000, 0}};
+    utimensat(AT_FDCWD, "test_stat.txt", times, 0);
+    struct file file = {.hash = 0, .path = path_intern(helper, "test_stat.txt")};
+    uint64_t hash = stat_hash(helper, &file);
+    assert(hash == hash_file(helper, "test_stat.txt"));
+    file.hash = 12345;
+    assert(stat_hash(helper, &file) == 12345);
+
+    cleanup(helper);
+    return 0;
+}
+
+int test_commit_lookup() {
+    void *helper = svc_init();
+    struct helper *svc = (struct helper *)helper;
+    char message[32];
+    for (int i=0; i<100; i++) {
+        FILE *f = fopen("test_lookup.txt", "w");
+        fprintf(f, "%d", i);
+        fclose(f);
+        if (i == 0) {
+            svc_add(helper, "test_lookup.txt");
+        }
+        sprintf(message, "Lookup %d", i);
+        svc_commit(helper, message);
+    }
+
+    for (size_t i=0; i<svc->n_commits; i++) {
+        char *id = svc->commits[i].commit_id;
+        struct commit *c = (struct commit *)get_commit(helper, id);
+        assert(c != NULL && strcmp(c->commit_id, id) == 0);
+
+        // Every prefix resolves to the commit only if no other ID shares it
+        for (size_t length=1; length<6; length++) {
+            char prefix[7];
+            strncpy(prefix, id, length);
+            prefix[length] = '\0';
+            int unique = 1;
+            for (size_t j=0; j<svc->n_commits; j++) {
+                if (strcmp(svc->commits[j].commit_id, id) != 0
+                    && strncmp(svc->commits[j].commit_id, prefix, length) == 0) {
+                    unique = 0;
+                }
+            }
+            c = (struct commit *)get_commit(helper, prefix);
+            if (unique) {
+                assert(c != NULL && strcmp(c->commit_id, id) == 0);
+            } else {
+                assert(c == NULL);
+            }
+        }
+    }
+    assert(get_commit(helper, "xyz") == NULL);
+
+    cleanup(helper);
+    return 0;
+}
+
+/**
+* Checks that every file in the index is found at its position through the
+* index table.
+*/
+void check_index_table(void *helper) {
+    struct helper *svc = (struct helper *)helper;
+    assert(svc->index_table.size == svc->index_size - svc->index_removed);
+    for (size_t i=0; i<svc->index_size; i++) {
+        char *file_name = path_name(helper, svc->index[i].path);
+        if (file_name != NULL) {
+            assert(table_get(&svc->index_table, file_name) == i);
+        }
+    }
+}
+
+int test_index_table() {
+    void *helper = svc_init();
+    mkdir("test_index", S_IRWXU);
+    char path[64];
+    for (int i=0; i<1000; i++) {
+        sprintf(path, "test_index/%d.txt", i);
+        FILE *f = fopen(path, "w");
+        fprintf(f, "%d", i);
+        fclose(f);
+        svc_add(helper, path);
+    }
+    assert(svc_add(helper, "test_index/5.txt") == (uint64_t)-2);
+    for (int i=0; i<1000; i+=3) {
+        sprintf(path, "test_index/%d.txt", i);
+        assert(svc_rm(helper, path) != (uint64_t)-2);
+        assert(!is_tracked(helper, path));
+    }
+    assert(is_tracked(helper, "test_index/1.txt"));
+    check_index_table(helper);
+
+    char id[7];
+    strcpy(id, svc_commit(helper, "Index table"));
+    check_index_table(helper);
+    svc_branch(helper, "index_branch");
+    svc_checkout(helper, "index_branch");
+    check_index_table(helper);
+    svc_rm(helper, "test_index/1.txt");
+    svc_commit(helper, "Removed a file");
+    svc_reset(helper, id);
+    check_index_table(helper);
+    assert(is_tracked(helper, "test_index/1.txt"));
+
+    cleanup(helper);
+    return 0;
+}
+
+int test_path_pool() {
+    void *helper = svc_init();
+    struct helper *svc = (struct helper *)helper;
+    uint32_t a = path_intern(helper, "pool/abcdefgh_a.txt");
+    assert(path_intern(helper, "pool/abcdefgh_a.txt") == a);
+    assert(path_find(helper, "pool/abcdefgh_a.txt") == a);
+    assert(strcmp(path_name(helper, a), "pool/abcdefgh_a.txt") == 0);
+    assert(path_find(helper, "pool/never_added.txt") == (uint32_t)-1);
+
+    // Paths are ordered ignoring case, then by the exact path
+    uint32_t b = path_intern(helper, "pool/ABCDEFGH_B.txt");
+    uint32_t upper_a = path_intern(helper, "pool/ABCDEFGH_a.txt");
+    uint32_t z = path_intern(helper, "Pool/z.txt");
+    assert(path_cmp(helper, a, b) < 0 && path_cmp(helper, b, a) > 0);
+    assert(path_cmp(helper, upper_a, a) < 0 && path_cmp(helper, a, upper_a) > 0);
+    assert(path_cmp(helper, upper_a, b) < 0);
+    assert(path_cmp(helper, b, z) < 0);
+    assert(path_cmp(helper, z, z) == 0);
+
+    // Adding a path again after removing it reuses its pooled name
+    mkdir("test_pool", S_IRWXU);
+    FILE *f = fopen("test_pool/file.txt", "w");
+    fprintf(f, "pool");
+    fclose(f);
+    svc_add(helper, "test_pool/file.txt");
+    svc_rm(helper, "test_pool/file.txt");
+    size_t n_paths = svc->n_paths;
+    svc_add(helper, "test_pool/file.txt");
+    assert(svc->n_paths == n_paths);
+    assert(path_cmp(helper, svc->index[svc->index_size - 1].path,
+                    path_find(helper, "test_pool/file.txt")) == 0);
+    svc_commit(helper, "Path pool");
+    cleanup(helper);
+    return 0;
+}
+
+/**
+* Checks that a list of files is sorted with no removed files.
+*/
+void check_sorted(void *helper, struct file *files, size_t n_files) {
+    for (size_t i=0; i<n_files; i++) {
+        assert(path_name(helper, files[i].path) != NULL);
+        if (i > 0) {
+            assert(file_cmp(helper, files + i - 1, files + i) < 0);
+        }
+    }
+}
+
+int test_sorted_index() {
+    void *helper = svc_init();
+    struct helper *svc = (struct helper *)helper;
+    char path[64];
+    mkdir("test_sorted", S_IRWXU);
+    for (int i=0; i<500; i++) {
+        sprintf(path, "test_sorted/%d.txt", (i * 7919) % 500);
+        FILE *f = fopen(path, "w");
+        fprintf(f, "%d", i);
+        fclose(f);
+        svc_add(helper, path);
+    }
+    char id[7];
+    strcpy(id, svc_commit(helper, "Sorted index"));
+    assert(svc->index_sorted == svc->index_size);
+    check_sorted(helper, svc->index, svc->index_size);
+    size_t mark = scratch_mark(helper);
+    struct file *commit_files = tree_map(helper, svc->commits[svc->n_commits - 1].tree);
+    check_sorted(helper, commit_files, svc->index_size);
+    scratch_release(helper, mark);
+
+    // Removed files stay in place and new files are appended until a flush
+    size_t index_size = svc->index_size;
+    assert(svc_rm(helper, "test_sorted/10.txt") != (uint64_t)-2);
+    assert(svc_rm(helper, "test_sorted/10.txt") == (uint64_t)-2);
+    assert(svc_add(helper, "test_sorted/10.txt") != (uint64_t)-2);
+    svc_rm(helper, "test_sorted/20.txt");
+    svc_rm(helper, "test_sorted/30.txt");
+    FILE *f = fopen("test_sorted/a.txt", "w");
+    fclose(f);
+    svc_add(helper, "test_sorted/a.txt");
+    assert(svc->index_size == index_size + 2);
+    check_index_table(helper);
+    index_flush(helper);
+    assert(svc->index_size == index_size - 1);
+    check_sorted(helper, svc->index, svc->index_size);
+    check_index_table(helper);
+
+    // Files which no longer exist are dropped at commit
+    remove("test_sorted/40.txt");
+    remove("test_sorted/41.txt");
+    svc_commit(helper, "Removed files");
+    assert(svc->index_size == index_size - 3);
+    assert(!is_tracked(helper, "test_sorted/41.txt"));
+    check_sorted(helper, svc->index, svc->index_size);
+    check_index_table(helper);
+
+    // Merging a branch ahead of the current one moves the current branch
+    // forward without a commit, so the resolutions are not used
+    svc_branch(helper, "sorted_branch");
+    svc_checkout(helper, "sorted_branch");
+    f = fopen("test_sorted/b.txt", "w");
+    fclose(f);
+    svc_add(helper, "test_sorted/b.txt");
+    char branch_id[7];
+    strcpy(branch_id, svc_commit(helper, "Added a file"));
+    svc_checkout(helper, "master");
+    size_t n_commits = svc->n_commits;
+    resolution res = {"test_sorted/50.txt", NULL};
+    assert(strcmp(svc_merge(helper, "sorted_branch", &res, 1), branch_id) == 0);
+    assert(svc->n_commits == n_commits);
+    assert(is_tracked(helper, "test_sorted/b.txt"));
+    assert(is_tracked(helper, "test_sorted/50.txt"));
+    assert(svc->index_size == index_size - 2);
+    check_sorted(helper, svc->index, svc->index_size);
+    check_index_table(helper);
+    cleanup(helper);
+    return 0;
+}
+
+/**
+* Writes a numbered line of text to a file.
+*/
+void write_numbered(char *path, char *prefix, int i) {
+    FILE *f = fopen(path, "w");
+    fprintf(f, "%s%d", prefix, i);
+    fclose(f);
+}
+
+int test_three_way_merge() {
+    void *helper = svc_init();
+    struct helper *svc = (struct helper *)helper;
+    size_t index_size = svc->index_size;
+    char path[64];
+    mkdir("test_merge", S_IRWXU);
+    for (int i=0; i<1000; i++) {
+        sprintf(path, "test_merge/%d.txt", i);
+        write_numbered(path, "", i);
+        svc_add(helper, path);
+    }
+    write_numbered("test_merge/removed.txt", "", 0);
+    svc_add(helper, "test_merge/removed.txt");
+    write_numbered("test_merge/resolved", "resolved", 0);
+    void *base = get_commit(helper, svc_commit(helper, "Merge base"));
+
+    // The merged branch changes every file, adds files and removes a file
+    svc_branch(helper, "merge_branch");
+    svc_checkout(helper, "merge_branch");
+    for (int i=0; i<2000; i++) {
+        sprintf(path, "test_merge/%d.txt", i);
+        write_numbered(path, "theirs", i);
+        if (i >= 1000) {
+            svc_add(helper, path);
+        }
+    }
+    svc_rm(helper, "test_merge/removed.txt");
+    void *theirs = get_commit(helper, svc_commit(helper, "Changed files"));
+
+    // The current branch changes the first 500 files, which conflict
+    svc_checkout(helper, "master");
+    for (int i=0; i<500; i++) {
+        sprintf(path, "test_merge/%d.txt", i);
+        write_numbered(path, "ours", i);
+    }
+    write_numbered("test_merge/ours.txt", "", 0);
+    svc_add(helper, "test_merge/ours.txt");
+    void *ours = get_commit(helper, svc_commit(helper, "Changed some files"));
+    assert(get_merge_base(helper, ours, theirs) == base);
+    assert(get_merge_base(helper, base, theirs) == base);
+
+    int n_conflicts;
+    char **conflicts = svc_merge_conflicts(helper, "merge_branch", &n_conflicts);
+    assert(n_conflicts == 500);
+    for (int i=0; i<n_conflicts; i++) {
+        assert(atoi(conflicts[i] + strlen("test_merge/")) < 500);
+    }
+    free(conflicts);
+    assert(svc_merge_conflicts(helper, "missing_branch", &n_conflicts) == NULL);
+    assert(n_conflicts == 0);
+
+    // Every third conflicting file is removed and every third file after
+    // those is replaced by the resolved file. Resolutions for files without
+    // conflicts are not used.
+    int n_resolutions = 0;
+    resolution *resolutions = malloc(1000 * sizeof(resolution));
+    char (*names)[64] = malloc(1000 * 64);
+    for (int i=0; i<500; i+=3) {
+        sprintf(names[n_resolutions], "test_merge/%d.txt", i);
+        resolutions[n_resolutions].file_name = names[n_resolutions];
+        resolutions[n_resolutions].resolved_file = NULL;
+        n_resolutions++;
+        sprintf(names[n_resolutions], "test_merge/%d.txt", i + 1);
+        resolutions[n_resolutions].file_name = names[n_resolutions];
+        resolutions[n_resolutions].resolved_file = "test_merge/resolved";
+        n_resolutions++;
+    }
+    resolutions[n_resolutions].file_name = "test_merge/1500.txt";
+    resolutions[n_resolutions].resolved_file = NULL;
+    n_resolutions++;
+    size_t n_commits = svc->n_commits;
+    char *id = svc_merge(helper, "merge_branch", resolutions, n_resolutions);
+    assert(svc->n_commits == n_commits + 1);
+    void *merged = get_commit(helper, id);
+    int n_prev;
+    char **prev_commits = get_prev_commits(helper, merged, &n_prev);
+    assert(n_prev == 2);
+    free(prev_commits);
+    assert(get_merge_base(helper, merged, theirs) == theirs);
+
+    assert(svc->index_size == index_size + 333 + 500 + 1000 + 1);
+    check_sorted(helper, svc->index, svc->index_size);
+    check_index_table(helper);
+    assert(!is_tracked(helper, "test_merge/removed.txt"));
+    assert(access("test_merge/removed.txt", F_OK) != 0);
+    assert(is_tracked(helper, "test_merge/ours.txt"));
+    uint64_t resolved_hash = hash_file(helper, "test_merge/resolved");
+    for (int i=0; i<2000; i++) {
+        sprintf(path, "test_merge/%d.txt", i);
+        assert(is_tracked(helper, path) == (i >= 500 || i % 3 != 0));
+        assert((access(path, F_OK) == 0) == (i >= 500 || i % 3 != 0));
+        if (i < 500 && i % 3 == 1) {
+            assert(hash_file(helper, path) == resolved_hash);
+        } else if (i < 500 && i % 3 == 2) {
+            write_numbered("test_merge/expected", "ours", i);
+            assert(hash_file(helper, path) == hash_file(helper, "test_merge/expected"));
+        } else if (i >= 500) {
+            write_numbered("test_merge/expected", "theirs", i);
+            assert(hash_file(helper, path) == hash_file(helper, "test_merge/expected"));
+        }
+    }
+
+    // Merging again has nothing to do, and merging the other way around
+    // fast-forwards the merged branch to the merge commit
+    assert(svc_merge(helper, "merge_branch", NULL, 0) == ((struct commit *)theirs)->commit_id);
+    svc_checkout(helper, "merge_branch");
+    assert(strcmp(svc_merge(helper, "master", NULL, 0), id) == 0);
+    assert(svc->n_commits == n_commits + 1);
+    assert(is_tracked(helper, "test_merge/ours.txt"));
+    svc_checkout(helper, "master");
+    free(resolutions);
+    free(names);
+    cleanup(helper);
+    return 0;
+}
+
+int test_scratch_arena() {
+    void *helper = svc_init();
+    struct helper *svc = (struct helper *)helper;
+    char path[64];
+    mkdir("test_scratch", S_IRWXU);
+    for (int i=0; i<50; i++) {
+        sprintf(path, "test_scratch/%d.txt", i);
+        write_numbered(path, "", i);
+        svc_add(helper, path);
+    }
+    char id[7];
+    strcpy(id, svc_commit(helper, "Scratch files"));
+    svc_branch(helper, "scratch_branch");
+
+    // Operations that store nothing leave the repository heap unchanged
+    size_t heap_used = svc->heap_used;
+    for (int i=0; i<20; i++) {
+        print_commit(helper, id);
+        assert(svc_commit(helper, "No changes") == NULL);
+        int n_conflicts;
+        assert(svc_merge_conflicts(helper, "scratch_branch", &n_conflicts) == NULL);
+        assert(svc_checkout(helper, "master") == 0);
+    }
+    assert(svc->heap_used == heap_used);
+    assert(svc->scratch_used == 0);
+
+    write_numbered("test_scratch/0.txt", "changed", 0);
+    assert(svc_commit(helper, "Changed a file") != NULL);
+    assert(svc->scratch_used == 0);
+    cleanup(helper);
+    return 0;
+}
+
+int test_incremental_checkout() {
+    void *helper = svc_init();
+    char path[64];
+    mkdir("test_checkout", S_IRWXU);
+    for (int i=0; i<100; i++) {
+        sprintf(path, "test_checkout/%d.txt", i);
+        write_numbered(path, "", i);
+        svc_add(helper, path);
+    }
+    char master_id[7];
+    strcpy(master_id, svc_commit(helper, "Checkout files"));
+    svc_branch(helper, "checkout_branch");
+    assert(svc_checkout(helper, "checkout_branch") == 0);
+    write_numbered("test_checkout/0.txt", "branch", 0);
+    write_numbered("test_checkout/1.txt", "branch", 1);
+    write_numbered("test_checkout/new.txt", "branch", 2);
+    svc_add(helper, "test_checkout/new.txt");
+    svc_commit(helper, "Branch changes");
+
+    // Files that are the same on both branches are not rewritten
+    struct timespec times[2] = {{1000000000, 0}, {1000000000, 0}};
+    utimensat(AT_FDCWD, "test_checkout/50.txt", times, 0);
+    assert(svc_checkout(helper, "master") == 0);
+    struct stat sb;
+    assert(stat("test_checkout/50.txt", &sb) == 0 && sb.st_mtime == 1000000000);
+    assert(!file_exists("test_checkout/new.txt"));
+    FILE *f = fopen("test_checkout/0.txt", "r");
+    int value = -1;
+    assert(fscanf(f, "%d", &value) == 1 && value == 0);
+    fclose(f);
+
+    assert(svc_checkout(helper, "checkout_branch") == 0);
+    assert(file_exists("test_checkout/new.txt"));
+    assert(stat("test_checkout/50.txt", &sb) == 0 && sb.st_mtime == 1000000000);
+
+    // Reset deletes the committed files the target commit does not have,
+    // keeps files that were only staged, and restores modified files
+    write_numbered("test_checkout/1.txt", "dirty", 1);
+    write_numbered("test_checkout/staged.txt", "precious", 3);
+    svc_add(helper, "test_checkout/staged.txt");
+    assert(svc_reset(helper, master_id) == 0);
+    assert(!file_exists("test_checkout/new.txt"));
+    assert(file_exists("test_checkout/staged.txt"));
+    assert(!is_tracked(helper, "test_checkout/staged.txt"));
+    f = fopen("test_checkout/staged.txt", "r");
+    char contents[16];
+    assert(fgets(contents, sizeof(contents), f) != NULL);
+    assert(strcmp(contents, "precious3") == 0);
+    fclose(f);
+    f = fopen("test_checkout/1.txt", "r");
+    assert(fscanf(f, "%d", &value) == 1 && value == 1);
+    fclose(f);
+    svc_checkout(helper, "master");
+    cleanup(helper);
+    return 0;
+}
+
+int test_commit_graph() {
+    void *helper = svc_init();
+    struct helper *svc = (struct helper *)helper;
+    char path[64];
+    char ids[200][7];
+    mkdir("test_graph", S_IRWXU);
+    for (int i=0; i<20; i++) {
+        sprintf(path, "test_graph/%d.txt", i);
+        write_numbered(path, "", i);
+        svc_add(helper, path);
+    }
+    strcpy(ids[0], svc_commit(helper, "Graph base"));
+
+    // Each commit changes one file
+    for (int i=1; i<200; i++) {
+        sprintf(path, "test_graph/%d.txt", i % 20);
+        write_numbered(path, "changed", i);
+        strcpy(ids[i], svc_commit(helper, "Changed a file"));
+    }
+    assert(svc->n_graph_nodes == svc->n_commits);
+    for (int i=1; i<200; i++) {
+        for (int j=0; j<20; j++) {
+            sprintf(path, "test_graph/%d.txt", j);
+            assert(svc_touches_path(helper, ids[i], path) == (i % 20 == j));
+        }
+    }
+    assert(svc_touches_path(helper, ids[0], "test_graph/0.txt") == 1);
+    assert(svc_touches_path(helper, "xyz", "test_graph/0.txt") == -1);
+
+    // The Bloom filters rule out almost every path that was not changed
+    size_t commit_index = find_commit(helper, ids[150]);
+    int n_maybe = 0;
+    for (int i=0; i<10000; i++) {
+        sprintf(path, "test_graph/other/%d.txt", i);
+        n_maybe += bloom_maybe_changed(helper, commit_index, path_intern(helper, path));
+    }
+    assert(n_maybe < 500);
+
+    // Ancestry follows both parents of merge commits
+    svc_branch(helper, "graph_branch");
+    svc_checkout(helper, "graph_branch");
+    write_numbered("test_graph/0.txt", "branch", 0);
+    char branch_id[7];
+    strcpy(branch_id, svc_commit(helper, "Branch commit"));
+    svc_checkout(helper, "master");
+    write_numbered("test_graph/1.txt", "master", 1);
+    svc_commit(helper, "Master commit");
+    char merge_id[7];
+    strcpy(merge_id, svc_merge(helper, "graph_branch", NULL, 0));
+    assert(svc_is_ancestor(helper, ids[0], ids[199]) == 1);
+    assert(svc_is_ancestor(helper, ids[199], ids[0]) == 0);
+    assert(svc_is_ancestor(helper, ids[50], ids[50]) == 1);
+    assert(svc_is_ancestor(helper, branch_id, merge_id) == 1);
+    assert(svc_is_ancestor(helper, ids[10], merge_id) == 1);
+    assert(svc_is_ancestor(helper, branch_id, ids[199]) == 0);
+    assert(svc_is_ancestor(helper, merge_id, branch_id) == 0);
+    assert(svc_is_ancestor(helper, "xyz", branch_id) == -1);
+    assert(svc_touches_path(helper, merge_id, "test_graph/0.txt") == 1);
+    assert(svc_touches_path(helper, merge_id, "test_graph/1.txt") == 0);
+    cleanup(helper);
+    return 0;
+}
+
+int test_file_tree() {
+    void *helper = svc_init();
+    struct helper *svc = (struct helper *)helper;
+    size_t n_files = 5000;
+    struct file *files = malloc(n_files * sizeof(struct file));
+    char path[64];
+    for (size_t i=0; i<n_files; i++) {
+        sprintf(path, "tree/%05zu.txt", i);
+        struct file f = {.hash = i, .path = path_intern(helper, path)};
+        files[i] = f;
+    }
+    struct tree_node *root = tree_build(helper, files, n_files);
+    assert(root->n_files == n_files);
+    assert(root->level > 0);
+    assert(tree_build(helper, files, n_files) == root);
+    assert(tree_build(helper, NULL, 0) == NULL);
+    size_t mark = scratch_mark(helper);
+    struct file *flat = tree_map(helper, root);
+    for (size_t i=0; i<n_files; i++) {
+        assert(flat[i].hash == i && flat[i].path == files[i].path);
+        assert(tree_find(helper, root, files[i].path)->hash == i);
+    }
+    scratch_release(helper, mark);
+    assert(tree_find(helper, root, path_intern(helper, "tree/missing.txt")) == NULL);
+    assert(tree_find(helper, root, path_intern(helper, "a")) == NULL);
+    assert(tree_find(helper, NULL, path_intern(helper, "a")) == NULL);
+
+    // Changing one file only creates the nodes on its path to the root
+    size_t n_nodes = svc->n_tree_nodes;
+    files[2500].hash = 0;
+    struct tree_node *changed = tree_build(helper, files, n_files);
+    assert(changed != root);
+    assert(svc->n_tree_nodes - n_nodes <= root->level + 1);
+    assert(tree_find(helper, changed, files[2500].path)->hash == 0);
+    assert(tree_find(helper, root, files[2500].path)->hash == 2500);
+
+    // Inserting a file only splits the nodes around it
+    n_nodes = svc->n_tree_nodes;
+    files[2500].path = path_intern(helper, "tree/02500a.txt");
+    files = realloc(files, (n_files + 1) * sizeof(struct file));
+    memmove(files + 2502, files + 2501, (n_files - 2501) * sizeof(struct file));
+    files[2501].path = path_intern(helper, "tree/02500b.txt");
+    struct tree_node *inserted = tree_build(helper, files, n_files + 1);
+    assert(inserted->n_files == n_files + 1);
+    assert(svc->n_tree_nodes - n_nodes <= 2 * (root->level + 1));
+    free(files);
+
+    // A commit changing one of many files grows the repository by a few
+    // nodes rather than by a copy of every file, even when the racy stat
+    // data of every other file is filled in since the last commit
+    mkdir("test_tree_commit", S_IRWXU);
+    for (int i=0; i<2000; i++) {
+        sprintf(path, "test_tree_commit/%d.txt", i);
+        write_numbered(path, "", i);
+        svc_add(helper, path);
+    }
+    svc_commit(helper, "Many files");
+    write_numbered("test_tree_commit/1000.txt", "changed", 0);
+    struct timespec times[2] = {{1000000000, 0}, {1000000000, 0}};
+    for (int i=0; i<2000; i++) {
+        sprintf(path, "test_tree_commit/%d.txt", i);
+        utimensat(AT_FDCWD, path, times, 0);
+    }
+    size_t heap_used = svc->heap_used;
+    char *id = svc_commit(helper, "One change");
+    assert(svc->heap_used - heap_used < 32768);
+    struct commit *c = (struct commit *)get_commit(helper, id);
+    assert(tree_find(helper, c->tree, path_find(helper, "test_tree_commit/1.txt"))->ino == 0);
+    assert(svc_touches_path(helper, id, "test_tree_commit/1000.txt") == 1);
+    assert(svc_touches_path(helper, id, "test_tree_commit/1001.txt") == 0);
+    cleanup(helper);
+    return 0;
+}
+
+int test_add_tree() {
+    void *helper = svc_init();
+    struct helper *svc = (struct helper *)helper;
+    char path[64];
+    mkdir("test_tree", S_IRWXU);
+    for (int i=0; i<8; i++) {
+        sprintf(path, "test_tree/%d", i);
+        mkdir(path, S_IRWXU);
+        sprintf(path, "test_tree/%d/sub", i);
+        mkdir(path, S_IRWXU);
+        for (int j=0; j<50; j++) {
+            sprintf(path, "test_tree/%d/%s%d.txt", i, j % 2 ? "sub/" : "", j);
+            FILE *f = fopen(path, "w");
+            fprintf(f, "%d %d", i, j);
+            fclose(f);
+        }
+    }
+    symlink("0", "test_tree/link");
+    size_t index_size = svc->index_size;
+
+    // Repeated, missing and already tracked paths are skipped
+    svc_add(helper, "test_tree/0/0.txt");
+    char *paths[] = {"test_tree/0/0.txt", "test_tree/0/2.txt", "test_tree/0/2.txt",
+                     "test_tree/missing.txt", "test_tree/1/sub/1.txt"};
+    assert(svc_add_paths(helper, paths, 5) == 2);
+    assert(svc_add_paths(helper, NULL, 1) == -1);
+    assert(svc->index_size == index_size + 3);
+
+    // Every other file is found once, without following the symbolic link
+    assert(svc_add_tree(helper, "test_tree/") == 397);
+    assert(svc_add_tree(helper, "test_tree") == 0);
+    assert(svc_add_tree(helper, "test_tree/0/0.txt") == -1);
+    assert(svc_add_tree(helper, "./test_tree") == 0);
+    assert(svc->index_size == index_size + 400);
+
+    // Directories are not added as files, and the database is never walked
+    char *dirs[] = {"test_tree/0", "test_tree/1/sub"};
+    assert(svc_add_paths(helper, dirs, 2) == 0);
+    assert(svc_add_tree(helper, "./svc_db") == 0);
+    char db_path[PATH_MAX];
+    assert(getcwd(db_path, sizeof(db_path) - 8) != NULL);
+    strcat(db_path, "/svc_db");
+    assert(svc_add_tree(helper, db_path) == 0);
+    assert(svc->index_size == index_size + 400);
+    assert(is_tracked(helper, "test_tree/7/sub/49.txt"));
+    assert(is_tracked(helper, "test_tree/7/48.txt"));
+    check_index_table(helper);
+    for (size_t i=0; i<svc->index_size; i++) {
+        assert(svc->index[i].hash == hash_file(helper, path_name(helper, svc->index[i].path)));
+    }
+    svc_commit(helper, "Added a tree");
+    cleanup(helper);
+    return 0;
+}
+
 int test_add_remove() {
     void *helper = svc_init();
     struct helper *svc = (struct helper *)helper;
@@ -188,7 +1520,7 @@ int test_add_remove() {
     // for (int i=0; i<svc->index_size; i++) {
     //     printf("%s\n", svc->index[i]->file_name);
     // }
-    assert(svc_add(helper, "Tests/diff.txt") == -2);
+    assert(svc_add(helper, "Tests/diff.txt") == (uint64_t)-2);
 
     svc_add(helper, "Tests/diff0.txt");
     printf("size: %d, cap: %d\n", svc->index_size, svc->index_cap);
@@ -237,7 +1569,23 @@ int test_branches() {
     for (int i=0; i<n_branches; i++) {
         printf("%s\n", branches[i]);
     }
-    free(branches);
+
+    // Branches are listed in sorted order and can be filtered by prefix
+    svc_branch(helper, "release/2");
+    svc_branch(helper, "release/1");
+    svc_branch(helper, "releases");
+    assert(svc_branch(helper, "release/1") == -2);
+    branches = list_branches(helper, &n_branches);
+    for (int i=1; i<n_branches; i++) {
+        assert(strcmp(branches[i - 1], branches[i]) < 0);
+    }
+    branches = list_branches_prefix(helper, "release/", &n_branches);
+    assert(n_branches == 2);
+    assert(strcmp(branches[0], "release/1") == 0);
+    assert(strcmp(branches[1], "release/2") == 0);
+    list_branches_prefix(helper, "feature/", &n_branches);
+    assert(n_branches == 0);
+    assert(svc_checkout(helper, "release/2") == 0);
 
     cleanup(helper);
     return 0;
@@ -246,7 +1594,7 @@ int test_branches() {
 int test_hash_file() {
     void *helper = svc_init();
 
-    int hash;
+    uint64_t hash;
 
     hash = hash_file(helper, "hello.py");
     // printf("hash: %d\n", hash);
@@ -259,7 +1607,7 @@ int test_hash_file() {
 int test_hash_file_big() {
     void *helper = svc_init();
 
-    int hash;
+    uint64_t hash;
 
     hash = hash_file(helper, "Tests/diff.txt");
     // printf("hash: %d\n", hash);
@@ -270,6 +1618,306 @@ int test_hash_file_big() {
 }
 
 
+int test_hash_collisions() {
+    void *helper = svc_init();
+
+    // Reordering the same bytes must change the hash
+    FILE *f = fopen("test_hash_a.txt", "w");
+    fputs("first line\nsecond line\n", f);
+    fclose(f);
+    f = fopen("test_hash_b.txt", "w");
+    fputs("second line\nfirst line\n", f);
+    fclose(f);
+    assert(hash_file(helper, "test_hash_a.txt") != hash_file(helper, "test_hash_b.txt"));
+
+    // Every hashing kernel gives the same result for every length
+    unsigned char data[3000];
+    for (int i=0; i<3000; i++) {
+        data[i] = (unsigned char)(i * 131 + 7);
+    }
+    char *kernels[] = {"sse2", "avx2", "avx512"};
+    for (int n=0; n<3000; n+=37) {
+        hash_set_kernel("scalar");
+        uint64_t expected = hash_bytes(data, n);
+        for (int k=0; k<3; k++) {
+            if (hash_set_kernel(kernels[k]) == 0) {
+                assert(hash_bytes(data, n) == expected);
+            }
+        }
+    }
+    hash_init();
+
+    cleanup(helper);
+    return 0;
+}
+
+/**
+* The byte sum previously used by hash_file(), kept as a baseline for
+* bench_hash_file(). It is only correct for lengths divisible by 32.
+*/
+int hash_bytesum(unsigned char *c, size_t size) {
+    int hash = 0;
+    for (size_t i=0; i<size; i+=32) {
+        hash += (c[i] + c[i+1] + c[i+2] + c[i+3]
+                + c[i+4] + c[i+5] + c[i+6] + c[i+7]
+                + c[i+8] + c[i+9] + c[i+10] + c[i+11]
+                + c[i+12] + c[i+13] + c[i+14] + c[i+15]
+                + c[i+16] + c[i+17] + c[i+18] + c[i+19]
+                + c[i+20] + c[i+21] + c[i+22] + c[i+23]
+                + c[i+24] + c[i+25] + c[i+26] + c[i+27]
+                + c[i+28] + c[i+29] + c[i+30] + c[i+31]);
+        if (hash >= 2000000000) {
+            hash = hash % 2000000000;
+        }
+    }
+    return hash;
+}
+
+double seconds_since(struct timespec *begin) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - begin->tv_sec) + (end.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+int bench_hash_file() {
+    size_t size = (size_t)1 << 28;
+    unsigned char *data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    for (size_t i=0; i<size; i++) {
+        data[i] = (unsigned char)(i * 2654435761U >> 13);
+    }
+    hash_init();
+
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    volatile int sum = hash_bytesum(data, size);
+    printf("byte sum: %.2f GB/s\n", size / seconds_since(&begin) / 1e9);
+    (void)sum;
+
+    char *kernels[] = {"scalar", "sse2", "avx2", "avx512"};
+    for (int k=0; k<4; k++) {
+        if (hash_set_kernel(kernels[k]) == -1) {
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        volatile uint64_t hash = hash_bytes(data, size);
+        printf("%s: %.2f GB/s\n", kernels[k], size / seconds_since(&begin) / 1e9);
+        (void)hash;
+    }
+    hash_init();
+    munmap(data, size);
+    return 0;
+}
+
+int test_parallel_hash() {
+    void *helper = svc_init();
+    struct helper *svc = (struct helper *)helper;
+    mkdir("test_parallel", S_IRWXU);
+    char path[64];
+    for (int i=0; i<200; i++) {
+        sprintf(path, "test_parallel/%d.txt", i);
+        FILE *f = fopen(path, "w");
+        fprintf(f, "file %d\n", i);
+        fclose(f);
+        svc_add(helper, path);
+    }
+
+    // The test's own files, looked up by path as the index holds others
+    struct file files[200];
+    for (int i=0; i<200; i++) {
+        sprintf(path, "test_parallel/%d.txt", i);
+        files[i] = svc->index[table_get(&svc->index_table, path)];
+    }
+
+    // Hashes are the same and in order for any number of workers
+    uint64_t serial[200];
+    uint64_t parallel[200];
+    svc->n_threads = 1;
+    for (int i=0; i<200; i++) {
+        files[i].mtime = 0;
+    }
+    hash_files(helper, files, 200, serial);
+    svc->n_threads = 4;
+    for (int i=0; i<200; i++) {
+        files[i].mtime = 0;
+    }
+    hash_files(helper, files, 200, parallel);
+    for (int i=0; i<200; i++) {
+        assert(serial[i] == parallel[i]);
+        assert(serial[i] == hash_file(helper, path_name(helper, files[i].path)));
+    }
+    svc->n_threads = 0;
+    svc_commit(helper, "Parallel hash");
+
+    // A file larger than a segment hashes the same as its contents in memory,
+    // with any number of workers
+    size_t n = ((size_t)1 << 25) + 100;
+    unsigned char *data = malloc(n);
+    for (size_t k=0; k<n; k++) {
+        data[k] = (unsigned char)(k * 2654435761u >> 11);
+    }
+    FILE *f = fopen("test_parallel_large.bin", "w");
+    fwrite(data, 1, n, f);
+    fclose(f);
+    uint64_t expected = hash_contents(helper, data, n);
+    assert(expected != hash_bytes(data, n));
+    for (int threads=1; threads<=4; threads+=3) {
+        svc->n_threads = threads;
+        assert(hash_file(helper, "test_parallel_large.bin") == expected);
+    }
+    svc->n_threads = 0;
+    remove("test_parallel_large.bin");
+    free(data);
+
+    cleanup(helper);
+    return 0;
+}
+
+/**
+* Measures how the time taken to rehash the index in svc_commit() scales with
+* the number of worker threads, on 50000 small files and on 4 large files.
+*/
+int bench_commit_threads() {
+    char path[64];
+    mkdir("bench_small", S_IRWXU);
+    mkdir("bench_huge", S_IRWXU);
+    for (int i=0; i<50000; i++) {
+        sprintf(path, "bench_small/%d.txt", i);
+        FILE *f = fopen(path, "w");
+        fprintf(f, "small file %d\n", i);
+        fclose(f);
+    }
+    for (int i=0; i<4; i++) {
+        sprintf(path, "bench_huge/%d.bin", i);
+        int fd = open(path, O_RDWR | O_CREAT, 0666);
+        ftruncate(fd, (size_t)1 << 28);
+        char *data = mmap(NULL, (size_t)1 << 28, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        for (size_t j=0; j<((size_t)1 << 28); j+=4096) {
+            data[j] = (char)(i + j);
+        }
+        munmap(data, (size_t)1 << 28);
+        close(fd);
+    }
+
+    char *dirs[] = {"bench_small", "bench_huge"};
+    int counts[] = {50000, 4};
+    char *formats[] = {"bench_small/%d.txt", "bench_huge/%d.bin"};
+    for (int d=0; d<2; d++) {
+        void *helper = svc_init();
+        struct helper *svc = (struct helper *)helper;
+        for (int i=0; i<counts[d]; i++) {
+            sprintf(path, formats[d], i);
+            svc_add(helper, path);
+        }
+        svc_commit(helper, "Benchmark files");
+
+        size_t n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for (size_t n_threads=1; n_threads<=n_cpus; n_threads*=2) {
+            svc->n_threads = n_threads;
+            // Forget the stat data so that every file is rehashed
+            for (size_t i=0; i<svc->index_size; i++) {
+                svc->index[i].mtime = 0;
+            }
+            struct timespec begin;
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            svc_commit(helper, "No changes");
+            printf("%s, %ld threads: %.3f seconds\n", dirs[d], n_threads,
+                   seconds_since(&begin));
+        }
+        cleanup(helper);
+    }
+    return 0;
+}
+
+int bench_commit_arena() {
+    void *helper = svc_init();
+    struct helper *svc = (struct helper *)helper;
+    char path[64];
+    mkdir("bench_arena", S_IRWXU);
+    for (int i=0; i<1000; i++) {
+        sprintf(path, "bench_arena/%d.txt", i);
+        write_numbered(path, "", i);
+        svc_add(helper, path);
+    }
+    svc_commit(helper, "Benchmark files");
+
+    // Each commit changes one file
+    size_t heap_used = svc->heap_used;
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i=1; i<=100000; i++) {
+        sprintf(path, "bench_arena/%d.txt", (i * 7919) % 1000);
+        write_numbered(path, "commit", i);
+        svc_commit(helper, "Changed a file");
+        if (i % 10000 == 0) {
+            printf("%d commits: %.1f MiB, %.0f bytes per commit, %.3f seconds\n", i,
+                   (svc->heap_used - heap_used) / 1048576.0,
+                   (svc->heap_used - heap_used) / (double)i, seconds_since(&begin));
+        }
+    }
+    cleanup(helper);
+    return 0;
+}
+
+int bench_uring_small_files() {
+    void *helper = svc_init();
+    struct helper *svc = (struct helper *)helper;
+    char path[64];
+    char ids[2][7];
+    mkdir("bench_uring", S_IRWXU);
+
+    // Commit and restore 100k small files with each backend
+    for (int pass=0; pass<2; pass++) {
+        svc->use_uring = pass == 0;
+        for (int i=0; i<100000; i++) {
+            sprintf(path, "bench_uring/%d.txt", i);
+            write_numbered(path, pass == 0 ? "uring" : "sync", i);
+            if (pass == 0) {
+                svc_add(helper, path);
+            }
+        }
+        struct timespec begin;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        strcpy(ids[pass], svc_commit(helper, "Small files"));
+        printf("%s commit: %.3f seconds\n", pass == 0 ? "uring" : "sync", seconds_since(&begin));
+    }
+    for (int pass=0; pass<2; pass++) {
+        svc->use_uring = pass == 0;
+        svc_reset(helper, ids[pass]);
+        struct timespec begin;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        svc_reset(helper, ids[1 - pass]);
+        printf("%s restore: %.3f seconds\n", pass == 0 ? "uring" : "sync", seconds_since(&begin));
+    }
+    cleanup(helper);
+    return 0;
+}
+
+int bench_line_diff() {
+    void *helper = svc_init();
+    size_t n_lines = (size_t)1 << 22;
+    char *a = malloc(n_lines * 32);
+    char *b = malloc(n_lines * 32);
+    size_t a_size = write_lines(a, n_lines, 0, NULL);
+
+    // Diff 100MB files with scattered edits
+    size_t steps[] = {0, 100000, 1000, 10};
+    for (int s=0; s<4; s++) {
+        size_t b_size = write_lines(b, n_lines, steps[s], "inserted");
+        size_t mark = scratch_mark(helper);
+        struct diff d;
+        struct timespec begin;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        diff_lines(helper, &d, (unsigned char *)a, a_size, (unsigned char *)b, b_size);
+        printf("%zu lines added: %.3f seconds\n", d.n_added, seconds_since(&begin));
+        scratch_release(helper, mark);
+    }
+    free(a);
+    free(b);
+    cleanup(helper);
+    return 0;
+}
+
 // size_t n_pages = 0;
 // size_t page_size;
 // void *mem = NULL;
@@ -303,6 +1951,35 @@ int main(int argc, char **argv) {
     // e.g.  assert((2 + 3) == 5);
     // test_1();
     // test_add_remove();
+    test_persistence();
+    test_allocator();
+    test_chunked_store();
+    test_copy_engine();
+    test_uring_io();
+    test_compression();
+    test_packfiles();
+    test_delta_packs();
+    test_gc();
+    test_line_diff();
+    test_hash_collisions();
+    test_stat_cache();
+    test_parallel_hash();
+    test_commit_lookup();
+    test_branches();
+    test_index_table();
+    test_path_pool();
+    test_sorted_index();
+    test_three_way_merge();
+    test_scratch_arena();
+    test_incremental_checkout();
+    test_commit_graph();
+    test_file_tree();
+    test_add_tree();
+    // bench_commit_threads();
+    // bench_commit_arena();
+    // bench_hash_file();
+    // bench_uring_small_files();
+    // bench_line_diff();
     test_example1();
     // small();
     // printf("%d\n", PROT_READ);